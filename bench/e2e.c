@@ -0,0 +1,181 @@
+// e2e.c - End-to-end interaction benchmark against local mock servers
+//
+// Starts the mock gateway and REST servers, points a bot at them and measures
+// how fast INTERACTION_CREATE dispatches turn into interaction callback POSTs.
+// Latency runs from the moment the mock writes a dispatch frame to the moment
+// the matching callback request reaches the mock REST server. Every interaction
+// token gets its own rate-limit bucket, so the run also fails if those buckets
+// are still held once the bot has gone idle. The mock asks for frequent
+// heartbeats and the run fails if any client frame was malformed.
+#include "mock.h"
+#include "../discord.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+
+// Buckets the bot may keep once idle: one per route it used, not per interaction
+#define BENCH_MAX_IDLE_BUCKETS 16
+// Short enough for several heartbeats per run, within the 120 sends a minute
+#define BENCH_HEARTBEAT_MS 750
+
+typedef struct {
+    mock_gateway_t *gateway;
+    uint64_t *latency_ns;           // Indexed by interaction id - 1
+    int interactions;
+    atomic_int completed;
+    _Atomic uint64_t last_ns;
+} bench_state_t;
+
+static discord_message_t* bench_command(const discord_interaction_t *ctx) {
+    (void)ctx;
+    return discord_create_message("pong", false);
+}
+
+// Mock REST thread: an interaction callback arrived
+static void bench_on_callback(uint64_t interaction_id, void *userdata) {
+    bench_state_t *state = (bench_state_t *)userdata;
+    uint64_t now = mock_now_ns();
+    uint64_t sent = mock_gateway_sent_ns(state->gateway, interaction_id);
+    if (!sent || state->latency_ns[interaction_id - 1]) return;
+    
+    state->latency_ns[interaction_id - 1] = now - sent;
+    atomic_store(&state->last_ns, now);
+    atomic_fetch_add(&state->completed, 1);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *sorted, int count, double p) {
+    if (count == 0) return 0.0;
+    int index = (int)(p * (count - 1) + 0.5);
+    return (double)sorted[index] / 1000.0;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-n interactions] [-r rate/s, 0 = unpaced] [-w workers] [-t timeout s]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    int interactions = 20000;
+    int rate = 0;
+    int workers = 0;
+    int timeout_s = 60;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:w:t:h")) != -1) {
+        switch (opt) {
+            case 'n': interactions = atoi(optarg); break;
+            case 'r': rate = atoi(optarg); break;
+            case 'w': workers = atoi(optarg); break;
+            case 't': timeout_s = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (interactions <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    
+    bench_state_t state = {0};
+    state.interactions = interactions;
+    state.latency_ns = calloc((size_t)interactions, sizeof(uint64_t));
+    if (!state.latency_ns) return 1;
+    
+    mock_gateway_config_t gateway_config = { 0, interactions, rate, BENCH_HEARTBEAT_MS };
+    state.gateway = mock_gateway_start(&gateway_config);
+    if (!state.gateway) {
+        fprintf(stderr, "Failed to start the mock gateway\n");
+        return 1;
+    }
+    mock_rest_t *rest = mock_rest_start(0, mock_gateway_port(state.gateway), bench_on_callback, &state);
+    if (!rest) {
+        fprintf(stderr, "Failed to start the mock REST server\n");
+        mock_gateway_stop(state.gateway);
+        return 1;
+    }
+    
+    // discord_init already talks to the API, so the base URL comes from the environment
+    char api_base_url[64];
+    snprintf(api_base_url, sizeof(api_base_url), "http://127.0.0.1:%d/api/v10", mock_rest_port(rest));
+    setenv("DISCORD_API_BASE_URL", api_base_url, 1);
+    
+    discord_bot_t *bot = discord_init("bench-token");
+    if (!bot) {
+        fprintf(stderr, "Failed to initialize the bot\n");
+        mock_rest_stop(rest);
+        mock_gateway_stop(state.gateway);
+        return 1;
+    }
+    // An unpaced flood can queue every interaction at once
+    discord_set_worker_pool(bot, workers, interactions);
+    discord_set_defer_threshold(bot, -1);
+    discord_register_slash_command(bot, "bench", "Benchmark command", bench_command);
+    
+    uint64_t start_ns = mock_now_ns();
+    if (!discord_start_bot(bot)) {
+        fprintf(stderr, "Failed to start the bot\n");
+        discord_cleanup(bot);
+        mock_rest_stop(rest);
+        mock_gateway_stop(state.gateway);
+        return 1;
+    }
+    
+    uint64_t deadline = start_ns + (uint64_t)timeout_s * 1000000000ULL;
+    int peak_buckets = 0;
+    discord_ratelimit_global_t ratelimit = {0};
+    while (atomic_load(&state.completed) < interactions && mock_now_ns() < deadline) {
+        usleep(10000);
+        discord_get_ratelimit_stats(bot, NULL, 0, &ratelimit);
+        if (ratelimit.bucket_count > peak_buckets) peak_buckets = ratelimit.bucket_count;
+    }
+    
+    // Give the REST thread time to sweep buckets whose windows have reset
+    sleep(2);
+    discord_get_ratelimit_stats(bot, NULL, 0, &ratelimit);
+    int idle_buckets = ratelimit.bucket_count;
+    
+    discord_cleanup(bot);
+    uint64_t heartbeats = mock_gateway_heartbeats(state.gateway);
+    uint64_t bad_frames = mock_gateway_bad_frames(state.gateway);
+    uint64_t rest_requests = mock_rest_requests(rest);
+    mock_rest_stop(rest);
+    
+    // Collect what completed; the first dispatch marks the start of the run
+    int completed = 0;
+    uint64_t first_sent = mock_gateway_sent_ns(state.gateway, 1);
+    for (int i = 0; i < interactions; i++) {
+        if (state.latency_ns[i]) state.latency_ns[completed++] = state.latency_ns[i];
+    }
+    mock_gateway_stop(state.gateway);
+    qsort(state.latency_ns, (size_t)completed, sizeof(uint64_t), compare_u64);
+    
+    double elapsed_s = completed && first_sent ? (double)(atomic_load(&state.last_ns) - first_sent) / 1e9 : 0.0;
+    printf("interactions: %d/%d completed (%llu REST requests)\n", completed, interactions,
+           (unsigned long long)rest_requests);
+    printf("throughput:   %.0f interactions/s over %.3fs\n", elapsed_s > 0 ? completed / elapsed_s : 0.0, elapsed_s);
+    printf("latency:      p50 %.1fus  p99 %.1fus  p999 %.1fus  max %.1fus\n",
+           percentile_us(state.latency_ns, completed, 0.50), percentile_us(state.latency_ns, completed, 0.99),
+           percentile_us(state.latency_ns, completed, 0.999), percentile_us(state.latency_ns, completed, 1.0));
+    printf("buckets:      peak %d, %d once idle\n", peak_buckets, idle_buckets);
+    printf("heartbeats:   %llu sent, %llu malformed frames\n", (unsigned long long)heartbeats,
+           (unsigned long long)bad_frames);
+    
+    free(state.latency_ns);
+    if (bad_frames > 0 || heartbeats < 2) {
+        fprintf(stderr, "Gateway heartbeats are broken: %llu received, %llu malformed frames\n",
+                (unsigned long long)heartbeats, (unsigned long long)bad_frames);
+        return 1;
+    }
+    if (idle_buckets > BENCH_MAX_IDLE_BUCKETS) {
+        fprintf(stderr, "Rate-limit buckets were not released: %d held after %d interactions\n", idle_buckets, completed);
+        return 1;
+    }
+    return completed == interactions ? 0 : 1;
+}
@@ -0,0 +1,425 @@
+// microbench.c - Timings and allocation counts for the hot paths in discord.c
+//
+// Builds discord.c into this translation unit so static functions can be called
+// directly. Each case is warmed up, then timed over repeated batches; the
+// percentiles are over per-operation batch means. malloc and friends are
+// interposed to count allocations made by the benchmarking thread.
+//
+// Results are written as tab-separated lines (see RESULTS_HEADER). Given a
+// baseline in the same format, any case allocating more per operation, or with
+// a p50 more than the tolerance above its baseline, fails the run.
+#include "../discord.c"
+#include <getopt.h>
+#include <stdarg.h>
+
+#define RESULTS_HEADER "# name\tp50_ns\tp90_ns\tp99_ns\tallocs_per_op\tbytes_per_op\n"
+#define MICROBENCH_MAX_CASES 64
+#define MICROBENCH_BATCH_NS 20000   // Target length of one timed batch
+
+// Interposed allocator. glibc routes its own internal allocations through these
+// too, so counts include what jansson and libc allocate on our behalf.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static _Thread_local uint64_t alloc_count;
+static _Thread_local uint64_t alloc_bytes;
+
+void *malloc(size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    alloc_count++;
+    alloc_bytes += count * size;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    alloc_count++;
+    alloc_bytes += size;
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size) {
+    void *ptr = memalign(alignment, size);
+    if (!ptr) return ENOMEM;
+    *out = ptr;
+    return 0;
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+
+typedef void (*microbench_fn_t)(void *state);
+
+typedef struct {
+    char name[64];
+    microbench_fn_t fn;
+    void *state;
+} microbench_case_t;
+
+typedef struct {
+    char name[64];
+    double p50_ns;
+    double p90_ns;
+    double p99_ns;
+    double allocs_per_op;
+    double bytes_per_op;
+} microbench_result_t;
+
+static microbench_case_t cases[MICROBENCH_MAX_CASES];
+static int case_count;
+
+static void add_case(microbench_fn_t fn, void *state, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+static void add_case(microbench_fn_t fn, void *state, const char *format, ...) {
+    if (case_count == MICROBENCH_MAX_CASES) return;
+    microbench_case_t *c = &cases[case_count++];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(c->name, sizeof(c->name), format, args);
+    va_end(args);
+    c->fn = fn;
+    c->state = state;
+}
+
+// Message payloads
+typedef struct {
+    discord_message_t *message;
+} payload_state_t;
+
+static void bench_payload(void *arg) {
+    payload_state_t *state = (payload_state_t *)arg;
+    json_buf_t payload;
+    payload_buf_acquire(&payload);
+    build_message_payload(&payload, state->message);
+    payload_buf_release(&payload);
+}
+
+// Command lookup over a bot with count registered commands, cycling through them
+typedef struct {
+    discord_bot_t bot;
+    char (*names)[32];
+    size_t *name_lens;
+    int count;
+    int next;
+    bool by_id;
+} lookup_state_t;
+
+static discord_message_t* noop_command(const discord_interaction_t *ctx) {
+    (void)ctx;
+    return NULL;
+}
+
+static lookup_state_t *lookup_state_new(int count, bool by_id) {
+    lookup_state_t *state = calloc(1, sizeof(lookup_state_t));
+    pthread_mutex_init(&state->bot.command_mutex, NULL);
+    state->names = calloc((size_t)count, sizeof(*state->names));
+    state->name_lens = calloc((size_t)count, sizeof(size_t));
+    state->count = count;
+    state->by_id = by_id;
+    for (int i = 0; i < count; i++) {
+        snprintf(state->names[i], sizeof(state->names[i]), "command-%d", i);
+        state->name_lens[i] = strlen(state->names[i]);
+        command_add(&state->bot, state->names[i], "Benchmark command", noop_command, NULL);
+        state->bot.commands[i]->id = 1100000000000000000ULL + (uint64_t)i * 7919;
+    }
+    command_index_build(&state->bot);
+    return state;
+}
+
+static void bench_lookup(void *arg) {
+    lookup_state_t *state = (lookup_state_t *)arg;
+    int i = state->next;
+    state->next = i + 1 == state->count ? 0 : i + 1;
+    
+    slash_command_t *cmd = state->by_id
+        ? command_lookup(&state->bot, state->bot.commands[i]->id, NULL, 0)
+        : command_lookup(&state->bot, 0, state->names[i], state->name_lens[i]);
+    if (!cmd) abort();
+}
+
+// Frame decoding: the work gateway_handle_message does before acting on a frame
+typedef struct {
+    char *frame;
+    size_t len;
+    discord_od_doc_t *doc;
+} frame_state_t;
+
+static void bench_decode_ondemand(void *arg) {
+    frame_state_t *state = (frame_state_t *)arg;
+    discord_od_doc_t *doc = state->doc;
+    if (!od_parse(doc, state->frame, state->len)) abort();
+    
+    od_value_t root = od_root(doc);
+    int64_t op, seq;
+    od_get_int(doc, od_object_get(doc, root, "op", 2), &op);
+    od_get_int(doc, od_object_get(doc, root, "s", 1), &seq);
+}
+
+static void bench_decode_jansson(void *arg) {
+    frame_state_t *state = (frame_state_t *)arg;
+    json_error_t error;
+    json_t *root = json_loadb(state->frame, state->len, 0, &error);
+    if (!root) abort();
+    
+    json_integer_value(json_object_get(root, "op"));
+    json_integer_value(json_object_get(root, "s"));
+    json_decref(root);
+}
+
+static void bench_prescan(void *arg) {
+    frame_state_t *state = (frame_state_t *)arg;
+    gateway_frame_head_t head;
+    if (!gateway_prescan(state->frame, state->len, &head)) abort();
+}
+
+// INTERACTION_CREATE with resolved users appended until it reaches about size bytes
+static char *interaction_frame(size_t size) {
+    size_t cap = size + 4096;
+    char *frame = malloc(cap);
+    int len = snprintf(frame, cap,
+        "{\"t\":\"INTERACTION_CREATE\",\"s\":42,\"op\":0,\"d\":{"
+        "\"version\":1,\"type\":2,\"token\":\"aW50ZXJhY3Rpb246MTIzNDU2Nzg5MDEyMzQ1Njc4OmJlbmNo\",\"locale\":\"en-US\","
+        "\"member\":{\"user\":{\"username\":\"bench\",\"public_flags\":0,\"id\":\"400000000000000001\","
+        "\"global_name\":\"Bench\",\"discriminator\":\"0\",\"avatar\":null},\"roles\":[],"
+        "\"premium_since\":null,\"permissions\":\"2248473465835073\",\"pending\":false,\"nick\":null,"
+        "\"mute\":false,\"joined_at\":\"2024-01-01T00:00:00.000000+00:00\",\"flags\":0,\"deaf\":false,"
+        "\"avatar\":null},\"id\":\"1200000000000000001\",\"guild_locale\":\"en-US\",\"guild_id\":\"300000000000000001\","
+        "\"entitlements\":[],\"channel_id\":\"200000000000000001\",\"app_permissions\":\"2248473465835073\","
+        "\"application_id\":\"100000000000000001\",\"data\":{\"type\":1,\"name\":\"bench\","
+        "\"id\":\"500000000000000001\",\"options\":[{\"type\":6,\"name\":\"user\",\"value\":\"400000000000000002\"},"
+        "{\"type\":3,\"name\":\"reason\",\"value\":\"micro \\\"benchmark\\\" \\u00e9t\\u00e9\"}],\"resolved\":{\"users\":{");
+    for (int i = 0; (size_t)len + 256 < size; i++) {
+        len += snprintf(frame + len, cap - (size_t)len,
+            "%s\"4%017d\":{\"username\":\"user%d\",\"public_flags\":0,\"id\":\"4%017d\",\"global_name\":null,"
+            "\"discriminator\":\"0\",\"avatar\":\"0123456789abcdef0123456789abcdef\"}",
+            i ? "," : "", i, i, i);
+    }
+    snprintf(frame + len, cap - (size_t)len, "}}}}}");
+    return frame;
+}
+
+static void add_frame_cases(const char *label, char *frame) {
+    frame_state_t *ondemand = calloc(1, sizeof(frame_state_t));
+    ondemand->frame = frame;
+    ondemand->len = strlen(frame);
+    ondemand->doc = od_doc_new();
+    add_case(bench_decode_ondemand, ondemand, "decode/ondemand/%s", label);
+    
+    frame_state_t *jansson = calloc(1, sizeof(frame_state_t));
+    *jansson = *ondemand;
+    jansson->doc = NULL;
+    add_case(bench_decode_jansson, jansson, "decode/jansson/%s", label);
+}
+
+static void register_cases(void) {
+    payload_state_t *content = calloc(1, sizeof(payload_state_t));
+    content->message = discord_create_message("Pong! Gateway latency is 42ms and every shard is connected.", false);
+    add_case(bench_payload, content, "payload/content");
+    
+    payload_state_t *embed = calloc(1, sizeof(payload_state_t));
+    embed->message = discord_create_message("Server status", false);
+    discord_embed_t *e = discord_create_embed("Status \"report\"", "All systems operational.\nLatency: 42ms", 0x5865f2);
+    discord_set_embed_footer(e, "Requested by bench");
+    discord_set_embed_footer_url(e, "https://cdn.discordapp.com/embed/avatars/0.png");
+    discord_set_embed_thumbnail(e, "https://cdn.discordapp.com/embed/avatars/1.png");
+    discord_set_embed_timestamp(e, 1700000000);
+    discord_message_set_embed(embed->message, e);
+    add_case(bench_payload, embed, "payload/embed");
+    
+    static const int command_counts[] = { 10, 200, 2000 };
+    for (size_t i = 0; i < sizeof(command_counts) / sizeof(command_counts[0]); i++) {
+        add_case(bench_lookup, lookup_state_new(command_counts[i], false), "command_lookup/name/%d", command_counts[i]);
+        add_case(bench_lookup, lookup_state_new(command_counts[i], true), "command_lookup/id/%d", command_counts[i]);
+    }
+    
+    add_frame_cases("hello", strdup("{\"t\":null,\"s\":null,\"op\":10,\"d\":{\"heartbeat_interval\":41250,"
+                                    "\"_trace\":[\"[\\\"gateway-prd-us-east1-b-0568\\\",{\\\"micros\\\":0.0}]\"]}}"));
+    add_frame_cases("heartbeat_ack", strdup("{\"t\":null,\"s\":null,\"op\":11,\"d\":null}"));
+    add_frame_cases("interaction_1k", interaction_frame(1024));
+    add_frame_cases("interaction_8k", interaction_frame(8 * 1024));
+    add_frame_cases("interaction_64k", interaction_frame(64 * 1024));
+    
+    frame_state_t *dropped = calloc(1, sizeof(frame_state_t));
+    dropped->frame = strdup("{\"t\":\"TYPING_START\",\"s\":1234,\"op\":0,\"d\":{\"user_id\":\"400000000000000001\","
+                            "\"timestamp\":1700000000,\"channel_id\":\"200000000000000001\",\"guild_id\":\"300000000000000001\"}}");
+    dropped->len = strlen(dropped->frame);
+    add_case(bench_prescan, dropped, "decode/prescan/typing_start");
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_case(const microbench_case_t *c, int warmup, int reps, microbench_result_t *result) {
+    // Warm up, and size batches so each takes about MICROBENCH_BATCH_NS
+    uint64_t start = monotonic_ns();
+    for (int i = 0; i < warmup; i++) c->fn(c->state);
+    double warm_ns = (double)(monotonic_ns() - start) / (warmup > 0 ? warmup : 1);
+    int batch = warm_ns > 0 ? (int)(MICROBENCH_BATCH_NS / warm_ns) : 1000;
+    if (batch < 1) batch = 1;
+    
+    double *samples = __libc_malloc((size_t)reps * sizeof(double));
+    uint64_t allocs_before = alloc_count, bytes_before = alloc_bytes;
+    for (int r = 0; r < reps; r++) {
+        start = monotonic_ns();
+        for (int i = 0; i < batch; i++) c->fn(c->state);
+        samples[r] = (double)(monotonic_ns() - start) / batch;
+    }
+    double ops = (double)reps * batch;
+    
+    qsort(samples, (size_t)reps, sizeof(double), compare_double);
+    memcpy(result->name, c->name, sizeof(result->name));
+    result->p50_ns = samples[(int)(0.50 * (reps - 1) + 0.5)];
+    result->p90_ns = samples[(int)(0.90 * (reps - 1) + 0.5)];
+    result->p99_ns = samples[(int)(0.99 * (reps - 1) + 0.5)];
+    result->allocs_per_op = (double)(alloc_count - allocs_before) / ops;
+    result->bytes_per_op = (double)(alloc_bytes - bytes_before) / ops;
+    __libc_free(samples);
+}
+
+// Read a results file; returns the number of entries, or -1 if it can't be opened
+static int load_results(const char *path, microbench_result_t *results, int max) {
+    FILE *file = fopen(path, "r");
+    if (!file) return -1;
+    
+    char line[256];
+    int count = 0;
+    while (count < max && fgets(line, sizeof(line), file)) {
+        if (line[0] == '#') continue;
+        microbench_result_t *r = &results[count];
+        if (sscanf(line, "%63s %lf %lf %lf %lf %lf", r->name, &r->p50_ns, &r->p90_ns, &r->p99_ns,
+                   &r->allocs_per_op, &r->bytes_per_op) == 6) {
+            count++;
+        }
+    }
+    fclose(file);
+    return count;
+}
+
+static int save_results(const char *path, const microbench_result_t *results, int count) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Failed to write %s\n", path);
+        return 0;
+    }
+    fputs(RESULTS_HEADER, file);
+    for (int i = 0; i < count; i++) {
+        const microbench_result_t *r = &results[i];
+        fprintf(file, "%s\t%.1f\t%.1f\t%.1f\t%.3f\t%.1f\n", r->name, r->p50_ns, r->p90_ns, r->p99_ns,
+                r->allocs_per_op, r->bytes_per_op);
+    }
+    return fclose(file) == 0;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [-w warmup] [-r reps] [-f filter] [-o results] [-b baseline] [-t tolerance] [-u]\n"
+            "  -f  run only cases whose name contains filter\n"
+            "  -t  allowed p50 slowdown against the baseline, as a fraction (default 0.25)\n"
+            "  -u  write the results to the baseline instead of comparing\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    int warmup = 2000;
+    int reps = 200;
+    double tolerance = 0.25;
+    const char *filter = NULL;
+    const char *output = NULL;
+    const char *baseline = NULL;
+    bool update = false;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "w:r:f:o:b:t:uh")) != -1) {
+        switch (opt) {
+            case 'w': warmup = atoi(optarg); break;
+            case 'r': reps = atoi(optarg); break;
+            case 'f': filter = optarg; break;
+            case 'o': output = optarg; break;
+            case 'b': baseline = optarg; break;
+            case 't': tolerance = atof(optarg); break;
+            case 'u': update = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (reps <= 0 || warmup < 0 || (update && !baseline)) {
+        usage(argv[0]);
+        return 2;
+    }
+    
+    register_cases();
+    
+    microbench_result_t results[MICROBENCH_MAX_CASES];
+    int count = 0;
+    printf("%-32s %10s %10s %10s %10s %10s\n", "case", "p50 ns", "p90 ns", "p99 ns", "allocs/op", "bytes/op");
+    for (int i = 0; i < case_count; i++) {
+        if (filter && !strstr(cases[i].name, filter)) continue;
+        microbench_result_t *r = &results[count++];
+        run_case(&cases[i], warmup, reps, r);
+        printf("%-32s %10.1f %10.1f %10.1f %10.3f %10.1f\n", r->name, r->p50_ns, r->p90_ns, r->p99_ns,
+               r->allocs_per_op, r->bytes_per_op);
+    }
+    
+    if (output && !save_results(output, results, count)) return 1;
+    if (!baseline) return 0;
+    if (update) {
+        if (!save_results(baseline, results, count)) return 1;
+        printf("Baseline written to %s\n", baseline);
+        return 0;
+    }
+    
+    microbench_result_t base[MICROBENCH_MAX_CASES];
+    int base_count = load_results(baseline, base, MICROBENCH_MAX_CASES);
+    if (base_count < 0) {
+        // First run on this machine: nothing to compare against yet
+        printf("No baseline at %s; writing one\n", baseline);
+        return save_results(baseline, results, count) ? 0 : 1;
+    }
+    
+    int regressions = 0;
+    for (int i = 0; i < count; i++) {
+        const microbench_result_t *r = &results[i];
+        for (int j = 0; j < base_count; j++) {
+            if (strcmp(r->name, base[j].name) != 0) continue;
+    
+            // Allocation counts are deterministic; latency gets the tolerance
+            if (r->allocs_per_op > base[j].allocs_per_op + 0.005) {
+                printf("REGRESSION %s: %.3f allocs/op, baseline %.3f\n", r->name, r->allocs_per_op, base[j].allocs_per_op);
+                regressions++;
+            }
+            if (r->p50_ns > base[j].p50_ns * (1.0 + tolerance) && r->p50_ns - base[j].p50_ns > 5.0) {
+                printf("REGRESSION %s: p50 %.1fns, baseline %.1fns (%+.0f%%)\n", r->name, r->p50_ns, base[j].p50_ns,
+                       (r->p50_ns / base[j].p50_ns - 1.0) * 100.0);
+                regressions++;
+            }
+            break;
+        }
+    }
+    
+    if (regressions) {
+        printf("%d regression%s against %s\n", regressions, regressions == 1 ? "" : "s", baseline);
+        return 1;
+    }
+    printf("No regressions against %s\n", baseline);
+    return 0;
+}
@@ -0,0 +1,50 @@
+// mock.h - Local stand-ins for the Discord gateway and REST API, for benchmarks
+#ifndef DISCORD_BENCH_MOCK_H
+#define DISCORD_BENCH_MOCK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Nanoseconds on the monotonic clock
+uint64_t mock_now_ns(void);
+
+// Gateway mock: a libwebsockets server speaking enough of the gateway protocol
+// for a bot to connect (HELLO, heartbeat ACKs, READY), then dispatching a flood
+// of INTERACTION_CREATE for the "bench" command once the bot identifies. Like
+// Discord, it closes a connection (4002) on any frame that isn't valid JSON.
+typedef struct mock_gateway mock_gateway_t;
+
+typedef struct {
+    int port;                   // 0 picks a free port
+    int interactions;           // Number of INTERACTION_CREATE frames to send
+    int rate;                   // Frames per second, 0 = as fast as the socket drains
+    int heartbeat_interval;     // Sent in HELLO, ms; 0 = Discord's 41250
+} mock_gateway_config_t;
+
+mock_gateway_t *mock_gateway_start(const mock_gateway_config_t *config);
+void mock_gateway_stop(mock_gateway_t *gateway);
+int mock_gateway_port(const mock_gateway_t *gateway);
+
+// Heartbeats received, and client frames rejected as malformed (heartbeats included)
+uint64_t mock_gateway_heartbeats(const mock_gateway_t *gateway);
+uint64_t mock_gateway_bad_frames(const mock_gateway_t *gateway);
+
+// Dispatch time of interaction id (ids run from 1 to interactions), 0 if not yet sent
+uint64_t mock_gateway_sent_ns(const mock_gateway_t *gateway, uint64_t id);
+
+// REST mock: a small HTTP/1.1 server with keep-alive that answers the calls a
+// bot makes at startup and accepts interaction callbacks and webhook edits.
+typedef struct mock_rest mock_rest_t;
+
+// Called on the server thread for every POST /interactions/{id}/{token}/callback
+typedef void (*mock_rest_callback_t)(uint64_t interaction_id, void *userdata);
+
+mock_rest_t *mock_rest_start(int port, int gateway_port, mock_rest_callback_t callback, void *userdata);
+void mock_rest_stop(mock_rest_t *rest);
+int mock_rest_port(const mock_rest_t *rest);
+uint64_t mock_rest_requests(const mock_rest_t *rest);
+
+#endif
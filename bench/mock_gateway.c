@@ -0,0 +1,300 @@
+// mock_gateway.c - Local gateway server for benchmarks
+#include "mock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libwebsockets.h>
+#include <jansson.h>
+
+#define MOCK_APPLICATION_ID "100000000000000001"
+#define MOCK_COMMAND_ID "500000000000000001"
+
+struct mock_gateway {
+    mock_gateway_config_t config;
+    struct lws_context *context;
+    struct lws_vhost *vhost;
+    int port;
+    pthread_t thread;
+    bool thread_started;
+    atomic_bool stop;
+    atomic_bool flood_claimed;      // Only the first session that identifies gets the flood
+    _Atomic uint64_t *sent_ns;      // Dispatch time per interaction
+    _Atomic uint64_t heartbeats;
+    _Atomic uint64_t bad_frames;
+};
+
+// Per-connection state
+typedef struct {
+    struct lws *wsi;
+    mock_gateway_t *gateway;
+    lws_sorted_usec_list_t sul_pace;
+    bool hello_due;
+    bool ack_due;
+    bool ready_due;
+    bool resumed_due;
+    bool flooding;
+    int next;                       // Interactions sent so far
+    int64_t seq;
+    uint64_t flood_start_ns;
+    char *rx;
+    size_t rx_len;
+    size_t rx_cap;
+} mock_session_t;
+
+uint64_t mock_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void mock_pace_cb(lws_sorted_usec_list_t *sul) {
+    mock_session_t *session = lws_container_of(sul, mock_session_t, sul_pace);
+    lws_callback_on_writable(session->wsi);
+}
+
+// Opcode of a client frame, -1 if Discord would reject it: not a JSON object
+// with an integer op, or a heartbeat whose d isn't the sequence or null
+static int mock_frame_op(const char *frame, size_t len) {
+    json_error_t error;
+    json_t *root = json_loadb(frame, len, 0, &error);
+    json_t *op = json_object_get(root, "op");
+    int opcode = json_is_integer(op) ? (int)json_integer_value(op) : -1;
+    if (opcode == 1) {
+        json_t *d = json_object_get(root, "d");
+        if (!json_is_integer(d) && !json_is_null(d)) opcode = -1;
+    }
+    json_decref(root);
+    return opcode;
+}
+
+// Returns -1 to drop the connection
+static int mock_receive(mock_session_t *session, const char *in, size_t len, bool final) {
+    if (session->rx_len + len + 1 > session->rx_cap) {
+        size_t cap = session->rx_cap ? session->rx_cap * 2 : 4096;
+        while (cap < session->rx_len + len + 1) cap *= 2;
+        char *rx = realloc(session->rx, cap);
+        if (!rx) return -1;
+        session->rx = rx;
+        session->rx_cap = cap;
+    }
+    memcpy(session->rx + session->rx_len, in, len);
+    session->rx_len += len;
+    if (!final) return 0;
+    
+    session->rx[session->rx_len] = '\0';
+    int op = mock_frame_op(session->rx, session->rx_len);
+    session->rx_len = 0;
+    switch (op) {
+        case -1:
+            fprintf(stderr, "Mock gateway: malformed client frame, closing with 4002\n");
+            atomic_fetch_add(&session->gateway->bad_frames, 1);
+            lws_close_reason(session->wsi, (enum lws_close_status)4002, (unsigned char *)"Error while decoding payload", 28);
+            return -1;
+        case 1:     // HEARTBEAT
+            atomic_fetch_add(&session->gateway->heartbeats, 1);
+            session->ack_due = true;
+            break;
+        case 2:     // IDENTIFY
+            session->ready_due = true;
+            break;
+        case 6:     // RESUME
+            session->resumed_due = true;
+            break;
+        default:
+            break;
+    }
+    lws_callback_on_writable(session->wsi);
+    return 0;
+}
+
+static int mock_frame_interaction(mock_session_t *session, char *out, size_t size, int id) {
+    return snprintf(out, size,
+        "{\"t\":\"INTERACTION_CREATE\",\"s\":%lld,\"op\":0,\"d\":{"
+        "\"version\":1,\"type\":2,\"token\":\"bench-token-%d\",\"locale\":\"en-US\","
+        "\"member\":{\"user\":{\"username\":\"bench\",\"public_flags\":0,\"id\":\"400000000000000001\","
+        "\"global_name\":\"Bench\",\"discriminator\":\"0\",\"avatar\":null},\"roles\":[],"
+        "\"premium_since\":null,\"permissions\":\"2248473465835073\",\"pending\":false,\"nick\":null,"
+        "\"mute\":false,\"joined_at\":\"2024-01-01T00:00:00.000000+00:00\",\"flags\":0,\"deaf\":false,"
+        "\"avatar\":null},\"id\":\"%d\",\"guild_locale\":\"en-US\",\"guild_id\":\"300000000000000001\","
+        "\"entitlements\":[],\"data\":{\"type\":1,\"name\":\"bench\",\"id\":\"" MOCK_COMMAND_ID "\"},"
+        "\"channel_id\":\"200000000000000001\",\"app_permissions\":\"2248473465835073\","
+        "\"application_id\":\"" MOCK_APPLICATION_ID "\"}}",
+        (long long)++session->seq, id, id);
+}
+
+// Write the next pending frame. Returns 1 if anything is left to send.
+static int mock_writeable(mock_session_t *session) {
+    mock_gateway_t *gateway = session->gateway;
+    unsigned char buf[LWS_PRE + 4096];
+    char *frame = (char *)buf + LWS_PRE;
+    size_t size = sizeof(buf) - LWS_PRE;
+    int len = 0;
+    
+    if (session->hello_due) {
+        session->hello_due = false;
+        int interval = gateway->config.heartbeat_interval > 0 ? gateway->config.heartbeat_interval : 41250;
+        len = snprintf(frame, size, "{\"t\":null,\"s\":null,\"op\":10,\"d\":{\"heartbeat_interval\":%d}}", interval);
+    } else if (session->ack_due) {
+        session->ack_due = false;
+        len = snprintf(frame, size, "{\"op\":11}");
+    } else if (session->ready_due) {
+        session->ready_due = false;
+        len = snprintf(frame, size,
+            "{\"t\":\"READY\",\"s\":%lld,\"op\":0,\"d\":{\"v\":10,\"user\":{\"id\":\"" MOCK_APPLICATION_ID "\","
+            "\"username\":\"bench\",\"bot\":true},\"guilds\":[],\"session_id\":\"bench-session\","
+            "\"resume_gateway_url\":\"ws://127.0.0.1:%d\",\"application\":{\"id\":\"" MOCK_APPLICATION_ID "\","
+            "\"flags\":0}}}", (long long)++session->seq, gateway->port);
+    
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&gateway->flood_claimed, &expected, true)) {
+            session->flooding = true;
+            session->flood_start_ns = mock_now_ns();
+        }
+    } else if (session->resumed_due) {
+        session->resumed_due = false;
+        len = snprintf(frame, size, "{\"t\":\"RESUMED\",\"s\":%lld,\"op\":0,\"d\":{}}", (long long)++session->seq);
+    } else if (session->flooding && session->next < gateway->config.interactions) {
+        uint64_t now = mock_now_ns();
+        if (gateway->config.rate > 0) {
+            uint64_t due = session->flood_start_ns + (uint64_t)session->next * 1000000000ULL / (uint64_t)gateway->config.rate;
+            if (now < due) {
+                lws_sul_schedule(gateway->context, 0, &session->sul_pace, mock_pace_cb, (lws_usec_t)((due - now) / 1000));
+                return 0;
+            }
+        }
+    
+        int id = ++session->next;
+        len = mock_frame_interaction(session, frame, size, id);
+        atomic_store_explicit(&gateway->sent_ns[id - 1], now, memory_order_release);
+    } else {
+        return 0;
+    }
+    
+    if (len <= 0 || (size_t)len >= size || lws_write(session->wsi, (unsigned char *)frame, (size_t)len, LWS_WRITE_TEXT) < len) {
+        return -1;
+    }
+    
+    return session->hello_due || session->ack_due || session->ready_due || session->resumed_due ||
+           (session->flooding && session->next < gateway->config.interactions);
+}
+
+static int mock_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+    mock_session_t *session = (mock_session_t *)user;
+    
+    switch (reason) {
+        case LWS_CALLBACK_ESTABLISHED:
+            memset(session, 0, sizeof(mock_session_t));
+            session->wsi = wsi;
+            session->gateway = (mock_gateway_t *)lws_context_user(lws_get_context(wsi));
+            session->hello_due = true;
+            lws_callback_on_writable(wsi);
+            break;
+        case LWS_CALLBACK_RECEIVE:
+            if (mock_receive(session, (const char *)in, len,
+                             lws_is_final_fragment(wsi) && !lws_remaining_packet_payload(wsi)) < 0) {
+                return -1;
+            }
+            break;
+        case LWS_CALLBACK_SERVER_WRITEABLE: {
+            int more = mock_writeable(session);
+            if (more < 0) return -1;
+            if (more) lws_callback_on_writable(wsi);
+            break;
+        }
+        case LWS_CALLBACK_CLOSED:
+            lws_sul_cancel(&session->sul_pace);
+            free(session->rx);
+            session->rx = NULL;
+            break;
+        default:
+            return lws_callback_http_dummy(wsi, reason, user, in, len);
+    }
+    return 0;
+}
+
+static const struct lws_protocols mock_protocols[] = {
+    { "discord-gateway", mock_callback, sizeof(mock_session_t), 65536, 0, NULL, 0 },
+    LWS_PROTOCOL_LIST_TERM
+};
+
+static void* mock_gateway_thread(void *arg) {
+    mock_gateway_t *gateway = (mock_gateway_t *)arg;
+    
+    while (!atomic_load(&gateway->stop)) {
+        lws_service(gateway->context, 0);
+    }
+    return NULL;
+}
+
+mock_gateway_t *mock_gateway_start(const mock_gateway_config_t *config) {
+    mock_gateway_t *gateway = calloc(1, sizeof(mock_gateway_t));
+    if (!gateway) return NULL;
+    
+    gateway->config = *config;
+    gateway->sent_ns = calloc(config->interactions > 0 ? (size_t)config->interactions : 1, sizeof(uint64_t));
+    if (!gateway->sent_ns) {
+        free(gateway);
+        return NULL;
+    }
+    
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.options = LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
+    info.user = gateway;
+    gateway->context = lws_create_context(&info);
+    if (!gateway->context) {
+        mock_gateway_stop(gateway);
+        return NULL;
+    }
+    
+    info.port = config->port;
+    info.iface = "127.0.0.1";
+    info.protocols = mock_protocols;
+    info.vhost_name = "mock-gateway";
+    gateway->vhost = lws_create_vhost(gateway->context, &info);
+    if (!gateway->vhost) {
+        mock_gateway_stop(gateway);
+        return NULL;
+    }
+    gateway->port = lws_get_vhost_listen_port(gateway->vhost);
+    
+    if (pthread_create(&gateway->thread, NULL, mock_gateway_thread, gateway) != 0) {
+        mock_gateway_stop(gateway);
+        return NULL;
+    }
+    gateway->thread_started = true;
+    return gateway;
+}
+
+void mock_gateway_stop(mock_gateway_t *gateway) {
+    if (!gateway) return;
+    
+    if (gateway->thread_started) {
+        atomic_store(&gateway->stop, true);
+        lws_cancel_service(gateway->context);
+        pthread_join(gateway->thread, NULL);
+    }
+    if (gateway->context) {
+        lws_context_destroy(gateway->context);
+    }
+    free(gateway->sent_ns);
+    free(gateway);
+}
+
+int mock_gateway_port(const mock_gateway_t *gateway) {
+    return gateway->port;
+}
+
+uint64_t mock_gateway_sent_ns(const mock_gateway_t *gateway, uint64_t id) {
+    if (id == 0 || id > (uint64_t)gateway->config.interactions) return 0;
+    return atomic_load_explicit(&gateway->sent_ns[id - 1], memory_order_acquire);
+}
+
+uint64_t mock_gateway_heartbeats(const mock_gateway_t *gateway) {
+    return atomic_load(&gateway->heartbeats);
+}
+
+uint64_t mock_gateway_bad_frames(const mock_gateway_t *gateway) {
+    return atomic_load(&gateway->bad_frames);
+}
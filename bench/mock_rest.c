@@ -0,0 +1,234 @@
+// mock_rest.c - Local REST API stub for benchmarks
+#include "mock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MOCK_REST_MAX_CLIENTS 1024   // curl opens a connection per concurrent request
+#define MOCK_REST_BUFFER (64 * 1024)
+
+// Discord rate-limits each interaction token on its own, so a flood of
+// callbacks leaves the bot with one bucket per interaction to clean up
+#define MOCK_INTERACTION_RATELIMIT "X-RateLimit-Bucket: 6c6f6e67706f6c6c\r\nX-RateLimit-Limit: 5\r\n" \
+                                   "X-RateLimit-Remaining: 4\r\nX-RateLimit-Reset-After: 0.100\r\n"
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+} mock_client_t;
+
+struct mock_rest {
+    int listen_fd;
+    int port;
+    int gateway_port;
+    mock_rest_callback_t callback;
+    void *userdata;
+    pthread_t thread;
+    bool thread_started;
+    atomic_bool stop;
+    _Atomic uint64_t requests;
+    mock_client_t clients[MOCK_REST_MAX_CLIENTS];
+};
+
+// headers holds extra header lines, each ending in \r\n
+static void mock_rest_respond(int fd, int status, const char *reason, const char *headers, const char *body) {
+    char response[1024];
+    size_t body_len = body ? strlen(body) : 0;
+    int len = snprintf(response, sizeof(response),
+                       "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\n%sContent-Length: %zu\r\n\r\n%s",
+                       status, reason, headers ? headers : "", body_len, body ? body : "");
+    if (len <= 0 || (size_t)len >= sizeof(response)) return;
+    
+    size_t sent = 0;
+    while (sent < (size_t)len) {
+        ssize_t n = send(fd, response + sent, (size_t)len - sent, MSG_NOSIGNAL);
+        if (n <= 0) return;
+        sent += (size_t)n;
+    }
+}
+
+// Answer one request. path excludes the "/api/vN" prefix.
+static void mock_rest_route(mock_rest_t *rest, int fd, const char *method, const char *path) {
+    atomic_fetch_add_explicit(&rest->requests, 1, memory_order_relaxed);
+    
+    if (strcmp(path, "/applications/@me") == 0) {
+        mock_rest_respond(fd, 200, "OK", NULL, "{\"id\":\"100000000000000001\",\"name\":\"bench\"}");
+    } else if (strcmp(path, "/gateway/bot") == 0) {
+        char body[256];
+        snprintf(body, sizeof(body),
+                 "{\"url\":\"ws://127.0.0.1:%d\",\"shards\":1,\"session_start_limit\":"
+                 "{\"total\":1000,\"remaining\":1000,\"reset_after\":0,\"max_concurrency\":1}}", rest->gateway_port);
+        mock_rest_respond(fd, 200, "OK", NULL, body);
+    } else if (strncmp(path, "/interactions/", 14) == 0 && strcmp(method, "POST") == 0) {
+        uint64_t id = strtoull(path + 14, NULL, 10);
+        if (rest->callback) rest->callback(id, rest->userdata);
+        mock_rest_respond(fd, 204, "No Content", MOCK_INTERACTION_RATELIMIT, NULL);
+    } else if (strstr(path, "/commands")) {
+        mock_rest_respond(fd, 200, "OK", NULL, "[]");
+    } else if (strncmp(path, "/webhooks/", 10) == 0 || strncmp(path, "/channels/", 10) == 0) {
+        mock_rest_respond(fd, strcmp(method, "DELETE") == 0 ? 204 : 200, "OK", NULL, strcmp(method, "DELETE") == 0 ? NULL : "{}");
+    } else {
+        mock_rest_respond(fd, 404, "Not Found", NULL, "{\"message\":\"404: Not Found\",\"code\":0}");
+    }
+}
+
+// Serve every complete request in the client's buffer (requests may be pipelined)
+static int mock_rest_process(mock_rest_t *rest, mock_client_t *client) {
+    size_t offset = 0;
+    
+    for (;;) {
+        char *start = client->buf + offset;
+        size_t avail = client->len - offset;
+        char *header_end = memmem(start, avail, "\r\n\r\n", 4);
+        if (!header_end) break;
+    
+        size_t header_len = (size_t)(header_end - start) + 4;
+        size_t content_length = 0;
+        for (char *line = strstr(start, "\r\n"); line && line < header_end; line = strstr(line + 2, "\r\n")) {
+            if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+                content_length = strtoul(line + 17, NULL, 10);
+            }
+        }
+        if (avail < header_len + content_length) break;
+    
+        char method[8] = "", target[512] = "";
+        *header_end = '\0';
+        if (sscanf(start, "%7s %511s", method, target) != 2) return 0;
+    
+        const char *path = target;
+        if (strncmp(path, "/api/v", 6) == 0) {
+            path = strchr(path + 6, '/');
+            if (!path) path = "/";
+        }
+        mock_rest_route(rest, client->fd, method, path);
+        offset += header_len + content_length;
+    }
+    
+    memmove(client->buf, client->buf + offset, client->len - offset);
+    client->len -= offset;
+    return client->len < MOCK_REST_BUFFER - 1;
+}
+
+static void mock_rest_close(mock_client_t *client) {
+    close(client->fd);
+    free(client->buf);
+    client->fd = -1;
+    client->buf = NULL;
+    client->len = 0;
+}
+
+static void* mock_rest_thread(void *arg) {
+    mock_rest_t *rest = (mock_rest_t *)arg;
+    struct pollfd fds[MOCK_REST_MAX_CLIENTS + 1];
+    
+    while (!atomic_load(&rest->stop)) {
+        fds[0] = (struct pollfd){ rest->listen_fd, POLLIN, 0 };
+        for (int i = 0; i < MOCK_REST_MAX_CLIENTS; i++) {
+            fds[i + 1] = (struct pollfd){ rest->clients[i].fd, POLLIN, 0 };
+        }
+        if (poll(fds, MOCK_REST_MAX_CLIENTS + 1, 100) <= 0) continue;
+    
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(rest->listen_fd, NULL, NULL);
+            int slot = -1;
+            for (int i = 0; i < MOCK_REST_MAX_CLIENTS && fd >= 0; i++) {
+                if (rest->clients[i].fd < 0) {
+                    slot = i;
+                    break;
+                }
+            }
+            if (slot >= 0 && (rest->clients[slot].buf = malloc(MOCK_REST_BUFFER))) {
+                rest->clients[slot].fd = fd;
+                rest->clients[slot].len = 0;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+    
+        for (int i = 0; i < MOCK_REST_MAX_CLIENTS; i++) {
+            mock_client_t *client = &rest->clients[i];
+            if (client->fd < 0 || !(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+    
+            ssize_t n = recv(client->fd, client->buf + client->len, MOCK_REST_BUFFER - 1 - client->len, 0);
+            if (n <= 0) {
+                mock_rest_close(client);
+                continue;
+            }
+            client->len += (size_t)n;
+            client->buf[client->len] = '\0';
+            if (!mock_rest_process(rest, client)) {
+                mock_rest_close(client);
+            }
+        }
+    }
+    return NULL;
+}
+
+mock_rest_t *mock_rest_start(int port, int gateway_port, mock_rest_callback_t callback, void *userdata) {
+    mock_rest_t *rest = calloc(1, sizeof(mock_rest_t));
+    if (!rest) return NULL;
+    
+    rest->gateway_port = gateway_port;
+    rest->callback = callback;
+    rest->userdata = userdata;
+    for (int i = 0; i < MOCK_REST_MAX_CLIENTS; i++) {
+        rest->clients[i].fd = -1;
+    }
+    
+    rest->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (rest->listen_fd < 0) {
+        free(rest);
+        return NULL;
+    }
+    
+    int one = 1;
+    setsockopt(rest->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(rest->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(rest->listen_fd, MOCK_REST_MAX_CLIENTS) != 0 ||
+        getsockname(rest->listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        mock_rest_stop(rest);
+        return NULL;
+    }
+    rest->port = ntohs(addr.sin_port);
+    
+    if (pthread_create(&rest->thread, NULL, mock_rest_thread, rest) != 0) {
+        mock_rest_stop(rest);
+        return NULL;
+    }
+    rest->thread_started = true;
+    return rest;
+}
+
+void mock_rest_stop(mock_rest_t *rest) {
+    if (!rest) return;
+    
+    if (rest->thread_started) {
+        atomic_store(&rest->stop, true);
+        pthread_join(rest->thread, NULL);
+    }
+    for (int i = 0; i < MOCK_REST_MAX_CLIENTS; i++) {
+        if (rest->clients[i].fd >= 0) mock_rest_close(&rest->clients[i]);
+    }
+    close(rest->listen_fd);
+    free(rest);
+}
+
+int mock_rest_port(const mock_rest_t *rest) {
+    return rest->port;
+}
+
+uint64_t mock_rest_requests(const mock_rest_t *rest) {
+    return atomic_load_explicit(&rest->requests, memory_order_relaxed);
+}
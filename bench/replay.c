@@ -0,0 +1,135 @@
+// replay.c - Replay recorded gateway traffic through the decoder offline
+//
+// Record a capture from a live bot by setting DISCORD_CAPTURE_FILE (or calling
+// discord_capture_start), then feed it back here with REST dry-run enabled:
+// no network, no real token. Frames go through the same receive, decode,
+// filtering and dispatch code as live traffic, so the run can be profiled under
+// perf and builds compared by frames per second.
+#include "../discord.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#define REPLAY_MAX_COMMANDS 64
+
+static discord_message_t* replay_command(const discord_interaction_t *ctx) {
+    (void)ctx;
+    return discord_create_message("ok", false);
+}
+
+static void replay_event(discord_bot_t *bot, const discord_event_info_t *event, void *userdata) {
+    (void)bot;
+    (void)event;
+    (void)userdata;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [-r] [-n loops] [-d ondemand|jansson] [-c command]... [-e] [-C] [-w workers] capture\n"
+            "  -r  replay at the recorded pace instead of full speed\n"
+            "  -c  register a command so its interactions are dispatched (repeatable)\n"
+            "  -e  subscribe to every event, so no dispatch is dropped before parsing\n"
+            "  -C  enable the entity cache\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    bool realtime = false;
+    int loops = 1;
+    int workers = 0;
+    bool all_events = false;
+    bool cache = false;
+    discord_decoder_t decoder = DISCORD_DECODER_ONDEMAND;
+    const char *commands[REPLAY_MAX_COMMANDS];
+    int command_count = 0;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "rn:d:c:eCw:h")) != -1) {
+        switch (opt) {
+            case 'r': realtime = true; break;
+            case 'n': loops = atoi(optarg); break;
+            case 'd':
+                if (strcmp(optarg, "jansson") == 0) {
+                    decoder = DISCORD_DECODER_JANSSON;
+                } else if (strcmp(optarg, "ondemand") != 0) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'c':
+                if (command_count < REPLAY_MAX_COMMANDS) commands[command_count++] = optarg;
+                break;
+            case 'e': all_events = true; break;
+            case 'C': cache = true; break;
+            case 'w': workers = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind != argc - 1 || loops <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    const char *path = argv[optind];
+    
+    // Replies from replayed commands must never reach Discord
+    setenv("DISCORD_REST_DRY_RUN", "1", 1);
+    unsetenv("DISCORD_CAPTURE_FILE");
+    
+    discord_bot_t *bot = discord_init("replay-token");
+    if (!bot) {
+        fprintf(stderr, "Failed to initialize the bot\n");
+        return 1;
+    }
+    discord_set_gateway_decoder(bot, decoder);
+    discord_set_defer_threshold(bot, -1);
+    // Replay can outrun the handlers; queue a whole burst rather than drop it
+    discord_set_worker_pool(bot, workers, 65536);
+    for (int i = 0; i < command_count; i++) {
+        discord_register_slash_command(bot, commands[i], "Replay command", replay_command);
+    }
+    if (all_events) {
+        for (int event = 0; event < DISCORD_EVENT_COUNT; event++) {
+            discord_on(bot, (discord_event_t)event, replay_event, NULL);
+        }
+    }
+    if (cache && !discord_enable_cache(bot, NULL)) {
+        fprintf(stderr, "Failed to enable the cache\n");
+        discord_cleanup(bot);
+        return 1;
+    }
+    
+    discord_replay_stats_t total = {0};
+    for (int i = 0; i < loops; i++) {
+        discord_replay_stats_t stats;
+        if (!discord_replay_capture(bot, path, realtime, &stats)) {
+            discord_cleanup(bot);
+            return 1;
+        }
+        total.records += stats.records;
+        total.messages += stats.messages;
+        total.bytes += stats.bytes;
+        total.elapsed_ns += stats.elapsed_ns;
+    }
+    
+    discord_metrics_snapshot_t metrics;
+    discord_get_metrics(bot, &metrics);
+    discord_cleanup(bot);
+    
+    double elapsed_s = (double)total.elapsed_ns / 1e9;
+    printf("replayed:   %llu messages (%llu receives, %.1f MB) in %.3fs, %d loop%s\n",
+           (unsigned long long)total.messages, (unsigned long long)total.records, (double)total.bytes / 1e6,
+           elapsed_s, loops, loops == 1 ? "" : "s");
+    printf("throughput: %.0f messages/s  %.1f MB/s\n", elapsed_s > 0 ? (double)total.messages / elapsed_s : 0.0,
+           elapsed_s > 0 ? (double)total.bytes / 1e6 / elapsed_s : 0.0);
+    printf("dropped:    %llu dispatches before parsing\n", (unsigned long long)metrics.frames_dropped);
+    printf("decode:     p50 %.2fus  p99 %.2fus  p999 %.2fus  max %.2fus\n",
+           (double)metrics.decode.p50 / 1000.0, (double)metrics.decode.p99 / 1000.0,
+           (double)metrics.decode.p999 / 1000.0, (double)metrics.decode.max / 1000.0);
+    if (metrics.handler.count) {
+        printf("handlers:   %llu run, p50 %.2fus  p99 %.2fus\n", (unsigned long long)metrics.handler.count,
+               (double)metrics.handler.p50 / 1000.0, (double)metrics.handler.p99 / 1000.0);
+    }
+    return 0;
+}
@@ -1,26 +1,207 @@
 // discord.c - Implementation
 #include "discord.h"
 #include <string.h>
+#include <stddef.h>
+#include <strings.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 
-// Global bot instance for built-in commands
-static discord_bot_t *global_bot_instance = NULL;
+// Bump allocator scoped to one interaction. A chain of blocks is carved up front
+// to back; nothing is freed individually, the whole arena is reset at once.
+#define ARENA_BLOCK_SIZE 8192
+#define ARENA_ALIGN 16
+#define ARENA_POOL_SIZE 64
 
-// Set global bot instance
-void discord_set_global_bot(discord_bot_t *bot) {
-    global_bot_instance = bot;
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) unsigned char data[];
+} arena_block_t;
+
+// Heap copy made for an arena by a thread that may not carve it
+typedef struct arena_spill {
+    struct arena_spill *next;
+    char data[];
+} arena_spill_t;
+
+struct discord_arena {
+    arena_block_t *head;        // Block currently being carved, newest first
+    void *last;                 // Most recent allocation, which may grow in place
+    size_t last_size;
+    atomic_int refs;            // The running handler plus each request still sending from it
+    _Atomic(arena_spill_t *) spill;     // Freed along with the arena
+    discord_arena_t *next_free;
+};
+
+static pthread_mutex_t arena_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static discord_arena_t *arena_pool = NULL;
+static int arena_pool_count = 0;
+
+// Arena of the interaction running on this thread, NULL outside arena-scoped handlers
+static _Thread_local discord_arena_t *current_arena = NULL;
+
+static arena_block_t *arena_block_new(size_t min_size) {
+    size_t size = min_size > ARENA_BLOCK_SIZE ? min_size : ARENA_BLOCK_SIZE;
+    arena_block_t *block = malloc(sizeof(arena_block_t) + size);
+    if (!block) return NULL;
+    
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+static void *arena_alloc(discord_arena_t *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    
+    arena_block_t *block = arena->head;
+    if (!block || block->size - block->used < size) {
+        block = arena_block_new(size);
+        if (!block) return NULL;
+        block->next = arena->head;
+        arena->head = block;
+    }
+    
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->last = ptr;
+    arena->last_size = size;
+    return ptr;
+}
+
+// Grow an allocation, extending it in place when it is the newest one in the block
+static void *arena_realloc(discord_arena_t *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (!ptr) return arena_alloc(arena, new_size);
+    
+    arena_block_t *block = arena->head;
+    if (ptr == arena->last && block) {
+        size_t offset = (size_t)((unsigned char *)ptr - block->data);
+        size_t aligned = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        if (offset + aligned <= block->size) {
+            block->used = offset + aligned;
+            arena->last_size = aligned;
+            return ptr;
+        }
+    }
+    
+    void *grown = arena_alloc(arena, new_size);
+    if (grown) memcpy(grown, ptr, old_size);
+    return grown;
+}
+
+static char *arena_strdup(discord_arena_t *arena, const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len);
+    if (copy) memcpy(copy, str, len);
+    return copy;
+}
+
+// Take an arena from the pool (or make one) holding a single reference
+static discord_arena_t *arena_acquire(void) {
+    discord_arena_t *arena = NULL;
+    
+    pthread_mutex_lock(&arena_pool_mutex);
+    if (arena_pool) {
+        arena = arena_pool;
+        arena_pool = arena->next_free;
+        arena_pool_count--;
+    }
+    pthread_mutex_unlock(&arena_pool_mutex);
+    
+    if (!arena) {
+        arena = calloc(1, sizeof(discord_arena_t));
+        if (!arena) return NULL;
+    }
+    atomic_store(&arena->refs, 1);
+    return arena;
+}
+
+static void arena_ref(discord_arena_t *arena) {
+    atomic_fetch_add(&arena->refs, 1);
+}
+
+// Drop a reference; the last one resets the arena and returns it to the pool,
+// keeping only its first block warm
+static void arena_unref(discord_arena_t *arena) {
+    if (!arena || atomic_fetch_sub(&arena->refs, 1) != 1) return;
+    
+    arena_spill_t *spill = atomic_exchange(&arena->spill, NULL);
+    while (spill) {
+        arena_spill_t *next = spill->next;
+        free(spill);
+        spill = next;
+    }
+    
+    arena_block_t *keep = NULL;
+    arena_block_t *block = arena->head;
+    while (block) {
+        arena_block_t *next = block->next;
+        if (!keep && block->size == ARENA_BLOCK_SIZE) {
+            keep = block;
+            keep->next = NULL;
+            keep->used = 0;
+        } else {
+            free(block);
+        }
+        block = next;
+    }
+    arena->head = keep;
+    arena->last = NULL;
+    arena->last_size = 0;
+    
+    pthread_mutex_lock(&arena_pool_mutex);
+    if (arena_pool_count < ARENA_POOL_SIZE) {
+        arena->next_free = arena_pool;
+        arena_pool = arena;
+        arena_pool_count++;
+        arena = NULL;
+    }
+    pthread_mutex_unlock(&arena_pool_mutex);
+    
+    if (arena) {
+        free(arena->head);
+        free(arena);
+    }
+}
+
+// Copy a string for a message or embed owned by arena (NULL = heap). Only the
+// thread running the arena's handler may carve it; anywhere else (a deferred
+// completion, another thread) the copy goes on the heap and is freed with the arena.
+static char *message_strdup(discord_arena_t *arena, const char *str) {
+    if (!str) return NULL;
+    if (!arena) return strdup(str);
+    if (arena == current_arena) return arena_strdup(arena, str);
+    
+    size_t len = strlen(str) + 1;
+    arena_spill_t *spill = malloc(sizeof(arena_spill_t) + len);
+    if (!spill) return NULL;
+    memcpy(spill->data, str, len);
+    spill->next = atomic_load_explicit(&arena->spill, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&arena->spill, &spill->next, spill,
+                                                  memory_order_release, memory_order_relaxed)) {
+    }
+    return spill->data;
 }
 
 // Create a new message
 discord_message_t* discord_create_message(const char *content, bool ephemeral) {
-    discord_message_t *msg = malloc(sizeof(discord_message_t));
+    discord_message_t *msg = current_arena ? arena_alloc(current_arena, sizeof(discord_message_t))
+                                           : malloc(sizeof(discord_message_t));
     if (!msg) return NULL;
     
     memset(msg, 0, sizeof(discord_message_t));
     msg->ephemeral = ephemeral;
-    
-    if (content) {
-        msg->content = strdup(content);
-    }
+    msg->arena = current_arena;
+    msg->content = message_strdup(msg->arena, content);
     
     return msg;
 }
@@ -29,34 +210,34 @@ discord_message_t* discord_create_message(const char *content, bool ephemeral) {
 void discord_destroy_message(discord_message_t *message) {
     if (!message) return;
     
-    free(message->content);
     if (message->embed) {
         discord_destroy_embed(message->embed);
     }
+    // Arena messages go away with their interaction's arena
+    if (message->arena) return;
+    
+    free(message->content);
     free(message);
 }
 
 // Create a new embed
 discord_embed_t* discord_create_embed(const char *title, const char *description, unsigned int color) {
-    discord_embed_t *embed = malloc(sizeof(discord_embed_t));
+    discord_embed_t *embed = current_arena ? arena_alloc(current_arena, sizeof(discord_embed_t))
+                                           : malloc(sizeof(discord_embed_t));
     if (!embed) return NULL;
     
     memset(embed, 0, sizeof(discord_embed_t));
     embed->color = color;
-    
-    if (title) {
-        embed->title = strdup(title);
-    }
-    if (description) {
-        embed->description = strdup(description);
-    }
+    embed->arena = current_arena;
+    embed->title = message_strdup(embed->arena, title);
+    embed->description = message_strdup(embed->arena, description);
     
     return embed;
 }
 
 // Destroy an embed
 void discord_destroy_embed(discord_embed_t *embed) {
-    if (!embed) return;
+    if (!embed || embed->arena) return;
     
     free(embed->title);
     free(embed->description);
@@ -70,34 +251,22 @@ void discord_destroy_embed(discord_embed_t *embed) {
 void discord_set_embed_footer(discord_embed_t *embed, const char *footer) {
     if (!embed) return;
     
-    free(embed->footer);
-    if (footer) {
-        embed->footer = strdup(footer);
-    } else {
-        embed->footer = NULL;
-    }
+    if (!embed->arena) free(embed->footer);
+    embed->footer = message_strdup(embed->arena, footer);
 }
 
 void discord_set_embed_footer_url(discord_embed_t *embed, const char *footer_url) {
   if (!embed) return;
 
-  free(embed->footer_url);
-  if (footer_url) {
-    embed->footer_url = strdup(footer_url);
-  } else {
-    embed->footer_url = NULL;
-  }
+  if (!embed->arena) free(embed->footer_url);
+  embed->footer_url = message_strdup(embed->arena, footer_url);
 }
 
 void discord_set_embed_thumbnail(discord_embed_t *embed, const char *thumbnail) {
   if (!embed) return;
   
-  free(embed->thumbnail);
-  if (thumbnail) {
-    embed->thumbnail = strdup(thumbnail);
-  } else {
-    embed->thumbnail = NULL;
-  }
+  if (!embed->arena) free(embed->thumbnail);
+  embed->thumbnail = message_strdup(embed->arena, thumbnail);
 }
 
 // Set embed timestamp
@@ -117,48 +286,33 @@ void discord_message_set_embed(discord_message_t *message, discord_embed_t *embe
     message->embed = embed;
 }
 
-// Get current latency in milliseconds
+// Get current latency in milliseconds, averaged over shards with a measurement
 long discord_get_latency(discord_bot_t *bot) {
     if (!bot) return -1;
     
+    long total = 0;
+    int measured = 0;
     pthread_mutex_lock(&bot->latency_mutex);
-    long latency = bot->gateway_latency_ms;
+    for (int i = 0; i < bot->shard_count; i++) {
+        if (bot->shards[i].latency_ms >= 0) {
+            total += bot->shards[i].latency_ms;
+            measured++;
+        }
+    }
     pthread_mutex_unlock(&bot->latency_mutex);
     
-    return latency;
-}
-
-// Calculate time difference in milliseconds
-static long timeval_diff_ms(struct timeval *start, struct timeval *end) {
-    return (end->tv_sec - start->tv_sec) * 1000 + (end->tv_usec - start->tv_usec) / 1000;
+    return measured ? total / measured : -1;
 }
 
-// Send heartbeat
-static void send_heartbeat(discord_bot_t *bot, struct lws *wsi) {
-    json_t *heartbeat = json_object();
-    json_object_set_new(heartbeat, "op", json_integer(1));
-    json_object_set_new(heartbeat, "d", json_null());
+// Get the latency of a single shard in milliseconds
+long discord_get_shard_latency(discord_bot_t *bot, int shard_id) {
+    if (!bot || shard_id < 0 || shard_id >= bot->shard_count) return -1;
     
-    char *heartbeat_str = json_dumps(heartbeat, 0);
-    if (heartbeat_str) {
-        size_t msg_len = strlen(heartbeat_str);
-        unsigned char *buf = malloc(LWS_PRE + msg_len);
-        if (buf) {
-            memcpy(&buf[LWS_PRE], heartbeat_str, msg_len);
-            lws_write(wsi, &buf[LWS_PRE], msg_len, LWS_WRITE_TEXT);
-            
-            // Record heartbeat sent time
-            pthread_mutex_lock(&bot->latency_mutex);
-            gettimeofday(&bot->last_heartbeat_sent, NULL);
-            bot->heartbeat_acked = 0;
-            pthread_mutex_unlock(&bot->latency_mutex);
-            
-            free(buf);
-        }
-        free(heartbeat_str);
-    }
+    pthread_mutex_lock(&bot->latency_mutex);
+    long latency = bot->shards[shard_id].latency_ms;
+    pthread_mutex_unlock(&bot->latency_mutex);
     
-    json_decref(heartbeat);
+    return latency;
 }
 
 // Response buffer for HTTP requests
@@ -177,379 +331,6058 @@ static size_t write_response_callback(void *contents, size_t size, size_t nmemb,
     return realsize;
 }
 
-// Simple callback for requests that don't need response
-static size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t realsize = size * nmemb;
-    return realsize;
+// Grow a buffer geometrically so it holds at least needed bytes
+static int buffer_reserve(void **buf, size_t *cap, size_t needed) {
+    if (needed <= *cap) return 1;
+    
+    size_t new_cap = *cap ? *cap : MAX_RESPONSE_SIZE;
+    while (new_cap < needed) new_cap *= 2;
+    
+    void *grown = realloc(*buf, new_cap);
+    if (!grown) return 0;
+    
+    *buf = grown;
+    *cap = new_cap;
+    return 1;
 }
 
-static char* build_message_payload(discord_message_t *message) {
-    if (!message) return NULL;
+// Growable output buffer for outbound payloads
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    discord_arena_t *arena;     // Set if data lives in an interaction arena
+} json_buf_t;
+
+// Process-wide cache of payload buffers, so steady-state replies reuse warm
+// allocations instead of growing a fresh buffer each time
+#define PAYLOAD_POOL_SIZE 32
+#define PAYLOAD_POOL_MAX_CAP (64 * 1024)
+
+static pthread_mutex_t payload_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static json_buf_t payload_pool[PAYLOAD_POOL_SIZE];
+static int payload_pool_count = 0;
+
+static void payload_buf_acquire(json_buf_t *buf) {
+    memset(buf, 0, sizeof(json_buf_t));
     
-    json_t *payload = json_object();
+    // Inside an arena-scoped handler the payload is carved from the interaction's arena
+    if (current_arena) {
+        buf->arena = current_arena;
+        return;
+    }
     
-    // Add content if present
-    if (message->content && strlen(message->content) > 0) {
-        json_object_set_new(payload, "content", json_string(message->content));
+    pthread_mutex_lock(&payload_pool_mutex);
+    if (payload_pool_count > 0) {
+        *buf = payload_pool[--payload_pool_count];
+    }
+    pthread_mutex_unlock(&payload_pool_mutex);
+    buf->len = 0;
+}
+
+static void payload_buf_release(json_buf_t *buf) {
+    if (!buf->data || buf->arena) {
+        memset(buf, 0, sizeof(json_buf_t));
+        return;
     }
     
-    // Add embed if present
-    if (message->embed) {
-        json_t *embed_obj = json_object();
-        
-        if (message->embed->title) {
-            json_object_set_new(embed_obj, "title", json_string(message->embed->title));
-        }
-        if (message->embed->description) {
-            json_object_set_new(embed_obj, "description", json_string(message->embed->description));
-        }
-        
-        // Handle footer (with optional icon)
-        if (message->embed->footer) {
-            json_t *footer_obj = json_object();
-            json_object_set_new(footer_obj, "text", json_string(message->embed->footer));
-            
-            // Add footer icon if provided
-            if (message->embed->footer_url) {
-                json_object_set_new(footer_obj, "icon_url", json_string(message->embed->footer_url));
-            }
-            
-            json_object_set_new(embed_obj, "footer", footer_obj);
-        }
-        
-        // Add color (only if non-zero)
-        if (message->embed->color != 0) {
-            json_object_set_new(embed_obj, "color", json_integer(message->embed->color));
+    if (buf->cap <= PAYLOAD_POOL_MAX_CAP) {
+        pthread_mutex_lock(&payload_pool_mutex);
+        if (payload_pool_count < PAYLOAD_POOL_SIZE) {
+            payload_pool[payload_pool_count++] = *buf;
+            buf->data = NULL;
         }
+        pthread_mutex_unlock(&payload_pool_mutex);
+    }
+    
+    free(buf->data);
+    memset(buf, 0, sizeof(json_buf_t));
+}
 
-        // Handle thumbnail
-        if (message->embed->thumbnail) {
-            json_t *thumbnail_obj = json_object();
-            json_object_set_new(thumbnail_obj, "url", json_string(message->embed->thumbnail));
-            json_object_set_new(embed_obj, "thumbnail", thumbnail_obj);
-        }
-        
-        // Add timestamp
-        if (message->embed->timestamp != 0) {
-            char timestamp[64];
-            strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S.000Z", gmtime(&message->embed->timestamp));
-            json_object_set_new(embed_obj, "timestamp", json_string(timestamp));
+// Streaming JSON writer: emits straight into a json_buf_t, no intermediate tree
+#define JSON_WRITER_MAX_DEPTH 16
+
+typedef struct {
+    json_buf_t *buf;
+    int depth;
+    bool need_comma[JSON_WRITER_MAX_DEPTH];
+    bool after_key;
+    bool failed;
+} json_writer_t;
+
+static void jw_init(json_writer_t *w, json_buf_t *buf) {
+    memset(w, 0, sizeof(json_writer_t));
+    w->buf = buf;
+}
+
+static void jw_append(json_writer_t *w, const char *data, size_t len) {
+    if (w->failed) return;
+    
+    // Always keep room for a terminator so the result is a C string too
+    json_buf_t *buf = w->buf;
+    size_t needed = buf->len + len + 1;
+    if (buf->arena && needed > buf->cap) {
+        size_t new_cap = buf->cap ? buf->cap * 2 : 512;
+        while (new_cap < needed) new_cap *= 2;
+        char *grown = arena_realloc(buf->arena, buf->data, buf->len, new_cap);
+        if (!grown) {
+            w->failed = true;
+            return;
         }
-        
-        json_t *embeds_array = json_array();
-        json_array_append_new(embeds_array, embed_obj);
-        json_object_set_new(payload, "embeds", embeds_array);
+        buf->data = grown;
+        buf->cap = new_cap;
+    } else if (!buffer_reserve((void **)&buf->data, &buf->cap, needed)) {
+        w->failed = true;
+        return;
     }
+    memcpy(w->buf->data + w->buf->len, data, len);
+    w->buf->len += len;
+    w->buf->data[w->buf->len] = '\0';
+}
+
+// Separator before a value: none after a key, a comma between siblings
+static void jw_separator(json_writer_t *w) {
+    if (w->after_key) {
+        w->after_key = false;
+        return;
+    }
+    if (w->need_comma[w->depth]) {
+        jw_append(w, ",", 1);
+    }
+    w->need_comma[w->depth] = true;
+}
+
+static void jw_begin(json_writer_t *w, char open) {
+    jw_separator(w);
+    jw_append(w, &open, 1);
+    if (w->depth + 1 >= JSON_WRITER_MAX_DEPTH) {
+        w->failed = true;
+        return;
+    }
+    w->need_comma[++w->depth] = false;
+}
+
+static void jw_end(json_writer_t *w, char close) {
+    jw_append(w, &close, 1);
+    if (w->depth > 0) w->depth--;
+}
+
+// Length of the well-formed UTF-8 sequence at s (RFC 3629: no overlongs,
+// surrogates or code points above U+10FFFF), 0 if the bytes there are invalid
+static size_t utf8_sequence_length(const unsigned char *s, size_t len) {
+    unsigned char c = s[0];
+    if (c < 0x80) return 1;
     
-    char *payload_str = json_dumps(payload, JSON_COMPACT);
-    json_decref(payload);
+    size_t n;
+    unsigned char lo = 0x80, hi = 0xbf;     // Range of the second byte
+    if (c >= 0xc2 && c <= 0xdf) {
+        n = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        n = 3;
+        if (c == 0xe0) lo = 0xa0;
+        if (c == 0xed) hi = 0x9f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        n = 4;
+        if (c == 0xf0) lo = 0x90;
+        if (c == 0xf4) hi = 0x8f;
+    } else {
+        return 0;
+    }
     
-    return payload_str;
+    if (len < n || s[1] < lo || s[1] > hi) return 0;
+    for (size_t i = 2; i < n; i++) {
+        if ((s[i] & 0xc0) != 0x80) return 0;
+    }
+    return n;
 }
 
-// Enhanced WebSocket callback with heartbeat and latency tracking
-static int ws_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
-    discord_bot_t *bot = (discord_bot_t *)lws_context_user(lws_get_context(wsi));
-    static time_t last_heartbeat_time = 0;
+static void jw_string_n(json_writer_t *w, const char *str, size_t len) {
+    static const char hex[] = "0123456789abcdef";
     
-    switch (reason) {
-        case LWS_CALLBACK_CLIENT_ESTABLISHED:
-            printf("Connected to Discord Gateway\n");
-            break;
-            
-        case LWS_CALLBACK_CLIENT_RECEIVE: {
-            // Allocate buffer with extra space for null terminator
-            char *msg = malloc(len + 1);
-            if (!msg) {
-                printf("Failed to allocate memory for message\n");
-                break;
-            }
-            
-            memcpy(msg, in, len);
-            msg[len] = '\0';
-            
-            // Parse the JSON message
-            json_error_t error;
-            json_t *root = json_loads(msg, 0, &error);
-            if (!root) {
-                printf("JSON parse error: %s\n", error.text);
-                free(msg);
-                break;
-            }
-            
-            json_t *op = json_object_get(root, "op");
-            json_t *t = json_object_get(root, "t");
-            json_t *d = json_object_get(root, "d");
-            
-            if (!op) {
-                json_decref(root);
-                free(msg);
-                break;
-            }
-            
-            int opcode = json_integer_value(op);
-            
-            // Handle HELLO message (opcode 10)
-            if (opcode == 10) {
-                // Extract heartbeat interval
-                if (d) {
-                    json_t *heartbeat_interval_obj = json_object_get(d, "heartbeat_interval");
-                    if (heartbeat_interval_obj) {
-                        bot->heartbeat_interval = json_integer_value(heartbeat_interval_obj);
-                    }
-                }
-                
-                // Send IDENTIFY
-                json_t *identify = json_object();
-                json_object_set_new(identify, "op", json_integer(2));
-                
-                json_t *identify_data = json_object();
-                json_object_set_new(identify_data, "token", json_string(bot->token));
-                json_object_set_new(identify_data, "intents", json_integer(1 << 15)); // GUILD_MESSAGE_CONTENT
-                
-                json_t *properties = json_object();
-                json_object_set_new(properties, "$os", json_string("linux"));
-                json_object_set_new(properties, "$browser", json_string("discord_c_lib"));
-                json_object_set_new(properties, "$device", json_string("discord_c_lib"));
-                json_object_set_new(identify_data, "properties", properties);
-                
-                json_object_set_new(identify, "d", identify_data);
-                
-                char *identify_str = json_dumps(identify, 0);
-                if (identify_str) {
-                    size_t msg_len = strlen(identify_str);
-                    unsigned char *buf = malloc(LWS_PRE + msg_len);
-                    if (buf) {
-                        memcpy(&buf[LWS_PRE], identify_str, msg_len);
-                        lws_write(wsi, &buf[LWS_PRE], msg_len, LWS_WRITE_TEXT);
-                        free(buf);
-                    }
-                    free(identify_str);
-                }
-                
-                json_decref(identify);
-            }
-            // Handle HEARTBEAT_ACK (opcode 11)
-            else if (opcode == 11) {
-                pthread_mutex_lock(&bot->latency_mutex);
-                gettimeofday(&bot->last_heartbeat_ack, NULL);
-                bot->heartbeat_acked = 1;
-                bot->gateway_latency_ms = timeval_diff_ms(&bot->last_heartbeat_sent, &bot->last_heartbeat_ack);
-                pthread_mutex_unlock(&bot->latency_mutex);
+    jw_separator(w);
+    jw_append(w, "\"", 1);
+    
+    // Copy runs of safe bytes in one go; escape quotes, backslashes and control
+    // characters. Invalid UTF-8 would make Discord reject the whole payload, so
+    // each bad byte becomes U+FFFD.
+    size_t run = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)str[i];
+        if (c >= 0x80) {
+            size_t n = utf8_sequence_length((const unsigned char *)str + i, len - i);
+            if (n) {
+                i += n - 1;
+                continue;
             }
-            // Handle INTERACTION_CREATE (slash commands)
-            else if (t && strcmp(json_string_value(t), "INTERACTION_CREATE") == 0) {
-              if (d) {
-                json_t *interaction_type = json_object_get(d, "type");
+            jw_append(w, str + run, i - run);
+            run = i + 1;
+            jw_append(w, "\xef\xbf\xbd", 3);
+            continue;
+        }
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
         
-                // Type 2 = Application Command
-                if (interaction_type && json_integer_value(interaction_type) == 2) {
-                  json_t *data_obj = json_object_get(d, "data");
-                  json_t *command_name = json_object_get(data_obj, "name");
-                  json_t *interaction_id = json_object_get(d, "id");
-                  json_t *interaction_token = json_object_get(d, "token");
-            
-                  if (command_name && interaction_id && interaction_token) {
-                    // Find matching command
-                    const char *cmd_name = json_string_value(command_name);
-                    for (int i = 0; i < bot->command_count; i++) {
-                      if (strcmp(bot->commands[i].name, cmd_name) == 0) {
-                        // Call the handler function which now returns discord_message_t*
-                        discord_message_t *response_msg = bot->commands[i].handler();
-                        
-                        if (response_msg) {
-                            discord_send_interaction_response(bot, 
-                                json_string_value(interaction_id),
-                                json_string_value(interaction_token),
-                                response_msg);
-                            
-                            discord_destroy_message(response_msg);
-                        }
-                        break;
-                    }
-                }
-            }
+        jw_append(w, str + run, i - run);
+        run = i + 1;
+        
+        char esc[6] = { '\\', 0 };
+        size_t esc_len = 2;
+        switch (c) {
+            case '"':  esc[1] = '"'; break;
+            case '\\': esc[1] = '\\'; break;
+            case '\b': esc[1] = 'b'; break;
+            case '\f': esc[1] = 'f'; break;
+            case '\n': esc[1] = 'n'; break;
+            case '\r': esc[1] = 'r'; break;
+            case '\t': esc[1] = 't'; break;
+            default:
+                esc[1] = 'u';
+                esc[2] = '0';
+                esc[3] = '0';
+                esc[4] = hex[c >> 4];
+                esc[5] = hex[c & 0xf];
+                esc_len = 6;
+                break;
         }
+        jw_append(w, esc, esc_len);
     }
+    jw_append(w, str + run, len - run);
+    jw_append(w, "\"", 1);
 }
-            
-            json_decref(root);
-            free(msg);
-            break;
-        }
-        
-        case LWS_CALLBACK_CLIENT_WRITEABLE: {
-            // Send heartbeat if needed
-            time_t current_time = time(NULL);
-            if (bot->heartbeat_interval > 0 && 
-                (current_time - last_heartbeat_time) >= (bot->heartbeat_interval / 1000)) {
-                send_heartbeat(bot, wsi);
-                last_heartbeat_time = current_time;
-            }
-            break;
-        }
-        
-        case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
-            printf("Connection error\n");
-            break;
-            
-        case LWS_CALLBACK_CLOSED:
-            printf("Connection closed\n");
-            break;
-            
-        default:
-            break;
+
+static void jw_string(json_writer_t *w, const char *str) {
+    jw_string_n(w, str, strlen(str));
+}
+
+static void jw_key(json_writer_t *w, const char *key) {
+    jw_string(w, key);
+    jw_append(w, ":", 1);
+    w->after_key = true;
+}
+
+static void jw_int(json_writer_t *w, long long value) {
+    char num[24];
+    int len = snprintf(num, sizeof(num), "%lld", value);
+    jw_separator(w);
+    jw_append(w, num, (size_t)len);
+}
+
+static void jw_null(json_writer_t *w) {
+    jw_separator(w);
+    jw_append(w, "null", 4);
+}
+
+// FNV-1a over a length-delimited string
+static uint64_t hash_bytes(const char *data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
     }
+    return hash;
+}
+
+// Finalizer from splitmix64; snowflakes are mostly timestamp so their low bits need mixing
+static uint64_t hash_u64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// Parse a decimal snowflake string, 0 if absent or malformed
+static uint64_t snowflake_parse(const char *str) {
+    if (!str || !*str) return 0;
     
-    return 0;
+    char *end;
+    unsigned long long value = strtoull(str, &end, 10);
+    return *end == '\0' ? (uint64_t)value : 0;
 }
 
-// Gateway thread function with heartbeat timer
-static void* gateway_thread_func(void *arg) {
-    discord_bot_t *bot = (discord_bot_t *)arg;
+// Milliseconds on the monotonic clock
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Nanoseconds on the monotonic clock, for latency measurements
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Uniform random number in [0, 1) for backoff and heartbeat jitter (xorshift64*, per thread)
+static double random_fraction(void) {
+    static _Thread_local uint64_t state = 0;
+    if (!state) {
+        state = hash_u64((uint64_t)monotonic_ms() ^ (uint64_t)(uintptr_t)&state) | 1;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (double)((state * 0x2545f4914f6cdd1dULL) >> 11) / 9007199254740992.0;
+}
+
+// Open-addressing map from 64-bit keys to pointers (key 0 marks an empty slot)
+typedef struct {
+    uint64_t *keys;
+    void **values;
+    size_t capacity;    // Power of two
+    size_t count;
+} u64_map_t;
+
+static void* u64_map_get(const u64_map_t *map, uint64_t key) {
+    if (!map->capacity) return NULL;
+    if (!key) key = 1;
     
-    // Get the correct Gateway URL first
-    if (!discord_get_gateway_url(bot)) {
-        printf("Warning: Using fallback Gateway URL\n");
-        // Fallback to hardcoded URL if API call fails
-        if (bot->gateway_url) {
-            free(bot->gateway_url);
+    size_t mask = map->capacity - 1;
+    for (size_t slot = hash_u64(key) & mask; map->keys[slot]; slot = (slot + 1) & mask) {
+        if (map->keys[slot] == key) return map->values[slot];
+    }
+    return NULL;
+}
+
+// Rehash into a table of the given capacity (a power of two above the count)
+static int u64_map_resize(u64_map_t *map, size_t capacity) {
+    uint64_t *keys = calloc(capacity, sizeof(uint64_t));
+    void **values = calloc(capacity, sizeof(void *));
+    if (!keys || !values) {
+        free(keys);
+        free(values);
+        return 0;
+    }
+    
+    for (size_t i = 0; i < map->capacity; i++) {
+        if (!map->keys[i]) continue;
+        size_t slot = hash_u64(map->keys[i]) & (capacity - 1);
+        while (keys[slot]) slot = (slot + 1) & (capacity - 1);
+        keys[slot] = map->keys[i];
+        values[slot] = map->values[i];
+    }
+    
+    free(map->keys);
+    free(map->values);
+    map->keys = keys;
+    map->values = values;
+    map->capacity = capacity;
+    return 1;
+}
+
+static int u64_map_put(u64_map_t *map, uint64_t key, void *value) {
+    if (!key) key = 1;
+    
+    // Keep the load factor under one half
+    if ((map->count + 1) * 2 > map->capacity && !u64_map_resize(map, map->capacity ? map->capacity * 2 : 16)) {
+        return 0;
+    }
+    
+    size_t mask = map->capacity - 1;
+    size_t slot = hash_u64(key) & mask;
+    while (map->keys[slot] && map->keys[slot] != key) slot = (slot + 1) & mask;
+    if (!map->keys[slot]) {
+        map->keys[slot] = key;
+        map->count++;
+    }
+    map->values[slot] = value;
+    return 1;
+}
+
+// Empty a slot, shifting later entries of the same probe run back into the gap.
+// The slot may hold another entry afterwards, so callers sweeping the table
+// check it again before moving on.
+static void u64_map_remove_slot(u64_map_t *map, size_t slot) {
+    size_t mask = map->capacity - 1;
+    size_t gap = slot;
+    for (size_t next = (gap + 1) & mask; map->keys[next]; next = (next + 1) & mask) {
+        // An entry may fill the gap unless its home slot lies cyclically in (gap, next]
+        size_t home = hash_u64(map->keys[next]) & mask;
+        if (((next - home) & mask) >= ((next - gap) & mask)) {
+            map->keys[gap] = map->keys[next];
+            map->values[gap] = map->values[next];
+            gap = next;
         }
-        bot->gateway_url = strdup("wss://gateway.discord.gg/?v=10&encoding=json");
     }
+    map->keys[gap] = 0;
+    map->values[gap] = NULL;
+    map->count--;
+}
+
+// Give back memory after a sweep emptied most of the table
+static void u64_map_shrink(u64_map_t *map) {
+    size_t capacity = map->capacity;
+    while (capacity > 16 && map->count * 8 < capacity) capacity /= 2;
+    if (capacity < map->capacity) u64_map_resize(map, capacity);
+}
+
+static void u64_map_free(u64_map_t *map) {
+    free(map->keys);
+    free(map->values);
+    memset(map, 0, sizeof(u64_map_t));
+}
+
+// Always-on instrumentation. Histograms are HDR-style: 16 linear sub-buckets
+// per power of two, so any recorded value is within 6.25% of its bucket, and
+// recording is a handful of relaxed atomic adds with no lock. Labelled families
+// (per route, per command) are fixed open-addressing tables whose slots are
+// claimed with a CAS and never move, so lookups take no lock either.
+#define METRICS_SUB_BUCKETS 16
+#define METRICS_MAX_EXPONENT 43     // Values up to 2^44 ns (about 4.9 hours)
+#define METRICS_BUCKETS ((METRICS_MAX_EXPONENT - 3) * METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS)
+#define METRICS_FAMILY_SLOTS 128
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t min;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[METRICS_BUCKETS];
+} metrics_histogram_t;
+
+typedef struct {
+    _Atomic uint64_t key;                       // Label hash, 0 while free
+    _Atomic(metrics_histogram_t *) histogram;   // Published once label is written
+    atomic_bool ready;                          // Set after histogram, even if allocation failed
+    char label[128];
+} metrics_family_slot_t;
+
+typedef struct {
+    metrics_family_slot_t slots[METRICS_FAMILY_SLOTS];
+    _Atomic uint64_t overflow;                  // Samples dropped because the table was full
+} metrics_family_t;
+
+struct discord_metrics {
+    // Counters
+    _Atomic uint64_t frames_received;
+    _Atomic uint64_t bytes_received;
+    _Atomic uint64_t frames_dropped;
+    _Atomic uint64_t rest_requests;
+    _Atomic uint64_t rest_errors;
+    _Atomic uint64_t rate_limited;
+    _Atomic uint64_t reconnects;
     
-    struct lws_context_creation_info info;
-    memset(&info, 0, sizeof(info));
+    // Histograms (nanoseconds, except queue depths)
+    metrics_histogram_t heartbeat_rtt;
+    metrics_histogram_t decode;
+    metrics_histogram_t handler;
+    metrics_histogram_t rest;
+    metrics_histogram_t worker_queue_depth;
+    metrics_histogram_t rest_queue_depth;
+    metrics_family_t routes;
+    metrics_family_t commands;
     
-    static struct lws_protocols protocols[] = {
-        {
-            "discord-gateway",
-            ws_callback,
-            0,
-            MAX_RESPONSE_SIZE,
-        },
-        { NULL, NULL, 0, 0 }
-    };
+    // Prometheus endpoint
+    int listen_fd;
+    pthread_t server_thread;
+    bool server_running;
+    atomic_bool server_stop;
+};
+
+static void histogram_init(metrics_histogram_t *h) {
+    atomic_init(&h->min, UINT64_MAX);
+}
+
+static int histogram_bucket(uint64_t value) {
+    if (value < METRICS_SUB_BUCKETS) return (int)value;
+    
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent > METRICS_MAX_EXPONENT) return METRICS_BUCKETS - 1;
+    return (exponent - 3) * METRICS_SUB_BUCKETS + (int)((value >> (exponent - 4)) - METRICS_SUB_BUCKETS);
+}
+
+// Highest value that lands in a bucket
+static uint64_t histogram_bucket_max(int bucket) {
+    if (bucket < METRICS_SUB_BUCKETS) return (uint64_t)bucket;
+    
+    int exponent = bucket / METRICS_SUB_BUCKETS + 3;
+    uint64_t sub = (uint64_t)(bucket % METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS);
+    return ((sub + 1) << (exponent - 4)) - 1;
+}
+
+static void histogram_record(metrics_histogram_t *h, uint64_t value) {
+    if (!h) return;
+    
+    atomic_fetch_add_explicit(&h->buckets[histogram_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+    
+    uint64_t seen = atomic_load_explicit(&h->min, memory_order_relaxed);
+    while (value < seen &&
+           !atomic_compare_exchange_weak_explicit(&h->min, &seen, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+    seen = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > seen &&
+           !atomic_compare_exchange_weak_explicit(&h->max, &seen, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Summarize a histogram. Concurrent records may land mid-copy; the copy is
+// internally consistent because count and quantiles come from the same buckets.
+static void histogram_snapshot(metrics_histogram_t *h, discord_histogram_stats_t *out) {
+    uint64_t counts[METRICS_BUCKETS];
+    memset(out, 0, sizeof(discord_histogram_stats_t));
+    if (!h) return;
+    
+    uint64_t total = 0;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    if (!total) return;
+    
+    out->count = total;
+    out->sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+    out->min = atomic_load_explicit(&h->min, memory_order_relaxed);
+    out->max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    
+    const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    uint64_t *targets[] = { &out->p50, &out->p90, &out->p99, &out->p999 };
+    uint64_t seen = 0;
+    int q = 0;
+    for (int i = 0; i < METRICS_BUCKETS && q < 4; i++) {
+        seen += counts[i];
+        while (q < 4 && (double)seen >= quantiles[q] * (double)total) {
+            uint64_t value = histogram_bucket_max(i);
+            *targets[q++] = value < out->max ? value : out->max;
+        }
+    }
+}
+
+// A claimed slot publishes its histogram right after the key; wait out that window
+static metrics_histogram_t *metrics_slot_histogram(metrics_family_slot_t *slot) {
+    while (!atomic_load_explicit(&slot->ready, memory_order_acquire)) {
+        // The claiming thread is writing the label and allocating
+    }
+    return atomic_load_explicit(&slot->histogram, memory_order_relaxed);
+}
+
+// Histogram for a label, created on first use. NULL once the table is full.
+static metrics_histogram_t *metrics_family_get(metrics_family_t *family, const char *label) {
+    size_t len = strnlen(label, sizeof(family->slots[0].label) - 1);
+    uint64_t key = hash_bytes(label, len);
+    if (!key) key = 1;
+    
+    size_t mask = METRICS_FAMILY_SLOTS - 1;
+    for (size_t probe = 0, i = hash_u64(key) & mask; probe < METRICS_FAMILY_SLOTS; probe++, i = (i + 1) & mask) {
+        metrics_family_slot_t *slot = &family->slots[i];
+        uint64_t current = atomic_load_explicit(&slot->key, memory_order_acquire);
+        
+        if (current == 0) {
+            if (!atomic_compare_exchange_strong(&slot->key, &current, key)) {
+                if (current != key) continue;
+                // Lost the race to the same label; use it once published
+                return metrics_slot_histogram(slot);
+            }
+            memcpy(slot->label, label, len);
+            slot->label[len] = '\0';
+            metrics_histogram_t *h = calloc(1, sizeof(metrics_histogram_t));
+            if (h) histogram_init(h);
+            atomic_store_explicit(&slot->histogram, h, memory_order_release);
+            atomic_store_explicit(&slot->ready, true, memory_order_release);
+            return h;
+        }
+        if (current == key) {
+            return metrics_slot_histogram(slot);
+        }
+    }
+    
+    atomic_fetch_add_explicit(&family->overflow, 1, memory_order_relaxed);
+    return NULL;
+}
+
+static int metrics_family_snapshot(metrics_family_t *family, discord_labelled_stats_t *out, int max) {
+    int count = 0;
+    for (int i = 0; i < METRICS_FAMILY_SLOTS && count < max; i++) {
+        metrics_histogram_t *h = atomic_load_explicit(&family->slots[i].histogram, memory_order_acquire);
+        if (!h) continue;
+        
+        snprintf(out[count].label, sizeof(out[count].label), "%s", family->slots[i].label);
+        histogram_snapshot(h, &out[count].latency);
+        count++;
+    }
+    return count;
+}
+
+static discord_metrics_t *metrics_create(void) {
+    discord_metrics_t *m = calloc(1, sizeof(discord_metrics_t));
+    if (!m) return NULL;
+    
+    histogram_init(&m->heartbeat_rtt);
+    histogram_init(&m->decode);
+    histogram_init(&m->handler);
+    histogram_init(&m->rest);
+    histogram_init(&m->worker_queue_depth);
+    histogram_init(&m->rest_queue_depth);
+    m->listen_fd = -1;
+    return m;
+}
+
+static void metrics_server_stop(discord_metrics_t *m);
+
+static void metrics_free(discord_metrics_t *m) {
+    if (!m) return;
+    
+    metrics_server_stop(m);
+    for (int i = 0; i < METRICS_FAMILY_SLOTS; i++) {
+        free(atomic_load(&m->routes.slots[i].histogram));
+        free(atomic_load(&m->commands.slots[i].histogram));
+    }
+    free(m);
+}
+
+static void metrics_count(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+int discord_get_metrics(discord_bot_t *bot, discord_metrics_snapshot_t *out) {
+    if (!bot || !bot->metrics || !out) return 0;
+    discord_metrics_t *m = bot->metrics;
+    
+    out->frames_received = atomic_load_explicit(&m->frames_received, memory_order_relaxed);
+    out->bytes_received = atomic_load_explicit(&m->bytes_received, memory_order_relaxed);
+    out->frames_dropped = atomic_load_explicit(&m->frames_dropped, memory_order_relaxed);
+    out->rest_requests = atomic_load_explicit(&m->rest_requests, memory_order_relaxed);
+    out->rest_errors = atomic_load_explicit(&m->rest_errors, memory_order_relaxed);
+    out->rate_limited = atomic_load_explicit(&m->rate_limited, memory_order_relaxed);
+    out->reconnects = atomic_load_explicit(&m->reconnects, memory_order_relaxed);
+    histogram_snapshot(&m->heartbeat_rtt, &out->heartbeat_rtt);
+    histogram_snapshot(&m->decode, &out->decode);
+    histogram_snapshot(&m->handler, &out->handler);
+    histogram_snapshot(&m->rest, &out->rest);
+    histogram_snapshot(&m->worker_queue_depth, &out->worker_queue_depth);
+    histogram_snapshot(&m->rest_queue_depth, &out->rest_queue_depth);
+    return 1;
+}
+
+int discord_get_route_metrics(discord_bot_t *bot, discord_labelled_stats_t *routes, int max_routes) {
+    if (!bot || !bot->metrics || !routes) return 0;
+    return metrics_family_snapshot(&bot->metrics->routes, routes, max_routes);
+}
+
+int discord_get_command_metrics(discord_bot_t *bot, discord_labelled_stats_t *commands, int max_commands) {
+    if (!bot || !bot->metrics || !commands) return 0;
+    return metrics_family_snapshot(&bot->metrics->commands, commands, max_commands);
+}
+
+// Prometheus text exposition
+static void prometheus_label(FILE *out, const char *value) {
+    for (const char *p = value; *p; p++) {
+        if (*p == '\\' || *p == '"') fputc('\\', out);
+        if (*p == '\n') {
+            fputs("\\n", out);
+        } else {
+            fputc(*p, out);
+        }
+    }
+}
+
+static void prometheus_counter(FILE *out, const char *name, const char *help, uint64_t value) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long)value);
+}
+
+// One summary series; scale converts recorded units (ns to seconds, or 1)
+static void prometheus_series(FILE *out, const char *name, const char *label_name, const char *label,
+                              const discord_histogram_stats_t *s, double scale) {
+    const char *quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+    const uint64_t values[] = { s->p50, s->p90, s->p99, s->p999 };
+    
+    for (int i = 0; i < 4; i++) {
+        fprintf(out, "%s{", name);
+        if (label_name) {
+            fprintf(out, "%s=\"", label_name);
+            prometheus_label(out, label);
+            fputs("\",", out);
+        }
+        fprintf(out, "quantile=\"%s\"} %.9g\n", quantiles[i], (double)values[i] * scale);
+    }
+    
+    const char *suffixes[] = { "_sum", "_count" };
+    for (int i = 0; i < 2; i++) {
+        fprintf(out, "%s%s", name, suffixes[i]);
+        if (label_name) {
+            fprintf(out, "{%s=\"", label_name);
+            prometheus_label(out, label);
+            fputs("\"}", out);
+        }
+        if (i == 0) {
+            fprintf(out, " %.9g\n", (double)s->sum * scale);
+        } else {
+            fprintf(out, " %llu\n", (unsigned long long)s->count);
+        }
+    }
+}
+
+static void prometheus_summary(FILE *out, const char *name, const char *help, const discord_histogram_stats_t *s, double scale) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    prometheus_series(out, name, NULL, NULL, s, scale);
+}
+
+static void prometheus_family(FILE *out, const char *name, const char *help, const char *label_name, metrics_family_t *family) {
+    fprintf(out, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+    for (int i = 0; i < METRICS_FAMILY_SLOTS; i++) {
+        metrics_histogram_t *h = atomic_load_explicit(&family->slots[i].histogram, memory_order_acquire);
+        if (!h) continue;
+        
+        discord_histogram_stats_t s;
+        histogram_snapshot(h, &s);
+        prometheus_series(out, name, label_name, family->slots[i].label, &s, 1e-9);
+    }
+}
+
+char *discord_metrics_prometheus(discord_bot_t *bot) {
+    discord_metrics_snapshot_t s;
+    if (!discord_get_metrics(bot, &s)) return NULL;
+    discord_metrics_t *m = bot->metrics;
+    
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *out = open_memstream(&text, &text_len);
+    if (!out) return NULL;
+    
+    prometheus_counter(out, "discord_gateway_frames_total", "Complete gateway messages received", s.frames_received);
+    prometheus_counter(out, "discord_gateway_bytes_total", "Gateway bytes received on the wire", s.bytes_received);
+    prometheus_counter(out, "discord_gateway_frames_dropped_total", "Dispatches dropped before parsing", s.frames_dropped);
+    prometheus_counter(out, "discord_gateway_reconnects_total", "Gateway reconnects scheduled", s.reconnects);
+    prometheus_counter(out, "discord_rest_requests_total", "Completed REST requests", s.rest_requests);
+    prometheus_counter(out, "discord_rest_errors_total", "REST requests that failed in transport", s.rest_errors);
+    prometheus_counter(out, "discord_rest_rate_limited_total", "REST 429 responses", s.rate_limited);
+    prometheus_summary(out, "discord_heartbeat_rtt_seconds", "Gateway heartbeat round trip", &s.heartbeat_rtt, 1e-9);
+    prometheus_summary(out, "discord_gateway_decode_seconds", "Time to index or parse one gateway frame", &s.decode, 1e-9);
+    prometheus_summary(out, "discord_worker_queue_depth", "Handler jobs queued at submission", &s.worker_queue_depth, 1.0);
+    prometheus_summary(out, "discord_rest_queue_depth", "REST requests queued at submission", &s.rest_queue_depth, 1.0);
+    prometheus_family(out, "discord_rest_request_seconds", "REST request latency from submission to completion", "route", &m->routes);
+    prometheus_family(out, "discord_handler_seconds", "Command handler latency until the reply is issued", "command", &m->commands);
+    
+    if (fclose(out) != 0) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+// Minimal HTTP responder for scrapes: one request per connection
+static void metrics_serve_client(discord_bot_t *bot, int fd) {
+    struct timeval timeout = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    char request[1024];
+    ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+    if (n <= 0) return;
+    request[n] = '\0';
+    
+    char *body = NULL;
+    const char *status = "404 Not Found";
+    if (strncmp(request, "GET /metrics", 12) == 0 && (request[12] == ' ' || request[12] == '?')) {
+        body = discord_metrics_prometheus(bot);
+        status = body ? "200 OK" : "500 Internal Server Error";
+    }
+    
+    char header[256];
+    size_t body_len = body ? strlen(body) : 0;
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, body_len);
+    
+    const char *parts[] = { header, body };
+    size_t lengths[] = { (size_t)header_len, body_len };
+    for (int i = 0; i < 2; i++) {
+        size_t sent = 0;
+        while (sent < lengths[i]) {
+            ssize_t w = send(fd, parts[i] + sent, lengths[i] - sent, MSG_NOSIGNAL);
+            if (w <= 0) break;
+            sent += (size_t)w;
+        }
+    }
+    free(body);
+}
+
+static void* metrics_server_func(void *arg) {
+    discord_bot_t *bot = (discord_bot_t *)arg;
+    discord_metrics_t *m = bot->metrics;
+    
+    while (!atomic_load(&m->server_stop)) {
+        struct pollfd pfd = { m->listen_fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 250) <= 0) continue;
+        
+        int fd = accept(m->listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        metrics_serve_client(bot, fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+int discord_enable_metrics_endpoint(discord_bot_t *bot, int port) {
+    if (!bot || !bot->metrics || port < 0 || port > 65535) return 0;
+    discord_metrics_t *m = bot->metrics;
+    if (m->server_running) return 0;
+    
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return 0;
+    
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    
+    // Loopback only: the endpoint has no authentication
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)port);
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 16) != 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        fprintf(stderr, "Metrics endpoint: cannot listen on 127.0.0.1:%d\n", port);
+        close(fd);
+        return 0;
+    }
+    
+    m->listen_fd = fd;
+    atomic_store(&m->server_stop, false);
+    if (pthread_create(&m->server_thread, NULL, metrics_server_func, bot) != 0) {
+        close(fd);
+        m->listen_fd = -1;
+        return 0;
+    }
+    m->server_running = true;
+    
+    int bound = ntohs(addr.sin_port);
+    printf("Serving metrics on http://127.0.0.1:%d/metrics\n", bound);
+    return bound;
+}
+
+static void metrics_server_stop(discord_metrics_t *m) {
+    if (!m->server_running) return;
+    
+    atomic_store(&m->server_stop, true);
+    pthread_join(m->server_thread, NULL);
+    close(m->listen_fd);
+    m->listen_fd = -1;
+    m->server_running = false;
+}
+
+// Rate-limit headers captured from a response
+typedef struct {
+    char bucket[64];
+    int limit;              // -1 if absent
+    int remaining;          // -1 if absent
+    double reset_after;     // Seconds, < 0 if absent
+    double retry_after;     // Seconds, < 0 if absent
+    bool global;
+} ratelimit_headers_t;
+
+typedef struct rate_bucket rate_bucket_t;
+
+// A queued or in-flight REST request
+struct discord_rest_request {
+    discord_rest_request_t *next;
+    CURL *easy;
+    char method[8];
+    char *url;
+    json_buf_t body;            // Pooled, arena or plain heap body (cap 0 and no arena)
+    bool authorize;
+    bool keepalive;             // Connection keepalive, kept out of the REST metrics
+    response_buffer_t response;
+    discord_rest_callback_t callback;
+    void *userdata;
+    
+    // Rate limiting
+    char route[128];            // Display route, e.g. "POST /channels/:id/messages"
+    uint64_t submitted_ns;      // For the latency histograms
+    uint64_t route_hash;        // Route including major parameters
+    uint64_t major_hash;        // Major parameters only (channel, guild, webhook)
+    bool global_exempt;         // Interaction callbacks don't count against the global limit
+    rate_bucket_t *bucket;      // Bucket the request was started in
+    int64_t submitted_ms;
+    bool delayed;
+    int retries;
+    ratelimit_headers_t rl;
+};
+
+// A Discord rate-limit bucket. Routes start in a provisional bucket of their own
+// until a response tells us which shared bucket they belong to.
+struct rate_bucket {
+    uint64_t key;
+    char name[64];
+    char route[128];
+    int limit;                  // -1 until the first response
+    int remaining;
+    int64_t reset_at_ms;        // Monotonic
+    int in_flight;
+    discord_rest_request_t *queue_head;
+    discord_rest_request_t *queue_tail;
+    int queued;
+    rate_bucket_t *next_pending;
+    bool pending;
+    
+    // Statistics
+    uint64_t requests;
+    uint64_t delayed;
+    uint64_t total_wait_ms;
+    uint64_t max_wait_ms;
+    uint64_t rate_limited;
+};
+
+struct discord_ratelimiter {
+    pthread_mutex_t mutex;      // Guards the tables and statistics for readers on other threads
+    u64_map_t routes;           // Route hash -> shared bucket, once known
+    u64_map_t buckets;          // Bucket key -> bucket
+    rate_bucket_t *pending;     // Buckets with queued requests
+    int queued;
+    int64_t sweep_at_ms;        // Last idle-bucket sweep
+    size_t sweep_count;         // Bucket count after it
+    
+    int64_t global_reset_at_ms;
+    int64_t global_window_start_ms;
+    int global_window_count;
+    
+    uint64_t global_delayed;
+    uint64_t global_rate_limited;
+    uint64_t invalid_requests;
+    int64_t invalid_window_start_ms;
+};
+
+#define RATELIMIT_GLOBAL_PER_SECOND 50
+#define RATELIMIT_MAX_RETRIES 5
+#define RATELIMIT_INVALID_WINDOW_MS (10 * 60 * 1000)
+#define RATELIMIT_SWEEP_INTERVAL_MS 1000
+
+// Derive the rate-limit route from a URL. Major parameters (channel, guild and
+// webhook IDs, webhook tokens) stay part of the route; other IDs are collapsed.
+static void ratelimit_classify(discord_rest_request_t *req) {
+    const char *path = strstr(req->url, "://");
+    path = path ? strchr(path + 3, '/') : req->url;
+    if (!path) path = "/";
+    
+    // Skip the "/api/vN" prefix
+    if (strncmp(path, "/api/v", 6) == 0) {
+        const char *next = strchr(path + 6, '/');
+        path = next ? next : "";
+    }
+    
+    uint64_t route_hash = hash_bytes(req->method, strlen(req->method));
+    uint64_t major_hash = 0;
+    size_t pos = (size_t)snprintf(req->route, sizeof(req->route), "%s ", req->method);
+    
+    char prev[32] = "";
+    bool prev_major_id = false;
+    const char *seg = path;
+    while (*seg == '/') {
+        seg++;
+        size_t seg_len = strcspn(seg, "/?");
+        bool numeric = seg_len > 0 && strspn(seg, "0123456789") >= seg_len;
+        bool major = false;
+        bool collapse = false;
+        
+        if (numeric) {
+            major = strcmp(prev, "channels") == 0 || strcmp(prev, "guilds") == 0 ||
+                    strcmp(prev, "webhooks") == 0 || strcmp(prev, "interactions") == 0;
+            collapse = true;
+        } else if (prev_major_id && (strncmp(seg, "@", 1) != 0)) {
+            // Webhook and interaction tokens follow their ID
+            major = true;
+            collapse = true;
+        }
+        
+        uint64_t seg_hash = hash_bytes(seg, seg_len);
+        if (major) {
+            major_hash = hash_u64(major_hash ^ seg_hash);
+        }
+        route_hash = hash_u64(route_hash ^ (collapse && !major ? 0x2a : seg_hash));
+        
+        if (pos < sizeof(req->route)) {
+            if (collapse) {
+                pos += (size_t)snprintf(req->route + pos, sizeof(req->route) - pos, "/%s", numeric ? ":id" : ":token");
+            } else {
+                pos += (size_t)snprintf(req->route + pos, sizeof(req->route) - pos, "/%.*s", (int)seg_len, seg);
+            }
+        }
+        
+        prev_major_id = numeric && (strcmp(prev, "webhooks") == 0 || strcmp(prev, "interactions") == 0);
+        snprintf(prev, sizeof(prev), "%.*s", (int)seg_len, seg);
+        seg += seg_len;
+    }
+    
+    req->route_hash = route_hash;
+    req->major_hash = major_hash;
+    req->global_exempt = strncmp(path, "/interactions/", 14) == 0 ||
+                         (strncmp(path, "/webhooks/", 10) == 0 && !req->authorize);
+}
+
+// Parse the rate-limit headers as curl delivers them
+static size_t ratelimit_header_callback(char *buffer, size_t size, size_t nitems, void *userdata) {
+    size_t len = size * nitems;
+    ratelimit_headers_t *rl = (ratelimit_headers_t *)userdata;
+    
+    const char *colon = memchr(buffer, ':', len);
+    if (!colon) return len;
+    
+    size_t name_len = colon - buffer;
+    const char *value = colon + 1;
+    size_t value_len = len - name_len - 1;
+    while (value_len && (*value == ' ' || *value == '\t')) {
+        value++;
+        value_len--;
+    }
+    while (value_len && (value[value_len - 1] == '\r' || value[value_len - 1] == '\n' || value[value_len - 1] == ' ')) {
+        value_len--;
+    }
+    
+    char val[64];
+    snprintf(val, sizeof(val), "%.*s", (int)(value_len < sizeof(val) ? value_len : sizeof(val) - 1), value);
+    
+    if (name_len == 18 && strncasecmp(buffer, "X-RateLimit-Bucket", 18) == 0) {
+        snprintf(rl->bucket, sizeof(rl->bucket), "%s", val);
+    } else if (name_len == 17 && strncasecmp(buffer, "X-RateLimit-Limit", 17) == 0) {
+        rl->limit = atoi(val);
+    } else if (name_len == 21 && strncasecmp(buffer, "X-RateLimit-Remaining", 21) == 0) {
+        rl->remaining = atoi(val);
+    } else if (name_len == 23 && strncasecmp(buffer, "X-RateLimit-Reset-After", 23) == 0) {
+        rl->reset_after = strtod(val, NULL);
+    } else if (name_len == 11 && strncasecmp(buffer, "Retry-After", 11) == 0) {
+        rl->retry_after = strtod(val, NULL);
+    } else if (name_len == 18 && strncasecmp(buffer, "X-RateLimit-Global", 18) == 0) {
+        rl->global = strcasecmp(val, "true") == 0;
+    } else if (name_len == 17 && strncasecmp(buffer, "X-RateLimit-Scope", 17) == 0) {
+        if (strcasecmp(val, "global") == 0) rl->global = true;
+    }
+    
+    return len;
+}
+
+static void ratelimit_headers_reset(ratelimit_headers_t *rl) {
+    memset(rl, 0, sizeof(ratelimit_headers_t));
+    rl->limit = -1;
+    rl->remaining = -1;
+    rl->reset_after = -1;
+    rl->retry_after = -1;
+}
+
+static rate_bucket_t* ratelimit_bucket_create(discord_ratelimiter_t *rl, uint64_t key, const char *name, const char *route) {
+    rate_bucket_t *bucket = calloc(1, sizeof(rate_bucket_t));
+    if (!bucket) return NULL;
+    
+    bucket->key = key;
+    bucket->limit = -1;
+    bucket->remaining = -1;
+    snprintf(bucket->name, sizeof(bucket->name), "%s", name);
+    snprintf(bucket->route, sizeof(bucket->route), "%s", route);
+    
+    pthread_mutex_lock(&rl->mutex);
+    int ok = u64_map_put(&rl->buckets, key, bucket);
+    pthread_mutex_unlock(&rl->mutex);
+    if (!ok) {
+        free(bucket);
+        return NULL;
+    }
+    return bucket;
+}
+
+// Bucket a request belongs to: the shared bucket if known, else the route's provisional one
+static rate_bucket_t* ratelimit_bucket_for(discord_ratelimiter_t *rl, discord_rest_request_t *req) {
+    rate_bucket_t *bucket = u64_map_get(&rl->routes, req->route_hash);
+    if (bucket) return bucket;
+    
+    bucket = u64_map_get(&rl->buckets, req->route_hash);
+    if (bucket) return bucket;
+    
+    return ratelimit_bucket_create(rl, req->route_hash, req->route, req->route);
+}
+
+static void ratelimit_mark_pending(discord_ratelimiter_t *rl, rate_bucket_t *bucket) {
+    if (bucket->pending) return;
+    
+    bucket->pending = true;
+    bucket->next_pending = rl->pending;
+    rl->pending = bucket;
+}
+
+static void ratelimit_enqueue(discord_ratelimiter_t *rl, rate_bucket_t *bucket, discord_rest_request_t *req, bool front) {
+    req->next = NULL;
+    if (front) {
+        req->next = bucket->queue_head;
+        bucket->queue_head = req;
+        if (!bucket->queue_tail) bucket->queue_tail = req;
+    } else if (bucket->queue_tail) {
+        bucket->queue_tail->next = req;
+        bucket->queue_tail = req;
+    } else {
+        bucket->queue_head = bucket->queue_tail = req;
+    }
+    bucket->queued++;
+    rl->queued++;
+    ratelimit_mark_pending(rl, bucket);
+}
+
+// Whether a request may start now; if not, *wake_at is lowered to when it might
+static bool ratelimit_admit(discord_ratelimiter_t *rl, rate_bucket_t *bucket, discord_rest_request_t *req,
+                            int64_t now, int64_t *wake_at) {
+    if (!req->global_exempt) {
+        if (rl->global_reset_at_ms > now) {
+            if (rl->global_reset_at_ms < *wake_at) *wake_at = rl->global_reset_at_ms;
+            return false;
+        }
+        if (now - rl->global_window_start_ms >= 1000) {
+            rl->global_window_start_ms = now;
+            rl->global_window_count = 0;
+        }
+        if (rl->global_window_count >= RATELIMIT_GLOBAL_PER_SECOND) {
+            int64_t next_window = rl->global_window_start_ms + 1000;
+            if (next_window < *wake_at) *wake_at = next_window;
+            if (!req->delayed) rl->global_delayed++;
+            return false;
+        }
+    }
+    
+    // Unknown limits: probe with one request at a time until headers arrive
+    if (bucket->limit < 0) {
+        return bucket->in_flight == 0;
+    }
+    
+    if (now >= bucket->reset_at_ms && bucket->remaining < bucket->limit) {
+        bucket->remaining = bucket->limit;
+    }
+    if (bucket->remaining - bucket->in_flight > 0) {
+        return true;
+    }
+    
+    if (bucket->reset_at_ms > now && bucket->reset_at_ms < *wake_at) *wake_at = bucket->reset_at_ms;
+    return false;
+}
+
+// Record what a response told us about its bucket. Returns the request's shared bucket.
+static rate_bucket_t* ratelimit_update(discord_ratelimiter_t *rl, discord_rest_request_t *req, long status, int64_t now) {
+    rate_bucket_t *bucket = req->bucket;
+    const ratelimit_headers_t *h = &req->rl;
+    
+    if (bucket) bucket->in_flight--;
+    
+    if (h->bucket[0]) {
+        uint64_t key = hash_u64(hash_bytes(h->bucket, strlen(h->bucket)) ^ req->major_hash);
+        rate_bucket_t *shared = u64_map_get(&rl->buckets, key);
+        if (!shared) {
+            shared = ratelimit_bucket_create(rl, key, h->bucket, req->route);
+        }
+        
+        if (shared && u64_map_get(&rl->routes, req->route_hash) != shared) {
+            pthread_mutex_lock(&rl->mutex);
+            u64_map_put(&rl->routes, req->route_hash, shared);
+            pthread_mutex_unlock(&rl->mutex);
+            
+            // Requests still waiting in the provisional bucket move to the shared one
+            if (bucket && bucket != shared) {
+                while (bucket->queue_head) {
+                    discord_rest_request_t *moved = bucket->queue_head;
+                    bucket->queue_head = moved->next;
+                    bucket->queued--;
+                    rl->queued--;
+                    ratelimit_enqueue(rl, shared, moved, false);
+                }
+                bucket->queue_tail = NULL;
+            }
+        }
+        if (shared) bucket = shared;
+    }
+    
+    if (bucket) {
+        pthread_mutex_lock(&rl->mutex);
+        if (h->limit >= 0) bucket->limit = h->limit;
+        if (h->remaining >= 0) bucket->remaining = h->remaining;
+        if (h->reset_after >= 0) bucket->reset_at_ms = now + (int64_t)(h->reset_after * 1000.0);
+        if (status == 429) bucket->rate_limited++;
+        pthread_mutex_unlock(&rl->mutex);
+    }
+    
+    if (status == 429) {
+        int64_t retry_ms = (int64_t)((h->retry_after >= 0 ? h->retry_after : 1.0) * 1000.0);
+        if (h->global) {
+            rl->global_reset_at_ms = now + retry_ms;
+            rl->global_rate_limited++;
+        } else if (bucket) {
+            bucket->remaining = 0;
+            if (bucket->limit < 0) bucket->limit = 1;
+            if (bucket->reset_at_ms < now + retry_ms) bucket->reset_at_ms = now + retry_ms;
+        }
+    }
+    
+    // Discord bans tokens that exceed 10,000 invalid requests in 10 minutes
+    if (status == 401 || status == 403 || status == 429) {
+        if (now - rl->invalid_window_start_ms >= RATELIMIT_INVALID_WINDOW_MS) {
+            rl->invalid_window_start_ms = now;
+            rl->invalid_requests = 0;
+        }
+        rl->invalid_requests++;
+        if (rl->invalid_requests == 5000) {
+            fprintf(stderr, "Warning: %llu invalid REST requests in the last 10 minutes\n",
+                    (unsigned long long)rl->invalid_requests);
+        }
+    }
+    
+    return bucket;
+}
+
+// A bucket nothing refers to and whose window has reset holds no state worth keeping
+static bool ratelimit_bucket_idle(const rate_bucket_t *bucket, int64_t now) {
+    return bucket->in_flight == 0 && bucket->queued == 0 && !bucket->pending && now >= bucket->reset_at_ms;
+}
+
+// Forget idle buckets and the routes mapped to them. Interaction and webhook
+// tokens are major parameters, so every interaction reply gets buckets of its
+// own; without this they would accumulate for the life of the bot. Runs every
+// RATELIMIT_SWEEP_INTERVAL_MS, or sooner once the table has doubled.
+static void ratelimit_sweep(discord_ratelimiter_t *rl, int64_t now) {
+    if (now - rl->sweep_at_ms < RATELIMIT_SWEEP_INTERVAL_MS && rl->buckets.count < rl->sweep_count * 2 + 64) {
+        return;
+    }
+    
+    pthread_mutex_lock(&rl->mutex);
+    // Routes first, while the buckets they point to are still allocated
+    for (size_t i = 0; i < rl->routes.capacity;) {
+        if (rl->routes.keys[i] && ratelimit_bucket_idle(rl->routes.values[i], now)) {
+            u64_map_remove_slot(&rl->routes, i);
+        } else {
+            i++;
+        }
+    }
+    for (size_t i = 0; i < rl->buckets.capacity;) {
+        rate_bucket_t *bucket = rl->buckets.values[i];
+        if (rl->buckets.keys[i] && ratelimit_bucket_idle(bucket, now)) {
+            u64_map_remove_slot(&rl->buckets, i);
+            free(bucket);
+        } else {
+            i++;
+        }
+    }
+    u64_map_shrink(&rl->routes);
+    u64_map_shrink(&rl->buckets);
+    pthread_mutex_unlock(&rl->mutex);
+    
+    rl->sweep_at_ms = now;
+    rl->sweep_count = rl->buckets.count;
+}
+
+static int ratelimiter_init(discord_bot_t *bot) {
+    discord_ratelimiter_t *rl = calloc(1, sizeof(discord_ratelimiter_t));
+    if (!rl) return 0;
+    
+    if (pthread_mutex_init(&rl->mutex, NULL) != 0) {
+        free(rl);
+        return 0;
+    }
+    
+    bot->ratelimiter = rl;
+    return 1;
+}
+
+static void ratelimiter_free(discord_bot_t *bot) {
+    discord_ratelimiter_t *rl = bot->ratelimiter;
+    if (!rl) return;
+    
+    for (size_t i = 0; i < rl->buckets.capacity; i++) {
+        if (rl->buckets.keys[i]) free(rl->buckets.values[i]);
+    }
+    u64_map_free(&rl->buckets);
+    u64_map_free(&rl->routes);
+    pthread_mutex_destroy(&rl->mutex);
+    free(rl);
+    bot->ratelimiter = NULL;
+}
+
+// Snapshot rate-limit statistics
+int discord_get_ratelimit_stats(discord_bot_t *bot, discord_ratelimit_stats_t *buckets, int max_buckets,
+                                discord_ratelimit_global_t *global) {
+    if (!bot || !bot->ratelimiter) return 0;
+    discord_ratelimiter_t *rl = bot->ratelimiter;
+    
+    int count = 0;
+    pthread_mutex_lock(&rl->mutex);
+    for (size_t i = 0; i < rl->buckets.capacity && count < max_buckets && buckets; i++) {
+        if (!rl->buckets.keys[i]) continue;
+        
+        const rate_bucket_t *bucket = rl->buckets.values[i];
+        discord_ratelimit_stats_t *out = &buckets[count++];
+        snprintf(out->bucket, sizeof(out->bucket), "%s", bucket->name);
+        snprintf(out->route, sizeof(out->route), "%s", bucket->route);
+        out->limit = bucket->limit;
+        out->remaining = bucket->remaining;
+        out->queued = bucket->queued;
+        out->requests = bucket->requests;
+        out->delayed = bucket->delayed;
+        out->total_wait_ms = bucket->total_wait_ms;
+        out->max_wait_ms = bucket->max_wait_ms;
+        out->rate_limited = bucket->rate_limited;
+    }
+    
+    if (global) {
+        global->bucket_count = (int)rl->buckets.count;
+        global->queued = rl->queued;
+        global->global_delayed = rl->global_delayed;
+        global->global_rate_limited = rl->global_rate_limited;
+        global->invalid_requests = rl->invalid_requests;
+    }
+    pthread_mutex_unlock(&rl->mutex);
+    
+    return count;
+}
+
+// Index flags into bot->rest_headers
+#define REST_HEADERS_AUTH 1
+#define REST_HEADERS_JSON 2
+
+#define REST_KEEPALIVE_DEFAULT_MS 40000
+
+// Give a request body back to wherever it came from
+static void rest_body_release(json_buf_t *body) {
+    if (body->arena) {
+        // The request held a reference; the last one releases the whole interaction
+        arena_unref(body->arena);
+        memset(body, 0, sizeof(json_buf_t));
+    } else if (body->cap) {
+        payload_buf_release(body);
+    } else {
+        free(body->data);
+        body->data = NULL;
+    }
+}
+
+static void rest_request_free(discord_rest_request_t *req) {
+    if (!req) return;
+    
+    if (req->easy) {
+        curl_easy_cleanup(req->easy);
+    }
+    free(req->url);
+    rest_body_release(&req->body);
+    free(req->response.data);
+    free(req);
+}
+
+// Queue a request, taking ownership of body (see rest_body_release)
+static int rest_submit_request(discord_bot_t *bot, const char *method, const char *url, json_buf_t *body,
+                               bool authorize, bool keepalive, discord_rest_callback_t callback, void *userdata) {
+    discord_rest_request_t *req = NULL;
+    if (bot && bot->rest_multi && method && url) {
+        req = calloc(1, sizeof(discord_rest_request_t));
+    }
+    if (!req) {
+        rest_body_release(body);
+        return 0;
+    }
+    
+    snprintf(req->method, sizeof(req->method), "%s", method);
+    req->url = strdup(url);
+    req->body = *body;
+    req->authorize = authorize;
+    req->keepalive = keepalive;
+    req->callback = callback;
+    req->userdata = userdata;
+    
+    if (!req->url) {
+        rest_request_free(req);
+        return 0;
+    }
+    
+    ratelimit_classify(req);
+    req->submitted_ms = monotonic_ms();
+    req->submitted_ns = monotonic_ns();
+    
+    // Push onto the lock-free submission stack. The I/O thread won't exit while
+    // rest_submitting is non-zero, and rest_engine_stop frees the multi handle
+    // once it has, so the announcement covers everything from the rest_running
+    // check to the wakeup: the push, and the last touch of bot->rest_multi.
+    atomic_fetch_add(&bot->rest_submitting, 1);
+    if (!atomic_load(&bot->rest_running)) {
+        atomic_fetch_sub(&bot->rest_submitting, 1);
+        rest_request_free(req);
+        return 0;
+    }
+    discord_rest_request_t *head = atomic_load_explicit(&bot->rest_queue, memory_order_relaxed);
+    do {
+        req->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&bot->rest_queue, &head, req,
+                                                    memory_order_release, memory_order_relaxed));
+    
+    // Wake the I/O thread out of curl_multi_poll. A non-empty stack means an
+    // earlier submitter already did, and the thread drains everything at once.
+    if (!head) {
+        curl_multi_wakeup(bot->rest_multi);
+    }
+    atomic_fetch_sub(&bot->rest_submitting, 1);
+    return 1;
+}
+
+static int rest_submit_body(discord_bot_t *bot, const char *method, const char *url, json_buf_t *body,
+                            bool authorize, discord_rest_callback_t callback, void *userdata) {
+    return rest_submit_request(bot, method, url, body, authorize, false, callback, userdata);
+}
+
+// Queue a request whose body is a payload buffer; the buffer goes back to the pool
+// (or its arena reference is dropped) once the request is done, and its known
+// length spares a strlen
+static int rest_submit_payload(discord_bot_t *bot, const char *method, const char *url, json_buf_t *payload,
+                               bool authorize, discord_rest_callback_t callback, void *userdata) {
+    json_buf_t body = *payload;
+    memset(payload, 0, sizeof(json_buf_t));
+    
+    // The arena must outlive the transfer that reads from it
+    if (body.arena) arena_ref(body.arena);
+    
+    return rest_submit_body(bot, method, url, &body, authorize, callback, userdata);
+}
+
+// Queue a request, taking ownership of the heap-allocated, NUL-terminated body
+static int rest_submit_owned(discord_bot_t *bot, const char *method, const char *url, char *body,
+                             bool authorize, discord_rest_callback_t callback, void *userdata) {
+    json_buf_t owned = { body, body ? strlen(body) : 0, 0, NULL };
+    return rest_submit_body(bot, method, url, &owned, authorize, callback, userdata);
+}
+
+int discord_rest_submit(discord_bot_t *bot, const char *method, const char *url, const char *body,
+                        bool authorize, discord_rest_callback_t callback, void *userdata) {
+    char *body_copy = NULL;
+    if (body) {
+        body_copy = strdup(body);
+        if (!body_copy) return 0;
+    }
+    
+    return rest_submit_owned(bot, method, url, body_copy, authorize, callback, userdata);
+}
+
+// Easy handles are recycled on the I/O thread: a reset handle keeps its buffers,
+// and connections, DNS entries and TLS sessions live in the multi handle and the
+// share, so nothing is lost between requests
+static CURL *rest_easy_acquire(discord_bot_t *bot) {
+    if (bot->rest_easy_pool_count > 0) {
+        return bot->rest_easy_pool[--bot->rest_easy_pool_count];
+    }
+    return curl_easy_init();
+}
+
+static void rest_easy_release(discord_bot_t *bot, CURL *easy) {
+    if (!easy) return;
+    
+    if (bot->rest_easy_pool_count < REST_EASY_POOL_SIZE) {
+        curl_easy_reset(easy);
+        bot->rest_easy_pool[bot->rest_easy_pool_count++] = easy;
+    } else {
+        curl_easy_cleanup(easy);
+    }
+}
+
+// Configure an easy handle for a request and hand it to the multi handle
+static int rest_start_request(discord_bot_t *bot, discord_rest_request_t *req) {
+    req->easy = rest_easy_acquire(bot);
+    if (!req->easy) return 0;
+    bot->rest_last_activity_ms = monotonic_ms();
+    
+    ratelimit_headers_reset(&req->rl);
+    
+    // Header lists are built once per bot and shared read-only by every transfer
+    int header_set = (req->authorize ? REST_HEADERS_AUTH : 0) | (req->body.data ? REST_HEADERS_JSON : 0);
+    
+    curl_easy_setopt(req->easy, CURLOPT_URL, req->url);
+    curl_easy_setopt(req->easy, CURLOPT_HTTPHEADER, bot->rest_headers[header_set]);
+    curl_easy_setopt(req->easy, CURLOPT_WRITEFUNCTION, write_response_callback);
+    curl_easy_setopt(req->easy, CURLOPT_WRITEDATA, &req->response);
+    curl_easy_setopt(req->easy, CURLOPT_HEADERFUNCTION, ratelimit_header_callback);
+    curl_easy_setopt(req->easy, CURLOPT_HEADERDATA, &req->rl);
+    curl_easy_setopt(req->easy, CURLOPT_PRIVATE, req);
+    curl_easy_setopt(req->easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(req->easy, CURLOPT_TIMEOUT, 30L);
+    
+    // Concurrent requests share one HTTP/2 connection: wait for it to come up
+    // rather than opening more. Without HTTP/2 support curl stays on HTTP/1.1.
+    curl_easy_setopt(req->easy, CURLOPT_SHARE, bot->rest_share);
+    curl_easy_setopt(req->easy, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(req->easy, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(req->easy, CURLOPT_TCP_KEEPALIVE, 1L);
+    
+    if (strcmp(req->method, "GET") != 0) {
+        curl_easy_setopt(req->easy, CURLOPT_CUSTOMREQUEST, req->method);
+    }
+    if (req->body.data) {
+        curl_easy_setopt(req->easy, CURLOPT_POSTFIELDS, req->body.data);
+        curl_easy_setopt(req->easy, CURLOPT_POSTFIELDSIZE, (long)req->body.len);
+    } else if (strcmp(req->method, "POST") == 0 || strcmp(req->method, "PUT") == 0 ||
+               strcmp(req->method, "PATCH") == 0) {
+        curl_easy_setopt(req->easy, CURLOPT_POSTFIELDS, "");
+    }
+    
+    return curl_multi_add_handle(bot->rest_multi, req->easy) == CURLM_OK;
+}
+
+static void rest_complete_request(discord_bot_t *bot, discord_rest_request_t *req, CURLcode result) {
+    discord_rest_response_t response = {0};
+    response.result = result;
+    response.body = req->response.data;
+    response.body_len = req->response.size;
+    if (req->easy) {
+        curl_easy_getinfo(req->easy, CURLINFO_RESPONSE_CODE, &response.status);
+    }
+    
+    if (result == CURLE_OK && response.status == 429) {
+        fprintf(stderr, "Rate limited on %s%s\n", req->route, req->rl.global ? " (global)" : "");
+    } else if (result != CURLE_OK) {
+        fprintf(stderr, "Request to %s failed: %s\n", req->url, curl_easy_strerror(result));
+        if (!req->keepalive) metrics_count(&bot->metrics->rest_errors, 1);
+    }
+    
+    // Keepalives would drag the latency figures towards an idle connection's
+    if (!req->keepalive) {
+        uint64_t elapsed_ns = monotonic_ns() - req->submitted_ns;
+        metrics_count(&bot->metrics->rest_requests, 1);
+        histogram_record(&bot->metrics->rest, elapsed_ns);
+        histogram_record(metrics_family_get(&bot->metrics->routes, req->route), elapsed_ns);
+    }
+    
+    if (req->callback) {
+        req->callback(bot, &response, req->userdata);
+    }
+}
+
+// Dry run: answer locally as Discord would on success, without touching the
+// network or the rate limiter
+static void rest_complete_dry_run(discord_bot_t *bot, discord_rest_request_t *req) {
+    discord_rest_response_t response = {0};
+    response.result = CURLE_OK;
+    if (strcmp(req->method, "GET") == 0) {
+        response.status = 200;
+        response.body = "{}";
+        response.body_len = 2;
+    } else {
+        response.status = 204;
+    }
+    
+    uint64_t elapsed_ns = monotonic_ns() - req->submitted_ns;
+    metrics_count(&bot->metrics->rest_requests, 1);
+    histogram_record(&bot->metrics->rest, elapsed_ns);
+    histogram_record(metrics_family_get(&bot->metrics->routes, req->route), elapsed_ns);
+    
+    if (req->callback) {
+        req->callback(bot, &response, req->userdata);
+    }
+}
+
+// Move new submissions into their rate-limit buckets
+static void rest_drain_queue(discord_bot_t *bot) {
+    discord_ratelimiter_t *rl = bot->ratelimiter;
+    
+    // Take the whole stack and reverse it into submission order
+    discord_rest_request_t *stack = atomic_exchange_explicit(&bot->rest_queue, NULL, memory_order_acquire);
+    discord_rest_request_t *req = NULL;
+    while (stack) {
+        discord_rest_request_t *next = stack->next;
+        stack->next = req;
+        req = stack;
+        stack = next;
+    }
+    
+    while (req) {
+        discord_rest_request_t *next = req->next;
+        
+        if (bot->rest_dry_run) {
+            rest_complete_dry_run(bot, req);
+            rest_request_free(req);
+            req = next;
+            continue;
+        }
+        
+        rate_bucket_t *bucket = ratelimit_bucket_for(rl, req);
+        if (bucket) {
+            ratelimit_enqueue(rl, bucket, req, false);
+            histogram_record(&bot->metrics->rest_queue_depth, (uint64_t)rl->queued);
+        } else {
+            rest_complete_request(bot, req, CURLE_OUT_OF_MEMORY);
+            rest_request_free(req);
+        }
+        req = next;
+    }
+}
+
+// Start every queued request its bucket allows. Returns the delay in ms until a
+// blocked bucket may release more, or -1 if nothing is waiting on a timer.
+static long rest_dispatch_buckets(discord_bot_t *bot) {
+    discord_ratelimiter_t *rl = bot->ratelimiter;
+    int64_t now = monotonic_ms();
+    int64_t wake_at = INT64_MAX;
+    ratelimit_sweep(rl, now);
+    
+    rate_bucket_t **link = &rl->pending;
+    while (*link) {
+        rate_bucket_t *bucket = *link;
+        
+        while (bucket->queue_head) {
+            discord_rest_request_t *req = bucket->queue_head;
+            if (!ratelimit_admit(rl, bucket, req, now, &wake_at)) {
+                req->delayed = true;
+                break;
+            }
+            
+            bucket->queue_head = req->next;
+            if (!bucket->queue_head) bucket->queue_tail = NULL;
+            bucket->queued--;
+            rl->queued--;
+            req->next = NULL;
+            
+            int64_t waited = now - req->submitted_ms;
+            pthread_mutex_lock(&rl->mutex);
+            bucket->requests++;
+            if (req->delayed) {
+                bucket->delayed++;
+                bucket->total_wait_ms += (uint64_t)waited;
+                if ((uint64_t)waited > bucket->max_wait_ms) bucket->max_wait_ms = (uint64_t)waited;
+            }
+            pthread_mutex_unlock(&rl->mutex);
+            
+            req->bucket = bucket;
+            bucket->in_flight++;
+            if (!req->global_exempt) rl->global_window_count++;
+            
+            if (rest_start_request(bot, req)) {
+                bot->rest_in_flight++;
+            } else {
+                bucket->in_flight--;
+                rest_complete_request(bot, req, CURLE_FAILED_INIT);
+                rest_request_free(req);
+            }
+        }
+        
+        if (!bucket->queue_head) {
+            // Nothing left to release: drop the bucket from the pending list
+            bucket->pending = false;
+            *link = bucket->next_pending;
+            bucket->next_pending = NULL;
+        } else {
+            link = &bucket->next_pending;
+        }
+    }
+    
+    if (wake_at == INT64_MAX) return -1;
+    return wake_at > now ? (long)(wake_at - now) : 0;
+}
+
+// Handle a finished transfer: update rate limits and either retry on 429 or complete
+static void rest_finish_transfer(discord_bot_t *bot, discord_rest_request_t *req, CURLcode result) {
+    discord_ratelimiter_t *rl = bot->ratelimiter;
+    
+    long status = 0;
+    if (result == CURLE_OK) {
+        curl_easy_getinfo(req->easy, CURLINFO_RESPONSE_CODE, &status);
+    }
+    
+    rate_bucket_t *bucket = ratelimit_update(rl, req, status, monotonic_ms());
+    if (status == 429) {
+        metrics_count(&bot->metrics->rate_limited, 1);
+    }
+    
+    if (status == 429 && bucket && req->retries < RATELIMIT_MAX_RETRIES) {
+        // Requeue at the front of its bucket; it goes out again after the reset
+        req->retries++;
+        req->delayed = true;
+        rest_easy_release(bot, req->easy);
+        req->easy = NULL;
+        free(req->response.data);
+        req->response.data = NULL;
+        req->response.size = 0;
+        ratelimit_enqueue(rl, bucket, req, true);
+        return;
+    }
+    
+    rest_complete_request(bot, req, result);
+    rest_easy_release(bot, req->easy);
+    req->easy = NULL;
+    rest_request_free(req);
+}
+
+// After keepalive_ms without traffic, send a cheap unauthenticated request so the
+// pooled connection, and with it the TLS session, is still open when the next
+// interaction reply goes out
+static void rest_keepalive(discord_bot_t *bot) {
+    if (bot->rest_keepalive_ms <= 0 || bot->rest_dry_run || bot->rest_in_flight > 0) return;
+    
+    int64_t now = monotonic_ms();
+    if (now - bot->rest_last_activity_ms < bot->rest_keepalive_ms) return;
+    bot->rest_last_activity_ms = now;
+    
+    char url[512];
+    snprintf(url, sizeof(url), "%s/gateway", bot->api_base_url);
+    json_buf_t none = {0};
+    rest_submit_request(bot, "GET", url, &none, false, true, NULL, NULL);
+}
+
+// One-shot callback run on the REST I/O thread
+typedef void (*rest_timer_fn)(discord_bot_t *bot, void *data);
+
+struct discord_rest_timer {
+    discord_rest_timer_t *next;
+    int64_t due_ms;
+    rest_timer_fn fn;
+    void *data;
+};
+
+// Run fn(bot, data) on the I/O thread after delay_ms. Timers still pending at
+// shutdown run once the engine has stopped accepting requests.
+static int rest_schedule(discord_bot_t *bot, int64_t delay_ms, rest_timer_fn fn, void *data) {
+    discord_rest_timer_t *timer = malloc(sizeof(discord_rest_timer_t));
+    if (!timer) return 0;
+    
+    timer->due_ms = monotonic_ms() + delay_ms;
+    timer->fn = fn;
+    timer->data = data;
+    
+    // Counted as a submitter until the wakeup, like rest_submit_request, so the
+    // I/O thread can't exit and have the multi handle freed in between
+    atomic_fetch_add(&bot->rest_submitting, 1);
+    pthread_mutex_lock(&bot->rest_mutex);
+    if (!atomic_load(&bot->rest_running)) {
+        pthread_mutex_unlock(&bot->rest_mutex);
+        atomic_fetch_sub(&bot->rest_submitting, 1);
+        free(timer);
+        return 0;
+    }
+    discord_rest_timer_t **link = &bot->rest_timers;
+    while (*link && (*link)->due_ms <= timer->due_ms) {
+        link = &(*link)->next;
+    }
+    timer->next = *link;
+    *link = timer;
+    pthread_mutex_unlock(&bot->rest_mutex);
+    
+    // Let the I/O thread shorten its poll timeout
+    curl_multi_wakeup(bot->rest_multi);
+    atomic_fetch_sub(&bot->rest_submitting, 1);
+    return 1;
+}
+
+// Run due timers (all of them if run_all). Returns ms until the next one, or -1.
+static long rest_run_timers(discord_bot_t *bot, bool run_all) {
+    int64_t now = monotonic_ms();
+    
+    pthread_mutex_lock(&bot->rest_mutex);
+    discord_rest_timer_t *due = NULL;
+    discord_rest_timer_t **tail = &due;
+    while (bot->rest_timers && (run_all || bot->rest_timers->due_ms <= now)) {
+        *tail = bot->rest_timers;
+        bot->rest_timers = bot->rest_timers->next;
+        tail = &(*tail)->next;
+    }
+    *tail = NULL;
+    long next_ms = bot->rest_timers ? (long)(bot->rest_timers->due_ms - now) : -1;
+    pthread_mutex_unlock(&bot->rest_mutex);
+    
+    while (due) {
+        discord_rest_timer_t *timer = due;
+        due = due->next;
+        timer->fn(bot, timer->data);
+        free(timer);
+    }
+    
+    return next_ms;
+}
+
+// REST I/O thread: drives every in-flight request on one multi handle
+static void* rest_thread_func(void *arg) {
+    discord_bot_t *bot = (discord_bot_t *)arg;
+    
+    for (;;) {
+        long timer_ms = rest_run_timers(bot, false);
+        rest_drain_queue(bot);
+        long wait_ms = rest_dispatch_buckets(bot);
+        if (timer_ms >= 0 && (wait_ms < 0 || timer_ms < wait_ms)) {
+            wait_ms = timer_ms;
+        }
+        
+        int still_running = 0;
+        curl_multi_perform(bot->rest_multi, &still_running);
+        
+        CURLMsg *msg;
+        int msgs_left;
+        while ((msg = curl_multi_info_read(bot->rest_multi, &msgs_left))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            
+            discord_rest_request_t *req = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&req);
+            CURLcode result = msg->data.result;
+            
+            curl_multi_remove_handle(bot->rest_multi, msg->easy_handle);
+            bot->rest_in_flight--;
+            
+            rest_finish_transfer(bot, req, result);
+            // Completions may have freed up bucket capacity
+            wait_ms = 0;
+        }
+        rest_keepalive(bot);
+        
+        // Exit once stopped and every accepted request has finished. The checks
+        // run in this order: once rest_running reads 0, a submitter that hasn't
+        // announced itself will refuse, and one that has is still counted until
+        // it is done with the multi handle.
+        bool done = !atomic_load(&bot->rest_running) && atomic_load(&bot->rest_submitting) == 0 &&
+                    !atomic_load(&bot->rest_queue) && bot->rest_in_flight == 0 && bot->ratelimiter->queued == 0;
+        if (done) break;
+        
+        // Sleep until curl has work, a submission arrives or a bucket resets
+        int timeout_ms = (wait_ms >= 0 && wait_ms < 1000) ? (int)wait_ms : 1000;
+        if (timeout_ms > 0) {
+            curl_multi_poll(bot->rest_multi, NULL, 0, timeout_ms, NULL);
+        }
+    }
+    
+    // Submissions are refused from here on; leftover timers just release their data
+    rest_run_timers(bot, true);
+    
+    return NULL;
+}
+
+static void rest_headers_free(discord_bot_t *bot) {
+    for (int i = 0; i < 4; i++) {
+        curl_slist_free_all(bot->rest_headers[i]);
+        bot->rest_headers[i] = NULL;
+    }
+}
+
+// Build the header list for every combination of REST_HEADERS_* flags up front
+static int rest_headers_build(discord_bot_t *bot) {
+    char auth_header[256];
+    snprintf(auth_header, sizeof(auth_header), "Authorization: Bot %s", bot->token);
+    
+    for (int set = 1; set < 4; set++) {
+        struct curl_slist *list = NULL;
+        if (set & REST_HEADERS_AUTH) {
+            list = curl_slist_append(list, auth_header);
+            if (!list) break;
+        }
+        if (set & REST_HEADERS_JSON) {
+            struct curl_slist *appended = curl_slist_append(list, "Content-Type: application/json");
+            if (!appended) {
+                curl_slist_free_all(list);
+                break;
+            }
+            list = appended;
+        }
+        bot->rest_headers[set] = list;
+    }
+    
+    if (!bot->rest_headers[REST_HEADERS_AUTH] || !bot->rest_headers[REST_HEADERS_JSON] ||
+        !bot->rest_headers[REST_HEADERS_AUTH | REST_HEADERS_JSON]) {
+        rest_headers_free(bot);
+        return 0;
+    }
+    return 1;
+}
+
+// DNS answers and TLS sessions shared by every transfer, so a connection
+// reopened after an idle close resumes its session instead of a full handshake.
+// Connections themselves are pooled by the multi handle.
+static CURLSH *rest_share_create(void) {
+    CURLSH *share = curl_share_init();
+    if (!share) return NULL;
+    
+    // Only the REST I/O thread uses the share, so it needs no lock callbacks
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    return share;
+}
+
+// Tear down the curl side of the engine: pooled handles first, as they still
+// reference the share
+static void rest_curl_free(discord_bot_t *bot) {
+    while (bot->rest_easy_pool_count > 0) {
+        curl_easy_cleanup(bot->rest_easy_pool[--bot->rest_easy_pool_count]);
+    }
+    curl_multi_cleanup(bot->rest_multi);
+    bot->rest_multi = NULL;
+    if (bot->rest_share) {
+        curl_share_cleanup(bot->rest_share);
+        bot->rest_share = NULL;
+    }
+}
+
+static int rest_engine_start(discord_bot_t *bot) {
+    if (!rest_headers_build(bot)) return 0;
+    
+    if (!ratelimiter_init(bot)) {
+        rest_headers_free(bot);
+        return 0;
+    }
+    
+    bot->rest_multi = curl_multi_init();
+    if (!bot->rest_multi) {
+        ratelimiter_free(bot);
+        rest_headers_free(bot);
+        return 0;
+    }
+    curl_multi_setopt(bot->rest_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    
+    // Without the share transfers still work, just without TLS session reuse
+    bot->rest_share = rest_share_create();
+    bot->rest_last_activity_ms = monotonic_ms();
+    
+    if (pthread_mutex_init(&bot->rest_mutex, NULL) != 0) {
+        rest_curl_free(bot);
+        ratelimiter_free(bot);
+        rest_headers_free(bot);
+        return 0;
+    }
+    
+    bot->rest_running = 1;
+    if (pthread_create(&bot->rest_thread, NULL, rest_thread_func, bot) != 0) {
+        bot->rest_running = 0;
+        pthread_mutex_destroy(&bot->rest_mutex);
+        rest_curl_free(bot);
+        ratelimiter_free(bot);
+        rest_headers_free(bot);
+        return 0;
+    }
+    
+    return 1;
+}
+
+// Stop accepting requests, let in-flight ones finish, then tear down
+static void rest_engine_stop(discord_bot_t *bot) {
+    if (!bot->rest_multi) return;
+    
+    pthread_mutex_lock(&bot->rest_mutex);
+    bot->rest_running = 0;
+    pthread_mutex_unlock(&bot->rest_mutex);
+    curl_multi_wakeup(bot->rest_multi);
+    
+    pthread_join(bot->rest_thread, NULL);
+    pthread_mutex_destroy(&bot->rest_mutex);
+    rest_curl_free(bot);
+    ratelimiter_free(bot);
+    rest_headers_free(bot);
+}
+
+// Blocking wrapper for startup calls that need the result before continuing
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int pending;
+} rest_waiter_t;
+
+typedef struct {
+    rest_waiter_t *waiter;
+    long status;
+    CURLcode result;
+    char *body;
+} rest_sync_result_t;
+
+static void rest_waiter_init(rest_waiter_t *waiter, int pending) {
+    pthread_mutex_init(&waiter->mutex, NULL);
+    pthread_cond_init(&waiter->cond, NULL);
+    waiter->pending = pending;
+}
+
+static void rest_waiter_done(rest_waiter_t *waiter) {
+    pthread_mutex_lock(&waiter->mutex);
+    waiter->pending--;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->mutex);
+}
+
+static void rest_waiter_wait(rest_waiter_t *waiter) {
+    pthread_mutex_lock(&waiter->mutex);
+    while (waiter->pending > 0) {
+        pthread_cond_wait(&waiter->cond, &waiter->mutex);
+    }
+    pthread_mutex_unlock(&waiter->mutex);
+    pthread_cond_destroy(&waiter->cond);
+    pthread_mutex_destroy(&waiter->mutex);
+}
+
+static void rest_sync_callback(discord_bot_t *bot, const discord_rest_response_t *response, void *userdata) {
+    (void)bot;
+    rest_sync_result_t *out = (rest_sync_result_t *)userdata;
+    
+    out->result = response->result;
+    out->status = response->status;
+    if (response->body) {
+        out->body = strdup(response->body);
+    }
+    rest_waiter_done(out->waiter);
+}
+
+// Perform a request through the engine and wait for it. Returns the response
+// body (caller frees) on a 2xx response, NULL otherwise.
+static char* rest_perform_sync(discord_bot_t *bot, const char *method, const char *url, char *body) {
+    rest_waiter_t waiter;
+    rest_waiter_init(&waiter, 1);
+    rest_sync_result_t out = { .waiter = &waiter };
+    
+    if (!rest_submit_owned(bot, method, url, body, true, rest_sync_callback, &out)) {
+        waiter.pending = 0;
+    }
+    rest_waiter_wait(&waiter);
+    
+    if (out.result != CURLE_OK || out.status < 200 || out.status >= 300) {
+        free(out.body);
+        return NULL;
+    }
+    return out.body;
+}
+
+// Write the message fields into the currently open object
+static void write_message_fields(json_writer_t *w, const discord_message_t *message) {
+    // Add content if present
+    if (message->content && message->content[0]) {
+        jw_key(w, "content");
+        jw_string(w, message->content);
+    }
+    
+    // Add embed if present
+    if (message->embed) {
+        const discord_embed_t *embed = message->embed;
+        
+        jw_key(w, "embeds");
+        jw_begin(w, '[');
+        jw_begin(w, '{');
+        
+        if (embed->title) {
+            jw_key(w, "title");
+            jw_string(w, embed->title);
+        }
+        if (embed->description) {
+            jw_key(w, "description");
+            jw_string(w, embed->description);
+        }
+        
+        // Handle footer (with optional icon)
+        if (embed->footer) {
+            jw_key(w, "footer");
+            jw_begin(w, '{');
+            jw_key(w, "text");
+            jw_string(w, embed->footer);
+            
+            // Add footer icon if provided
+            if (embed->footer_url) {
+                jw_key(w, "icon_url");
+                jw_string(w, embed->footer_url);
+            }
+            jw_end(w, '}');
+        }
+        
+        // Add color (only if non-zero)
+        if (embed->color != 0) {
+            jw_key(w, "color");
+            jw_int(w, embed->color);
+        }
+        
+        // Handle thumbnail
+        if (embed->thumbnail) {
+            jw_key(w, "thumbnail");
+            jw_begin(w, '{');
+            jw_key(w, "url");
+            jw_string(w, embed->thumbnail);
+            jw_end(w, '}');
+        }
+        
+        // Add timestamp
+        if (embed->timestamp != 0) {
+            struct tm tm_utc;
+            char timestamp[64];
+            gmtime_r(&embed->timestamp, &tm_utc);
+            strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S.000Z", &tm_utc);
+            jw_key(w, "timestamp");
+            jw_string(w, timestamp);
+        }
+        
+        jw_end(w, '}');
+        jw_end(w, ']');
+    }
+}
+
+// Serialize a message for the channel messages endpoint into out
+static bool build_message_payload(json_buf_t *out, const discord_message_t *message) {
+    if (!message) return false;
+    
+    json_writer_t w;
+    jw_init(&w, out);
+    jw_begin(&w, '{');
+    write_message_fields(&w, message);
+    jw_end(&w, '}');
+    
+    return !w.failed;
+}
+
+// Serialize an interaction follow-up, which carries its own flags
+static bool build_followup_payload(json_buf_t *out, const discord_message_t *message) {
+    json_writer_t w;
+    jw_init(&w, out);
+    jw_begin(&w, '{');
+    write_message_fields(&w, message);
+    if (message->ephemeral) {
+        jw_key(&w, "flags");
+        jw_int(&w, 64); // EPHEMERAL flag
+    }
+    jw_end(&w, '}');
+    
+    return !w.failed;
+}
+
+// Serialize an interaction callback: {"type":N,"data":{message...,"flags":64}}
+static bool build_interaction_response_payload(json_buf_t *out, int type, const discord_message_t *message) {
+    json_writer_t w;
+    jw_init(&w, out);
+    jw_begin(&w, '{');
+    jw_key(&w, "type");
+    jw_int(&w, type);
+    
+    if (message) {
+        jw_key(&w, "data");
+        jw_begin(&w, '{');
+        write_message_fields(&w, message);
+        
+        // Add ephemeral flag if needed (this goes in the data object)
+        if (message->ephemeral) {
+            jw_key(&w, "flags");
+            jw_int(&w, 64); // EPHEMERAL flag
+        }
+        jw_end(&w, '}');
+    }
+    jw_end(&w, '}');
+    
+    return !w.failed;
+}
+
+// Dispatch tables over the command registry. An index is immutable once
+// published: lookups load it without a lock, and a rebuild publishes a new one
+// and retires the old. A lookup may hold a retired index for any length of
+// time, and rebuilds only follow command registration and ID sync, so retired
+// indexes are kept until discord_cleanup. Slots point at command records,
+// which never move.
+
+typedef struct {
+    uint64_t id;                // Copied, so lookups never read a record's ID mid-update
+    slash_command_t *cmd;       // NULL = empty
+} command_id_slot_t;
+
+struct discord_command_index {
+    discord_command_index_t *retired_next;
+    int count;
+    size_t size;                // Power of two
+    slash_command_t **by_name;
+    command_id_slot_t *by_id;
+};
+
+// Build an index over the current registry (caller holds command_mutex)
+static discord_command_index_t *command_index_create(discord_bot_t *bot) {
+    size_t size = 8;
+    while (size < (size_t)bot->command_count * 2) size *= 2;
+    
+    discord_command_index_t *index = calloc(1, sizeof(discord_command_index_t) +
+                                            size * (sizeof(slash_command_t *) + sizeof(command_id_slot_t)));
+    if (!index) return NULL;
+    index->count = bot->command_count;
+    index->size = size;
+    index->by_id = (command_id_slot_t *)(index + 1);
+    index->by_name = (slash_command_t **)(index->by_id + size);
+    
+    size_t mask = size - 1;
+    for (int i = 0; i < bot->command_count; i++) {
+        slash_command_t *cmd = bot->commands[i];
+        
+        size_t slot = cmd->name_hash & mask;
+        while (index->by_name[slot]) slot = (slot + 1) & mask;
+        index->by_name[slot] = cmd;
+        
+        if (cmd->id) {
+            slot = hash_u64(cmd->id) & mask;
+            while (index->by_id[slot].cmd) slot = (slot + 1) & mask;
+            index->by_id[slot].id = cmd->id;
+            index->by_id[slot].cmd = cmd;
+        }
+    }
+    return index;
+}
+
+// Swap in a new index and retire the old one (caller holds command_mutex)
+static void command_index_publish(discord_bot_t *bot, discord_command_index_t *index) {
+    discord_command_index_t *old = atomic_exchange_explicit(&bot->command_index, index, memory_order_acq_rel);
+    if (old) {
+        old->retired_next = bot->command_index_retired;
+        bot->command_index_retired = old;
+    }
+}
+
+// (Re)build and publish the dispatch index for the current registry
+static int command_index_build(discord_bot_t *bot) {
+    pthread_mutex_lock(&bot->command_mutex);
+    discord_command_index_t *index = command_index_create(bot);
+    if (index) command_index_publish(bot, index);
+    pthread_mutex_unlock(&bot->command_mutex);
+    return index != NULL;
+}
+
+static void command_index_free(discord_bot_t *bot) {
+    free(atomic_exchange(&bot->command_index, NULL));
+    while (bot->command_index_retired) {
+        discord_command_index_t *retired = bot->command_index_retired;
+        bot->command_index_retired = retired->retired_next;
+        free(retired);
+    }
+}
+
+static slash_command_t* command_index_find(const discord_command_index_t *index, uint64_t id,
+                                           const char *name, size_t name_len) {
+    size_t mask = index->size - 1;
+    
+    if (id) {
+        for (size_t slot = hash_u64(id) & mask; index->by_id[slot].cmd; slot = (slot + 1) & mask) {
+            if (index->by_id[slot].id == id) return index->by_id[slot].cmd;
+        }
+    }
+    
+    if (name) {
+        uint64_t hash = hash_bytes(name, name_len);
+        for (size_t slot = hash & mask; index->by_name[slot]; slot = (slot + 1) & mask) {
+            slash_command_t *cmd = index->by_name[slot];
+            if (cmd->name_hash == hash && strncmp(cmd->name, name, name_len) == 0 && cmd->name[name_len] == '\0') {
+                return cmd;
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+// Find the handler for an interaction: by command ID first, then by name
+static slash_command_t* command_lookup(discord_bot_t *bot, uint64_t id, const char *name, size_t name_len) {
+    const discord_command_index_t *index = atomic_load_explicit(&bot->command_index, memory_order_acquire);
+    return index ? command_index_find(index, id, name, name_len) : NULL;
+}
+
+// Work item for the handler pool; stored by value in the queues
+typedef void (*worker_fn_t)(discord_bot_t *bot, void *data, void *context);
+
+typedef struct {
+    worker_fn_t fn;
+    void *data;
+    void *context;
+} worker_job_t;
+
+// Bounded per-worker FIFO. Interactions must be acknowledged within 3 seconds,
+// so both the owner and idle workers stealing from a busy worker's queue take
+// the oldest job, from the head.
+typedef struct {
+    pthread_mutex_t mutex;
+    worker_job_t *jobs;
+    size_t capacity;    // Power of two
+    size_t head;
+    size_t tail;
+    pthread_t thread;
+    bool initialized;   // mutex and jobs are set up
+    bool started;
+    int index;
+    struct discord_worker_pool *pool;
+} worker_queue_t;
+
+struct discord_worker_pool {
+    discord_bot_t *bot;
+    worker_queue_t *queues;
+    int count;
+    
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+    int idle;
+    bool stopping;
+    
+    atomic_size_t pending;
+    atomic_uint next_queue;
+    atomic_uint_fast64_t executed;
+    atomic_uint_fast64_t stolen;
+    atomic_uint_fast64_t dropped;
+};
+
+static bool worker_queue_push(worker_queue_t *queue, const worker_job_t *job) {
+    pthread_mutex_lock(&queue->mutex);
+    bool ok = queue->tail - queue->head < queue->capacity;
+    if (ok) {
+        queue->jobs[queue->tail & (queue->capacity - 1)] = *job;
+        queue->tail++;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return ok;
+}
+
+static bool worker_queue_pop(worker_queue_t *queue, worker_job_t *job) {
+    pthread_mutex_lock(&queue->mutex);
+    bool ok = queue->tail != queue->head;
+    if (ok) {
+        *job = queue->jobs[queue->head & (queue->capacity - 1)];
+        queue->head++;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return ok;
+}
+
+// Own queue first, then steal from the others
+static bool worker_next_job(worker_queue_t *self, worker_job_t *job) {
+    discord_worker_pool_t *pool = self->pool;
+    
+    if (worker_queue_pop(self, job)) return true;
+    
+    for (int i = 1; i < pool->count; i++) {
+        worker_queue_t *victim = &pool->queues[(self->index + i) % pool->count];
+        if (worker_queue_pop(victim, job)) {
+            atomic_fetch_add_explicit(&pool->stolen, 1, memory_order_relaxed);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void* worker_thread_func(void *arg) {
+    worker_queue_t *self = (worker_queue_t *)arg;
+    discord_worker_pool_t *pool = self->pool;
+    
+    for (;;) {
+        worker_job_t job;
+        if (worker_next_job(self, &job)) {
+            atomic_fetch_sub_explicit(&pool->pending, 1, memory_order_relaxed);
+            job.fn(pool->bot, job.data, job.context);
+            atomic_fetch_add_explicit(&pool->executed, 1, memory_order_relaxed);
+            continue;
+        }
+        
+        // Sleep until work arrives; on shutdown, leave once everything queued has run
+        pthread_mutex_lock(&pool->idle_mutex);
+        while (atomic_load(&pool->pending) == 0 && !pool->stopping) {
+            pool->idle++;
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_mutex);
+            pool->idle--;
+        }
+        bool done = pool->stopping && atomic_load(&pool->pending) == 0;
+        pthread_mutex_unlock(&pool->idle_mutex);
+        if (done) break;
+    }
+    
+    return NULL;
+}
+
+// Hand a job to the pool. Never blocks: returns 0 if every queue is full.
+static int worker_pool_submit(discord_bot_t *bot, worker_fn_t fn, void *data, void *context) {
+    discord_worker_pool_t *pool = bot->workers;
+    if (!pool) return 0;
+    
+    worker_job_t job = { fn, data, context };
+    unsigned start = atomic_fetch_add_explicit(&pool->next_queue, 1, memory_order_relaxed);
+    
+    // Counted before the push, so a worker that takes the job at once never
+    // decrements below zero
+    size_t pending = atomic_fetch_add_explicit(&pool->pending, 1, memory_order_relaxed) + 1;
+    for (int i = 0; i < pool->count; i++) {
+        worker_queue_t *queue = &pool->queues[(start + i) % pool->count];
+        if (!worker_queue_push(queue, &job)) continue;
+        
+        histogram_record(&bot->metrics->worker_queue_depth, (uint64_t)pending);
+        pthread_mutex_lock(&pool->idle_mutex);
+        if (pool->idle > 0) {
+            pthread_cond_signal(&pool->idle_cond);
+        }
+        pthread_mutex_unlock(&pool->idle_mutex);
+        return 1;
+    }
+    
+    atomic_fetch_sub_explicit(&pool->pending, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->dropped, 1, memory_order_relaxed);
+    return 0;
+}
+
+static void worker_pool_stop(discord_bot_t *bot);
+
+static int worker_pool_start(discord_bot_t *bot) {
+    int count = bot->worker_count_requested;
+    if (count <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        count = cpus > 0 ? (int)cpus : 1;
+    }
+    int depth = bot->worker_queue_depth > 0 ? bot->worker_queue_depth : 1024;
+    
+    // Split the total depth over the workers, rounded up to a power of two each
+    size_t per_queue = 1;
+    while (per_queue * count < (size_t)depth) per_queue *= 2;
+    
+    discord_worker_pool_t *pool = calloc(1, sizeof(discord_worker_pool_t));
+    if (!pool) return 0;
+    pool->bot = bot;
+    pool->queues = calloc(count, sizeof(worker_queue_t));
+    if (!pool->queues) {
+        free(pool);
+        return 0;
+    }
+    pool->count = count;
+    if (pthread_mutex_init(&pool->idle_mutex, NULL) != 0) {
+        free(pool->queues);
+        free(pool);
+        return 0;
+    }
+    if (pthread_cond_init(&pool->idle_cond, NULL) != 0) {
+        pthread_mutex_destroy(&pool->idle_mutex);
+        free(pool->queues);
+        free(pool);
+        return 0;
+    }
+    bot->workers = pool;
+    
+    // Every queue is ready before any worker can try to steal from it
+    for (int i = 0; i < count; i++) {
+        worker_queue_t *queue = &pool->queues[i];
+        queue->jobs = malloc(per_queue * sizeof(worker_job_t));
+        if (!queue->jobs || pthread_mutex_init(&queue->mutex, NULL) != 0) {
+            free(queue->jobs);
+            queue->jobs = NULL;
+            worker_pool_stop(bot);
+            return 0;
+        }
+        queue->initialized = true;
+        queue->capacity = per_queue;
+        queue->index = i;
+        queue->pool = pool;
+    }
+    
+    for (int i = 0; i < count; i++) {
+        worker_queue_t *queue = &pool->queues[i];
+        if (pthread_create(&queue->thread, NULL, worker_thread_func, queue) != 0) {
+            worker_pool_stop(bot);
+            return 0;
+        }
+        queue->started = true;
+    }
+    
+    return 1;
+}
+
+// Run everything still queued, then join and free the workers
+static void worker_pool_stop(discord_bot_t *bot) {
+    discord_worker_pool_t *pool = bot->workers;
+    if (!pool) return;
+    
+    pthread_mutex_lock(&pool->idle_mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_mutex);
+    
+    for (int i = 0; i < pool->count; i++) {
+        worker_queue_t *queue = &pool->queues[i];
+        if (queue->started) {
+            pthread_join(queue->thread, NULL);
+        }
+    }
+    // Only after every worker is gone: a running one may be stealing from any queue
+    for (int i = 0; i < pool->count; i++) {
+        worker_queue_t *queue = &pool->queues[i];
+        if (!queue->initialized) continue;
+        pthread_mutex_destroy(&queue->mutex);
+        free(queue->jobs);
+    }
+    
+    uint64_t dropped = atomic_load(&pool->dropped);
+    if (dropped) {
+        fprintf(stderr, "Handler pool dropped %llu interactions (queue full)\n", (unsigned long long)dropped);
+    }
+    
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->idle_mutex);
+    free(pool->queues);
+    free(pool);
+    bot->workers = NULL;
+}
+
+// Configure the handler pool (call before discord_start_bot). thread_count 0 uses one
+// worker per CPU; queue_depth is the total number of interactions that may wait.
+void discord_set_worker_pool(discord_bot_t *bot, int thread_count, int queue_depth) {
+    if (!bot) return;
+    
+    bot->worker_count_requested = thread_count;
+    bot->worker_queue_depth = queue_depth;
+}
+
+void discord_set_interaction_arena(discord_bot_t *bot, bool enabled) {
+    if (!bot) return;
+    
+    bot->interaction_arenas = enabled;
+}
+
+// View of a JSON string owned by the frame
+static discord_str_t json_str_view(json_t *value) {
+    discord_str_t view = { "", 0 };
+    if (json_is_string(value)) {
+        view.ptr = json_string_value(value);
+        view.len = json_string_length(value);
+    }
+    return view;
+}
+
+static uint64_t json_snowflake(json_t *value) {
+    return snowflake_parse(json_string_value(value));
+}
+
+// Fill the context from the INTERACTION_CREATE payload with plain lookups
+static void interaction_context_init(discord_interaction_t *ctx, discord_bot_t *bot, json_t *d) {
+    memset(ctx, 0, sizeof(discord_interaction_t));
+    ctx->bot = bot;
+    
+    json_t *data_obj = json_object_get(d, "data");
+    ctx->frame_data = data_obj;
+    ctx->id = json_snowflake(json_object_get(d, "id"));
+    ctx->application_id = json_snowflake(json_object_get(d, "application_id"));
+    ctx->guild_id = json_snowflake(json_object_get(d, "guild_id"));
+    ctx->channel_id = json_snowflake(json_object_get(d, "channel_id"));
+    ctx->token = json_str_view(json_object_get(d, "token"));
+    ctx->locale = json_str_view(json_object_get(d, "locale"));
+    ctx->command_id = json_snowflake(json_object_get(data_obj, "id"));
+    ctx->command_name = json_str_view(json_object_get(data_obj, "name"));
+    
+    // Guild interactions carry the invoking user inside member, DMs at the top level
+    json_t *user = json_object_get(json_object_get(d, "member"), "user");
+    if (!user) user = json_object_get(d, "user");
+    ctx->user_id = json_snowflake(json_object_get(user, "id"));
+    ctx->user_name = json_str_view(json_object_get(user, "username"));
+}
+
+// The option list a handler sees: the command's own, or its subcommand's
+static json_t *interaction_options(const discord_interaction_t *ctx) {
+    if (!ctx) return NULL;
+    
+    json_t *options = json_object_get((json_t *)ctx->frame_data, "options");
+    
+    // Descend through a subcommand group and/or subcommand to the leaf options
+    for (int level = 0; level < 2; level++) {
+        json_t *first = json_array_get(options, 0);
+        json_int_t type = json_integer_value(json_object_get(first, "type"));
+        if (json_array_size(options) != 1 ||
+            (type != DISCORD_OPTION_SUB_COMMAND && type != DISCORD_OPTION_SUB_COMMAND_GROUP)) {
+            break;
+        }
+        options = json_object_get(first, "options");
+    }
+    
+    return options;
+}
+
+static void interaction_option_decode(json_t *opt, discord_option_t *option) {
+    memset(option, 0, sizeof(discord_option_t));
+    
+    json_t *value = json_object_get(opt, "value");
+    option->name = json_str_view(json_object_get(opt, "name"));
+    option->type = (discord_option_type_t)json_integer_value(json_object_get(opt, "type"));
+    
+    switch (option->type) {
+        case DISCORD_OPTION_STRING:
+            option->string = json_str_view(value);
+            break;
+        case DISCORD_OPTION_INTEGER:
+            option->integer = json_integer_value(value);
+            break;
+        case DISCORD_OPTION_NUMBER:
+            option->number = json_number_value(value);
+            break;
+        case DISCORD_OPTION_BOOLEAN:
+            option->boolean = json_is_true(value);
+            break;
+        case DISCORD_OPTION_USER:
+        case DISCORD_OPTION_CHANNEL:
+        case DISCORD_OPTION_ROLE:
+        case DISCORD_OPTION_MENTIONABLE:
+        case DISCORD_OPTION_ATTACHMENT:
+            option->string = json_str_view(value);
+            option->snowflake = json_snowflake(value);
+            break;
+        default:
+            break;
+    }
+}
+
+int discord_interaction_option_count(const discord_interaction_t *ctx) {
+    return (int)json_array_size(interaction_options(ctx));
+}
+
+int discord_interaction_option_at(const discord_interaction_t *ctx, int index, discord_option_t *option) {
+    if (!option || index < 0) return 0;
+    
+    json_t *opt = json_array_get(interaction_options(ctx), (size_t)index);
+    if (!opt) return 0;
+    
+    interaction_option_decode(opt, option);
+    return 1;
+}
+
+int discord_interaction_option(const discord_interaction_t *ctx, const char *name, discord_option_t *option) {
+    if (!name || !option) return 0;
+    
+    json_t *options = interaction_options(ctx);
+    size_t index;
+    json_t *opt;
+    json_array_foreach(options, index, opt) {
+        const char *opt_name = json_string_value(json_object_get(opt, "name"));
+        if (opt_name && strcmp(opt_name, name) == 0) {
+            interaction_option_decode(opt, option);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Reply state of one interaction. Discord needs an answer within 3 seconds: the
+// REST thread ACKs with a deferred response once the threshold passes, and the
+// eventual result then edits that original response.
+typedef enum {
+    DEFERRED_PENDING,       // Nothing sent yet
+    DEFERRED_ACKING,        // Deferred ACK in flight; an edit must wait for it
+    DEFERRED_ACKED,         // Deferred ACK done; the result edits the original
+    DEFERRED_FAILED,        // Deferred ACK rejected; the interaction is dead
+    DEFERRED_DONE           // Result sent or queued
+} deferred_state_t;
+
+struct discord_deferred {
+    discord_bot_t *bot;         // NULL once discord_cleanup detached it (registry lock)
+    discord_deferred_t *prev, *next;    // In bot->deferreds (registry lock)
+    discord_interaction_t ctx;
+    json_t *frame;              // Gateway frame the context views point into
+    pthread_mutex_t mutex;
+    deferred_state_t state;
+    bool ephemeral;
+    bool ack_ephemeral;         // The flag the deferred ACK went out with
+    json_buf_t edit;            // Edit held back until the ACK completes
+    const char *edit_method;    // "PATCH", "POST" (follow-up) or "DELETE", NULL if none held
+    uint64_t started_ns;        // Handler start, for the latency histograms
+    metrics_histogram_t *latency;   // The command's histogram, NULL if its family is full
+    atomic_int refs;            // Completion side, threshold timer, in-flight ACK
+};
+
+// Every bot's unfinished replies. Asynchronous handlers may complete after
+// discord_cleanup, so cleanup detaches the replies from the bot and waits for
+// completions already using it; later ones find no bot and drop the message.
+static pthread_mutex_t deferred_registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t deferred_registry_cond = PTHREAD_COND_INITIALIZER;
+
+static void deferred_unref(discord_deferred_t *deferred) {
+    if (atomic_fetch_sub(&deferred->refs, 1) != 1) return;
+    
+    pthread_mutex_lock(&deferred_registry_mutex);
+    if (deferred->bot) {
+        if (deferred->prev) deferred->prev->next = deferred->next;
+        else deferred->bot->deferreds = deferred->next;
+        if (deferred->next) deferred->next->prev = deferred->prev;
+    }
+    pthread_mutex_unlock(&deferred_registry_mutex);
+    
+    if (deferred->edit_method) rest_body_release(&deferred->edit);
+    pthread_mutex_destroy(&deferred->mutex);
+    json_decref(deferred->frame);
+    free(deferred);
+}
+
+// Pin the bot for a completion, NULL if it has been cleaned up
+static discord_bot_t *deferred_enter(discord_deferred_t *deferred) {
+    pthread_mutex_lock(&deferred_registry_mutex);
+    discord_bot_t *bot = deferred->bot;
+    if (bot) bot->deferred_completing++;
+    pthread_mutex_unlock(&deferred_registry_mutex);
+    return bot;
+}
+
+static void deferred_leave(discord_bot_t *bot) {
+    pthread_mutex_lock(&deferred_registry_mutex);
+    if (--bot->deferred_completing == 0) {
+        pthread_cond_broadcast(&deferred_registry_cond);
+    }
+    pthread_mutex_unlock(&deferred_registry_mutex);
+}
+
+// Cut every unfinished reply loose from the bot, then wait out the completions
+// still sending through it
+static void deferred_detach_all(discord_bot_t *bot) {
+    pthread_mutex_lock(&deferred_registry_mutex);
+    for (discord_deferred_t *deferred = bot->deferreds; deferred; deferred = deferred->next) {
+        deferred->bot = NULL;
+    }
+    bot->deferreds = NULL;
+    while (bot->deferred_completing > 0) {
+        pthread_cond_wait(&deferred_registry_cond, &deferred_registry_mutex);
+    }
+    pthread_mutex_unlock(&deferred_registry_mutex);
+}
+
+static void deferred_original_url(const discord_bot_t *bot, const discord_deferred_t *deferred, char *url, size_t size) {
+    snprintf(url, size, "%s/webhooks/%llu/%s/messages/@original", bot->api_base_url,
+             (unsigned long long)deferred->ctx.application_id, deferred->ctx.token.ptr);
+}
+
+// Queue the held-back edit; the request owns its body from here on. A "POST"
+// result is an ephemeral follow-up that replaces the public placeholder.
+static void deferred_send_edit(discord_bot_t *bot, discord_deferred_t *deferred, const char *method, json_buf_t *body) {
+    char url[512];
+    deferred_original_url(bot, deferred, url, sizeof(url));
+    
+    // Webhook calls are authenticated by the interaction token in the URL
+    if (strcmp(method, "POST") == 0) {
+        json_buf_t none = {0};
+        rest_submit_body(bot, "DELETE", url, &none, false, NULL, NULL);
+        snprintf(url, sizeof(url), "%s/webhooks/%llu/%s", bot->api_base_url,
+                 (unsigned long long)deferred->ctx.application_id, deferred->ctx.token.ptr);
+    }
+    rest_submit_body(bot, method, url, body, false, NULL, NULL);
+}
+
+// Completion of the deferred ACK (REST thread). Without an accepted ACK there
+// is no original response to edit, so a rejected one fails the interaction.
+static void deferred_ack_done(discord_bot_t *bot, const discord_rest_response_t *response, void *userdata) {
+    discord_deferred_t *deferred = (discord_deferred_t *)userdata;
+    bool acked = response->result == CURLE_OK && response->status >= 200 && response->status < 300;
+    
+    pthread_mutex_lock(&deferred->mutex);
+    const char *method = deferred->edit_method;
+    json_buf_t edit = deferred->edit;
+    deferred->edit_method = NULL;
+    memset(&deferred->edit, 0, sizeof(json_buf_t));
+    if (!acked) {
+        deferred->state = DEFERRED_FAILED;
+    } else if (deferred->state == DEFERRED_ACKING) {
+        deferred->state = DEFERRED_ACKED;
+    }
+    pthread_mutex_unlock(&deferred->mutex);
+    
+    if (!acked) {
+        fprintf(stderr, "Deferred ACK for interaction %llu failed (HTTP %ld), dropping its reply\n",
+                (unsigned long long)deferred->ctx.id, response->status);
+        if (method) rest_body_release(&edit);
+    } else if (method) {
+        deferred_send_edit(bot, deferred, method, &edit);
+    }
+    deferred_unref(deferred);
+}
+
+// Threshold timer (REST thread): ACK with type 5 if no reply has been sent yet
+static void deferred_threshold_cb(discord_bot_t *bot, void *data) {
+    discord_deferred_t *deferred = (discord_deferred_t *)data;
+    
+    pthread_mutex_lock(&deferred->mutex);
+    bool ack = deferred->state == DEFERRED_PENDING;
+    bool ephemeral = deferred->ephemeral;
+    if (ack) {
+        deferred->state = DEFERRED_ACKING;
+        deferred->ack_ephemeral = ephemeral;
+    }
+    pthread_mutex_unlock(&deferred->mutex);
+    
+    if (ack) {
+        char url[512];
+        snprintf(url, sizeof(url), "%s/interactions/%llu/%s/callback", bot->api_base_url,
+                 (unsigned long long)deferred->ctx.id, deferred->ctx.token.ptr);
+        
+        // DEFERRED_CHANNEL_MESSAGE_WITH_SOURCE, optionally with the EPHEMERAL flag
+        const char *body = ephemeral ? "{\"type\":5,\"data\":{\"flags\":64}}" : "{\"type\":5}";
+        
+        atomic_fetch_add(&deferred->refs, 1);
+        if (!discord_rest_submit(bot, "POST", url, body, false, deferred_ack_done, deferred)) {
+            // Shutting down: nothing more will be sent for this interaction
+            pthread_mutex_lock(&deferred->mutex);
+            deferred->state = DEFERRED_DONE;
+            pthread_mutex_unlock(&deferred->mutex);
+            deferred_unref(deferred);
+        }
+    }
+    
+    deferred_unref(deferred);
+}
+
+// Wrap a frame (taking over the caller's reference) and arm the threshold timer
+static discord_deferred_t *deferred_create(discord_bot_t *bot, json_t *frame) {
+    discord_deferred_t *deferred = calloc(1, sizeof(discord_deferred_t));
+    if (!deferred) return NULL;
+    
+    if (pthread_mutex_init(&deferred->mutex, NULL) != 0) {
+        free(deferred);
+        return NULL;
+    }
+    deferred->bot = bot;
+    deferred->frame = frame;
+    deferred->state = DEFERRED_PENDING;
+    atomic_init(&deferred->refs, 1);
+    interaction_context_init(&deferred->ctx, bot, json_object_get(frame, "d"));
+    
+    if (deferred->ctx.application_id == 0 && bot->application_id) {
+        deferred->ctx.application_id = snowflake_parse(bot->application_id);
+    }
+    
+    pthread_mutex_lock(&deferred_registry_mutex);
+    deferred->next = bot->deferreds;
+    if (bot->deferreds) bot->deferreds->prev = deferred;
+    bot->deferreds = deferred;
+    pthread_mutex_unlock(&deferred_registry_mutex);
+    
+    if (bot->defer_threshold_ms >= 0) {
+        atomic_fetch_add(&deferred->refs, 1);
+        if (!rest_schedule(bot, bot->defer_threshold_ms, deferred_threshold_cb, deferred)) {
+            atomic_fetch_sub(&deferred->refs, 1);
+        }
+    }
+    
+    return deferred;
+}
+
+void discord_deferred_set_ephemeral(discord_deferred_t *deferred, bool ephemeral) {
+    if (!deferred) return;
+    
+    pthread_mutex_lock(&deferred->mutex);
+    deferred->ephemeral = ephemeral;
+    pthread_mutex_unlock(&deferred->mutex);
+}
+
+void discord_deferred_complete(discord_deferred_t *deferred, discord_message_t *message) {
+    if (!deferred) {
+        discord_destroy_message(message);
+        return;
+    }
+    
+    discord_bot_t *bot = deferred_enter(deferred);
+    if (!bot) {
+        // Completed after discord_cleanup: there is nothing left to send with
+        discord_destroy_message(message);
+        deferred_unref(deferred);
+        return;
+    }
+    
+    pthread_mutex_lock(&deferred->mutex);
+    deferred_state_t state = deferred->state;
+    bool ack_ephemeral = deferred->ack_ephemeral;
+    if (state == DEFERRED_PENDING) {
+        deferred->state = DEFERRED_DONE;
+    }
+    pthread_mutex_unlock(&deferred->mutex);
+    
+    if (state != DEFERRED_DONE) {
+        uint64_t elapsed_ns = monotonic_ns() - deferred->started_ns;
+        histogram_record(&bot->metrics->handler, elapsed_ns);
+        histogram_record(deferred->latency, elapsed_ns);
+    }
+    
+    if (state == DEFERRED_PENDING) {
+        // Still inside the window: answer directly
+        if (message) {
+            char interaction_id[24];
+            snprintf(interaction_id, sizeof(interaction_id), "%llu", (unsigned long long)deferred->ctx.id);
+            discord_send_interaction_response(bot, interaction_id, deferred->ctx.token.ptr, message);
+        }
+    } else if (state == DEFERRED_ACKING || state == DEFERRED_ACKED) {
+        // Serialized outside the lock, then held back if the ACK is still in flight
+        json_buf_t edit = {0};
+        const char *method = "DELETE";
+        if (message) {
+            // Editing can't make a public ACK ephemeral, so that takes a follow-up
+            method = message->ephemeral && !ack_ephemeral ? "POST" : "PATCH";
+            payload_buf_acquire(&edit);
+            bool built = strcmp(method, "POST") == 0 ? build_followup_payload(&edit, message)
+                                                     : build_message_payload(&edit, message);
+            if (!built) {
+                payload_buf_release(&edit);
+                method = NULL;
+            } else if (edit.arena) {
+                // The held edit keeps the interaction's arena alive, like a request would
+                arena_ref(edit.arena);
+            }
+        }
+        
+        if (method) {
+            pthread_mutex_lock(&deferred->mutex);
+            deferred_state_t now = deferred->state;
+            if (now == DEFERRED_ACKING) {
+                deferred->edit = edit;
+                deferred->edit_method = method;
+            }
+            if (now != DEFERRED_FAILED) deferred->state = DEFERRED_DONE;
+            pthread_mutex_unlock(&deferred->mutex);
+            
+            if (now == DEFERRED_ACKED) {
+                deferred_send_edit(bot, deferred, method, &edit);
+            } else if (now == DEFERRED_FAILED) {
+                rest_body_release(&edit);
+            }
+        }
+    }
+    
+    discord_destroy_message(message);
+    deferred_leave(bot);
+    deferred_unref(deferred);
+}
+
+void discord_set_defer_threshold(discord_bot_t *bot, int threshold_ms) {
+    if (!bot) return;
+    
+    bot->defer_threshold_ms = threshold_ms < 0 ? -1 : threshold_ms;
+}
+
+// Worker side of INTERACTION_CREATE: run the handler and send its reply.
+// data is the frame's JSON root; the job's reference passes to the deferred
+// reply, which keeps every view in the context valid until the reply is done.
+static void interaction_job_run(discord_bot_t *bot, void *data, void *context) {
+    json_t *root = (json_t *)data;
+    slash_command_t *cmd = (slash_command_t *)context;
+    
+    discord_deferred_t *deferred = deferred_create(bot, root);
+    if (!deferred) {
+        json_decref(root);
+        return;
+    }
+    deferred->started_ns = monotonic_ns();
+    deferred->latency = metrics_family_get(&bot->metrics->commands, cmd->name);
+    
+    // Async handlers may finish on another thread after this job, so they never
+    // allocate from the job's arena
+    if (cmd->async_handler) {
+        cmd->async_handler(&deferred->ctx, deferred);
+        return;
+    }
+    
+    // With arenas on, everything the handler builds for its reply comes from one
+    // arena; requests sending from it hold references until they complete
+    discord_arena_t *arena = bot->interaction_arenas ? arena_acquire() : NULL;
+    current_arena = arena;
+    
+    // Only the returned message decides ephemerality. If the threshold ACK went
+    // out while the handler ran, an ephemeral reply becomes a follow-up.
+    discord_message_t *response_msg = cmd->handler(&deferred->ctx);
+    discord_deferred_set_ephemeral(deferred, response_msg && response_msg->ephemeral);
+    discord_deferred_complete(deferred, response_msg);
+    
+    current_arena = NULL;
+    arena_unref(arena);
+}
+
+// Entity cache: guilds, channels, roles and members fed by gateway events.
+// Records live inline in open-addressing tables keyed by snowflake. Gateway
+// threads write under one mutex; lookups take no lock and validate their copy
+// against a per-table sequence counter (seqlock). Anything a reader may still be
+// looking at (replaced strings, role lists, old slot arrays) is retired and
+// freed by epoch: a reader publishes the epoch it entered in, and memory retired
+// in an epoch is freed only once no reader is still in that epoch or an earlier one.
+#define CACHE_TOMBSTONE UINT64_MAX
+#define CACHE_MIN_CAPACITY 64
+#define CACHE_READER_SLOTS 64
+#define CACHE_EVICT_SAMPLES 8
+#define CACHE_INTERN_MIN_BUCKETS 256
+
+// Interned, immutable, reference-counted string (guarded by the cache mutex)
+typedef struct cache_string {
+    struct cache_string *next;  // Intern bucket chain
+    uint64_t hash;
+    uint32_t refs;
+    uint32_t len;
+    char data[];
+} cache_string_t;
+
+typedef struct {
+    uint32_t count;
+    uint64_t ids[];
+} cache_role_list_t;
+
+// Common head of every slot
+typedef struct {
+    uint64_t key;               // 0 = empty, CACHE_TOMBSTONE = deleted
+    uint64_t key2;              // Guild ID for members, 0 otherwise
+    atomic_uint_fast64_t last_used;
+} cache_entry_t;
+
+typedef struct {
+    cache_entry_t entry;
+    cache_string_t *name;
+    uint64_t owner_id;
+    int member_count;
+} cache_guild_t;
+
+typedef struct {
+    cache_entry_t entry;
+    cache_string_t *name;
+    uint64_t guild_id;
+    uint64_t parent_id;
+    int type;
+    int position;
+} cache_channel_t;
+
+typedef struct {
+    cache_entry_t entry;
+    cache_string_t *name;
+    uint64_t guild_id;
+    uint64_t permissions;
+    uint32_t color;
+    int position;
+} cache_role_t;
+
+typedef struct {
+    cache_entry_t entry;
+    cache_string_t *username;
+    cache_string_t *nick;
+    cache_role_list_t *roles;
+} cache_member_t;
+
+typedef struct {
+    size_t capacity;            // Power of two
+    unsigned char data[];
+} cache_slots_t;
+
+typedef struct {
+    _Atomic(cache_slots_t *) slots;
+    atomic_uint seq;            // Odd while a writer is modifying the table
+    size_t slot_size;
+    size_t count;
+    size_t tombstones;
+    size_t limit;               // 0 = unlimited
+    size_t evict_cursor;
+    void (*release)(discord_cache_t *cache, void *record);
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    uint64_t evictions;
+} cache_table_t;
+
+typedef struct cache_retired {
+    struct cache_retired *next;
+    uint64_t epoch;             // Epoch the memory was unlinked in
+    size_t bytes;
+    void *ptr;
+} cache_retired_t;
+
+// One reader inside a lookup; slots are claimed per lookup, not per thread
+typedef struct {
+    _Alignas(64) _Atomic uint64_t epoch;    // 0 = free
+} cache_reader_t;
+
+struct discord_cache {
+    pthread_mutex_t mutex;      // Serializes writers
+    atomic_uint_fast64_t clock; // LRU clock
+    bool members_enabled;
+    
+    cache_table_t guilds;
+    cache_table_t channels;
+    cache_table_t roles;
+    cache_table_t members;
+    
+    cache_string_t **intern;
+    size_t intern_buckets;
+    size_t intern_count;
+    size_t string_bytes;
+    size_t role_list_bytes;
+    
+    cache_retired_t *retired;
+    size_t retired_bytes;
+    
+    _Atomic uint64_t epoch;     // Advanced by the writer when it reclaims
+    cache_reader_t readers[CACHE_READER_SLOTS];
+};
+
+static void cache_retire(discord_cache_t *cache, void *ptr, size_t bytes) {
+    if (!ptr) return;
+    
+    cache_retired_t *node = malloc(sizeof(cache_retired_t));
+    if (!node) {
+        // Leaking is safer than freeing under a concurrent reader
+        return;
+    }
+    node->ptr = ptr;
+    node->bytes = bytes;
+    node->epoch = atomic_load_explicit(&cache->epoch, memory_order_relaxed);
+    node->next = cache->retired;
+    cache->retired = node;
+    cache->retired_bytes += bytes;
+}
+
+// Slot hint per thread, so concurrent readers rarely contend for a slot
+static _Thread_local unsigned cache_reader_hint = 0;
+
+// Enter a lookup: publish the current epoch in a free reader slot. Everything
+// retired from here on outlives the lookup.
+static cache_reader_t *cache_read_enter(discord_cache_t *cache) {
+    for (unsigned i = cache_reader_hint;; i = (i + 1) % CACHE_READER_SLOTS) {
+        cache_reader_t *reader = &cache->readers[i];
+        uint64_t free_slot = 0;
+        uint64_t epoch = atomic_load(&cache->epoch);
+        if (atomic_compare_exchange_weak(&reader->epoch, &free_slot, epoch)) {
+            // Pairs with the fence in cache_reclaim: either the writer sees this
+            // slot, or this reader sees everything the writer unlinked
+            atomic_thread_fence(memory_order_seq_cst);
+            cache_reader_hint = i;
+            return reader;
+        }
+    }
+}
+
+static void cache_read_exit(cache_reader_t *reader) {
+    atomic_store_explicit(&reader->epoch, 0, memory_order_release);
+}
+
+// Free retired memory no reader can still be copying from: advance the epoch,
+// then free what was retired before the oldest epoch a reader is still in
+// (writer, under the cache mutex)
+static void cache_reclaim(discord_cache_t *cache, bool all) {
+    if (!cache->retired) return;
+    
+    uint64_t oldest = UINT64_MAX;
+    if (!all) {
+        atomic_fetch_add(&cache->epoch, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        for (int i = 0; i < CACHE_READER_SLOTS; i++) {
+            uint64_t epoch = atomic_load_explicit(&cache->readers[i].epoch, memory_order_acquire);
+            if (epoch && epoch < oldest) oldest = epoch;
+        }
+    }
+    
+    cache_retired_t **link = &cache->retired;
+    while (*link) {
+        cache_retired_t *node = *link;
+        if (node->epoch < oldest) {
+            *link = node->next;
+            cache->retired_bytes -= node->bytes;
+            free(node->ptr);
+            free(node);
+        } else {
+            link = &node->next;
+        }
+    }
+}
+
+static cache_string_t *cache_intern(discord_cache_t *cache, const char *str, size_t len) {
+    if (!str) return NULL;
+    
+    uint64_t hash = hash_bytes(str, len);
+    
+    // Grow the bucket array at load factor 1
+    if (cache->intern_count >= cache->intern_buckets) {
+        size_t buckets = cache->intern_buckets ? cache->intern_buckets * 2 : CACHE_INTERN_MIN_BUCKETS;
+        cache_string_t **table = calloc(buckets, sizeof(cache_string_t *));
+        if (table) {
+            for (size_t i = 0; i < cache->intern_buckets; i++) {
+                cache_string_t *node = cache->intern[i];
+                while (node) {
+                    cache_string_t *next = node->next;
+                    node->next = table[node->hash & (buckets - 1)];
+                    table[node->hash & (buckets - 1)] = node;
+                    node = next;
+                }
+            }
+            free(cache->intern);
+            cache->intern = table;
+            cache->intern_buckets = buckets;
+        }
+        if (!cache->intern) return NULL;
+    }
+    
+    cache_string_t **bucket = &cache->intern[hash & (cache->intern_buckets - 1)];
+    for (cache_string_t *node = *bucket; node; node = node->next) {
+        if (node->hash == hash && node->len == len && memcmp(node->data, str, len) == 0) {
+            node->refs++;
+            return node;
+        }
+    }
+    
+    cache_string_t *node = malloc(sizeof(cache_string_t) + len + 1);
+    if (!node) return NULL;
+    node->hash = hash;
+    node->refs = 1;
+    node->len = (uint32_t)len;
+    memcpy(node->data, str, len);
+    node->data[len] = '\0';
+    node->next = *bucket;
+    *bucket = node;
+    cache->intern_count++;
+    cache->string_bytes += sizeof(cache_string_t) + len + 1;
+    return node;
+}
+
+static cache_string_t *cache_intern_json(discord_cache_t *cache, json_t *value) {
+    if (!json_is_string(value)) return NULL;
+    return cache_intern(cache, json_string_value(value), json_string_length(value));
+}
+
+static void cache_string_release(discord_cache_t *cache, cache_string_t *str) {
+    if (!str || --str->refs > 0) return;
+    
+    cache_string_t **link = &cache->intern[str->hash & (cache->intern_buckets - 1)];
+    while (*link && *link != str) {
+        link = &(*link)->next;
+    }
+    if (*link) *link = str->next;
+    
+    size_t bytes = sizeof(cache_string_t) + str->len + 1;
+    cache->intern_count--;
+    cache->string_bytes -= bytes;
+    cache_retire(cache, str, bytes);
+}
+
+// Copy an interned string out for a reader, truncating to the destination at a
+// codepoint boundary so the copy stays valid UTF-8
+static void cache_string_copy(char *dst, size_t size, const cache_string_t *str) {
+    size_t len = str ? str->len : 0;
+    if (len >= size) {
+        len = size - 1;
+        while (len && ((unsigned char)str->data[len] & 0xc0) == 0x80) len--;
+    }
+    if (len) memcpy(dst, str->data, len);
+    dst[len] = '\0';
+}
+
+static void cache_guild_release(discord_cache_t *cache, void *record) {
+    cache_guild_t *guild = (cache_guild_t *)record;
+    cache_string_release(cache, guild->name);
+}
+
+static void cache_channel_release(discord_cache_t *cache, void *record) {
+    cache_channel_t *channel = (cache_channel_t *)record;
+    cache_string_release(cache, channel->name);
+}
+
+static void cache_role_release(discord_cache_t *cache, void *record) {
+    cache_role_t *role = (cache_role_t *)record;
+    cache_string_release(cache, role->name);
+}
+
+static void cache_role_list_release(discord_cache_t *cache, cache_role_list_t *roles) {
+    if (!roles) return;
+    
+    size_t bytes = sizeof(cache_role_list_t) + roles->count * sizeof(uint64_t);
+    cache->role_list_bytes -= bytes;
+    cache_retire(cache, roles, bytes);
+}
+
+static void cache_member_release(discord_cache_t *cache, void *record) {
+    cache_member_t *member = (cache_member_t *)record;
+    cache_string_release(cache, member->username);
+    cache_string_release(cache, member->nick);
+    cache_role_list_release(cache, member->roles);
+}
+
+static int cache_table_init(cache_table_t *table, size_t slot_size, size_t limit,
+                            void (*release)(discord_cache_t *, void *)) {
+    memset(table, 0, sizeof(cache_table_t));
+    table->slot_size = slot_size;
+    table->limit = limit;
+    table->release = release;
+    
+    cache_slots_t *slots = calloc(1, sizeof(cache_slots_t) + CACHE_MIN_CAPACITY * slot_size);
+    if (!slots) return 0;
+    slots->capacity = CACHE_MIN_CAPACITY;
+    atomic_init(&table->slots, slots);
+    return 1;
+}
+
+static inline cache_entry_t *cache_slot(cache_slots_t *slots, size_t slot_size, size_t index) {
+    return (cache_entry_t *)(slots->data + index * slot_size);
+}
+
+static inline size_t cache_key_hash(uint64_t key, uint64_t key2) {
+    return (size_t)hash_u64(key ^ (key2 * 0x9e3779b97f4a7c15ULL));
+}
+
+// Probe for a live record; safe for readers inside a seqlock section
+static cache_entry_t *cache_table_find(cache_table_t *table, uint64_t key, uint64_t key2) {
+    cache_slots_t *slots = atomic_load_explicit(&table->slots, memory_order_acquire);
+    size_t mask = slots->capacity - 1;
+    size_t index = cache_key_hash(key, key2) & mask;
+    
+    for (size_t probe = 0; probe <= mask; probe++) {
+        cache_entry_t *entry = cache_slot(slots, table->slot_size, (index + probe) & mask);
+        if (entry->key == 0) return NULL;
+        if (entry->key == key && entry->key2 == key2) return entry;
+    }
+    return NULL;
+}
+
+static void cache_write_begin(cache_table_t *table) {
+    atomic_fetch_add_explicit(&table->seq, 1, memory_order_acq_rel);
+}
+
+static void cache_write_end(cache_table_t *table) {
+    atomic_fetch_add_explicit(&table->seq, 1, memory_order_release);
+}
+
+static unsigned cache_read_begin(cache_table_t *table) {
+    unsigned seq;
+    while ((seq = atomic_load_explicit(&table->seq, memory_order_acquire)) & 1) {
+        // A writer is mid-update; its critical sections are short
+    }
+    return seq;
+}
+
+static bool cache_read_retry(cache_table_t *table, unsigned seq) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&table->seq, memory_order_relaxed) != seq;
+}
+
+// Rebuild into a fresh slot array (dropping tombstones), doubling if needed.
+// Called inside a write section; the old array is retired, not freed.
+static int cache_table_rehash(discord_cache_t *cache, cache_table_t *table) {
+    cache_slots_t *old = atomic_load_explicit(&table->slots, memory_order_relaxed);
+    size_t capacity = old->capacity;
+    while ((table->count + 1) * 2 > capacity) capacity *= 2;
+    
+    cache_slots_t *slots = calloc(1, sizeof(cache_slots_t) + capacity * table->slot_size);
+    if (!slots) return 0;
+    slots->capacity = capacity;
+    
+    for (size_t i = 0; i < old->capacity; i++) {
+        cache_entry_t *entry = cache_slot(old, table->slot_size, i);
+        if (entry->key == 0 || entry->key == CACHE_TOMBSTONE) continue;
+        
+        size_t index = cache_key_hash(entry->key, entry->key2) & (capacity - 1);
+        while (cache_slot(slots, table->slot_size, index)->key != 0) {
+            index = (index + 1) & (capacity - 1);
+        }
+        memcpy(cache_slot(slots, table->slot_size, index), entry, table->slot_size);
+    }
+    
+    atomic_store_explicit(&table->slots, slots, memory_order_release);
+    table->tombstones = 0;
+    cache_retire(cache, old, sizeof(cache_slots_t) + old->capacity * table->slot_size);
+    return 1;
+}
+
+static void cache_table_remove_entry(discord_cache_t *cache, cache_table_t *table, cache_entry_t *entry) {
+    table->release(cache, entry);
+    memset((unsigned char *)entry + sizeof(cache_entry_t), 0, table->slot_size - sizeof(cache_entry_t));
+    entry->key = CACHE_TOMBSTONE;
+    entry->key2 = 0;
+    table->count--;
+    table->tombstones++;
+}
+
+// Approximate LRU: evict the least recently used of a few sampled live records
+static void cache_table_evict(discord_cache_t *cache, cache_table_t *table) {
+    cache_slots_t *slots = atomic_load_explicit(&table->slots, memory_order_relaxed);
+    cache_entry_t *victim = NULL;
+    uint64_t oldest = UINT64_MAX;
+    int sampled = 0;
+    
+    for (size_t scanned = 0; scanned < slots->capacity && sampled < CACHE_EVICT_SAMPLES; scanned++) {
+        table->evict_cursor = (table->evict_cursor + 1) & (slots->capacity - 1);
+        cache_entry_t *entry = cache_slot(slots, table->slot_size, table->evict_cursor);
+        if (entry->key == 0 || entry->key == CACHE_TOMBSTONE) continue;
+        
+        uint64_t used = atomic_load_explicit(&entry->last_used, memory_order_relaxed);
+        if (used < oldest) {
+            oldest = used;
+            victim = entry;
+        }
+        sampled++;
+    }
+    
+    if (victim) {
+        cache_table_remove_entry(cache, table, victim);
+        table->evictions++;
+    }
+}
+
+// Find or create the slot for a key. Returns NULL if the table is full and
+// could not grow. Called inside a write section; *created tells the caller
+// whether the record's previous fields need releasing.
+static cache_entry_t *cache_table_upsert(discord_cache_t *cache, cache_table_t *table,
+                                         uint64_t key, uint64_t key2, bool *created) {
+    cache_entry_t *entry = cache_table_find(table, key, key2);
+    if (entry) {
+        *created = false;
+    } else {
+        if (table->limit && table->count >= table->limit) {
+            cache_table_evict(cache, table);
+        }
+        
+        cache_slots_t *slots = atomic_load_explicit(&table->slots, memory_order_relaxed);
+        if ((table->count + table->tombstones + 1) * 4 > slots->capacity * 3) {
+            if (!cache_table_rehash(cache, table)) return NULL;
+            slots = atomic_load_explicit(&table->slots, memory_order_relaxed);
+        }
+        
+        size_t mask = slots->capacity - 1;
+        size_t index = cache_key_hash(key, key2) & mask;
+        for (;;) {
+            entry = cache_slot(slots, table->slot_size, index);
+            if (entry->key == 0 || entry->key == CACHE_TOMBSTONE) break;
+            index = (index + 1) & mask;
+        }
+        if (entry->key == CACHE_TOMBSTONE) table->tombstones--;
+        
+        memset(entry, 0, table->slot_size);
+        entry->key = key;
+        entry->key2 = key2;
+        table->count++;
+        *created = true;
+    }
+    
+    atomic_store_explicit(&entry->last_used, atomic_fetch_add(&cache->clock, 1), memory_order_relaxed);
+    return entry;
+}
+
+static void cache_table_remove(discord_cache_t *cache, cache_table_t *table, uint64_t key, uint64_t key2) {
+    cache_write_begin(table);
+    cache_entry_t *entry = cache_table_find(table, key, key2);
+    if (entry) cache_table_remove_entry(cache, table, entry);
+    cache_write_end(table);
+}
+
+// Remove every record whose guild (key2 or guild_id) matches
+static void cache_table_purge_guild(discord_cache_t *cache, cache_table_t *table, uint64_t guild_id,
+                                    size_t guild_offset) {
+    cache_write_begin(table);
+    cache_slots_t *slots = atomic_load_explicit(&table->slots, memory_order_relaxed);
+    for (size_t i = 0; i < slots->capacity; i++) {
+        cache_entry_t *entry = cache_slot(slots, table->slot_size, i);
+        if (entry->key == 0 || entry->key == CACHE_TOMBSTONE) continue;
+        
+        uint64_t owner = guild_offset ? *(uint64_t *)((unsigned char *)entry + guild_offset) : entry->key2;
+        if (owner == guild_id) {
+            cache_table_remove_entry(cache, table, entry);
+        }
+    }
+    cache_write_end(table);
+}
+
+static void cache_table_free(discord_cache_t *cache, cache_table_t *table) {
+    cache_slots_t *slots = atomic_load_explicit(&table->slots, memory_order_relaxed);
+    if (!slots) return;
+    
+    for (size_t i = 0; i < slots->capacity; i++) {
+        cache_entry_t *entry = cache_slot(slots, table->slot_size, i);
+        if (entry->key != 0 && entry->key != CACHE_TOMBSTONE) {
+            table->release(cache, entry);
+        }
+    }
+    free(slots);
+    atomic_store(&table->slots, NULL);
+}
+
+// Touch a record on lookup; a relaxed store is enough for approximate LRU
+static void cache_touch(discord_cache_t *cache, cache_table_t *table, cache_entry_t *entry) {
+    atomic_store_explicit(&entry->last_used, atomic_load_explicit(&cache->clock, memory_order_relaxed),
+                          memory_order_relaxed);
+    atomic_fetch_add_explicit(&table->hits, 1, memory_order_relaxed);
+}
+
+static void cache_store_guild(discord_cache_t *cache, json_t *obj) {
+    uint64_t id = json_snowflake(json_object_get(obj, "id"));
+    if (!id) return;
+    
+    cache_string_t *name = cache_intern_json(cache, json_object_get(obj, "name"));
+    
+    cache_table_t *table = &cache->guilds;
+    cache_write_begin(table);
+    bool created;
+    cache_guild_t *guild = (cache_guild_t *)cache_table_upsert(cache, table, id, 0, &created);
+    if (guild) {
+        // Partial updates (GUILD_UPDATE) keep fields they do not carry
+        json_t *member_count = json_object_get(obj, "member_count");
+        if (json_is_integer(member_count)) guild->member_count = (int)json_integer_value(member_count);
+        if (json_object_get(obj, "owner_id")) guild->owner_id = json_snowflake(json_object_get(obj, "owner_id"));
+        if (name) {
+            cache_string_release(cache, guild->name);
+            guild->name = name;
+            name = NULL;
+        }
+    }
+    cache_write_end(table);
+    cache_string_release(cache, name);
+}
+
+static void cache_store_channel(discord_cache_t *cache, json_t *obj, uint64_t guild_id) {
+    uint64_t id = json_snowflake(json_object_get(obj, "id"));
+    if (!id) return;
+    
+    json_t *guild = json_object_get(obj, "guild_id");
+    if (guild) guild_id = json_snowflake(guild);
+    cache_string_t *name = cache_intern_json(cache, json_object_get(obj, "name"));
+    
+    cache_table_t *table = &cache->channels;
+    cache_write_begin(table);
+    bool created;
+    cache_channel_t *channel = (cache_channel_t *)cache_table_upsert(cache, table, id, 0, &created);
+    if (channel) {
+        if (!created) cache_channel_release(cache, channel);
+        channel->name = name;
+        name = NULL;
+        channel->guild_id = guild_id;
+        channel->parent_id = json_snowflake(json_object_get(obj, "parent_id"));
+        channel->type = (int)json_integer_value(json_object_get(obj, "type"));
+        channel->position = (int)json_integer_value(json_object_get(obj, "position"));
+    }
+    cache_write_end(table);
+    cache_string_release(cache, name);
+}
+
+static void cache_store_role(discord_cache_t *cache, json_t *obj, uint64_t guild_id) {
+    uint64_t id = json_snowflake(json_object_get(obj, "id"));
+    if (!id) return;
+    
+    cache_string_t *name = cache_intern_json(cache, json_object_get(obj, "name"));
+    
+    cache_table_t *table = &cache->roles;
+    cache_write_begin(table);
+    bool created;
+    cache_role_t *role = (cache_role_t *)cache_table_upsert(cache, table, id, 0, &created);
+    if (role) {
+        if (!created) cache_role_release(cache, role);
+        role->name = name;
+        name = NULL;
+        role->guild_id = guild_id;
+        role->permissions = json_snowflake(json_object_get(obj, "permissions")); // Decimal string
+        role->color = (uint32_t)json_integer_value(json_object_get(obj, "color"));
+        role->position = (int)json_integer_value(json_object_get(obj, "position"));
+    }
+    cache_write_end(table);
+    cache_string_release(cache, name);
+}
+
+static void cache_store_member(discord_cache_t *cache, json_t *obj, uint64_t guild_id) {
+    json_t *user = json_object_get(obj, "user");
+    uint64_t user_id = json_snowflake(json_object_get(user, "id"));
+    if (!user_id || !guild_id) return;
+    
+    cache_string_t *username = cache_intern_json(cache, json_object_get(user, "username"));
+    cache_string_t *nick = cache_intern_json(cache, json_object_get(obj, "nick"));
+    
+    json_t *role_ids = json_object_get(obj, "roles");
+    size_t role_count = json_array_size(role_ids);
+    cache_role_list_t *roles = NULL;
+    if (role_count) {
+        size_t bytes = sizeof(cache_role_list_t) + role_count * sizeof(uint64_t);
+        roles = malloc(bytes);
+        if (roles) {
+            roles->count = (uint32_t)role_count;
+            for (size_t i = 0; i < role_count; i++) {
+                roles->ids[i] = json_snowflake(json_array_get(role_ids, i));
+            }
+            cache->role_list_bytes += bytes;
+        }
+    }
+    
+    cache_table_t *table = &cache->members;
+    cache_write_begin(table);
+    bool created;
+    cache_member_t *member = (cache_member_t *)cache_table_upsert(cache, table, user_id, guild_id, &created);
+    if (member) {
+        if (!created) cache_member_release(cache, member);
+        member->username = username;
+        member->nick = nick;
+        member->roles = roles;
+        username = nick = NULL;
+        roles = NULL;
+    }
+    cache_write_end(table);
+    cache_string_release(cache, username);
+    cache_string_release(cache, nick);
+    cache_role_list_release(cache, roles);
+}
+
+static void cache_store_guild_create(discord_cache_t *cache, json_t *d) {
+    // Unavailable guilds carry no data yet
+    if (json_is_true(json_object_get(d, "unavailable"))) return;
+    
+    uint64_t guild_id = json_snowflake(json_object_get(d, "id"));
+    size_t index;
+    json_t *item;
+    
+    cache_store_guild(cache, d);
+    json_array_foreach(json_object_get(d, "channels"), index, item) {
+        cache_store_channel(cache, item, guild_id);
+    }
+    json_array_foreach(json_object_get(d, "threads"), index, item) {
+        cache_store_channel(cache, item, guild_id);
+    }
+    json_array_foreach(json_object_get(d, "roles"), index, item) {
+        cache_store_role(cache, item, guild_id);
+    }
+    if (cache->members_enabled) {
+        json_array_foreach(json_object_get(d, "members"), index, item) {
+            cache_store_member(cache, item, guild_id);
+        }
+    }
+}
+
+// Events the cache consumes
+static bool cache_wants_event(const discord_cache_t *cache, discord_event_t event) {
+    switch (event) {
+        case DISCORD_EVENT_GUILD_CREATE:
+        case DISCORD_EVENT_GUILD_UPDATE:
+        case DISCORD_EVENT_GUILD_DELETE:
+        case DISCORD_EVENT_CHANNEL_CREATE:
+        case DISCORD_EVENT_CHANNEL_UPDATE:
+        case DISCORD_EVENT_CHANNEL_DELETE:
+        case DISCORD_EVENT_GUILD_ROLE_CREATE:
+        case DISCORD_EVENT_GUILD_ROLE_UPDATE:
+        case DISCORD_EVENT_GUILD_ROLE_DELETE:
+            return true;
+        case DISCORD_EVENT_GUILD_MEMBER_ADD:
+        case DISCORD_EVENT_GUILD_MEMBER_UPDATE:
+        case DISCORD_EVENT_GUILD_MEMBER_REMOVE:
+            return cache->members_enabled;
+        default:
+            return false;
+    }
+}
+
+static void cache_purge_guild(discord_cache_t *cache, uint64_t guild_id) {
+    cache_table_remove(cache, &cache->guilds, guild_id, 0);
+    cache_table_purge_guild(cache, &cache->channels, guild_id, offsetof(cache_channel_t, guild_id));
+    cache_table_purge_guild(cache, &cache->roles, guild_id, offsetof(cache_role_t, guild_id));
+    cache_table_purge_guild(cache, &cache->members, guild_id, 0);
+}
+
+// Feed a dispatch event to the cache (gateway thread). Returns 1 if it applied.
+static int cache_apply_event(discord_cache_t *cache, discord_event_t event, json_t *d) {
+    if (!cache || !d || !cache_wants_event(cache, event)) return 0;
+    
+    uint64_t guild_id = json_snowflake(json_object_get(d, "guild_id"));
+    
+    pthread_mutex_lock(&cache->mutex);
+    switch (event) {
+        case DISCORD_EVENT_GUILD_CREATE:
+            cache_store_guild_create(cache, d);
+            break;
+        case DISCORD_EVENT_GUILD_UPDATE:
+            cache_store_guild(cache, d);
+            break;
+        case DISCORD_EVENT_GUILD_DELETE:
+            // unavailable means an outage, not that the bot left the guild
+            if (!json_is_true(json_object_get(d, "unavailable"))) {
+                cache_purge_guild(cache, json_snowflake(json_object_get(d, "id")));
+            }
+            break;
+        case DISCORD_EVENT_CHANNEL_CREATE:
+        case DISCORD_EVENT_CHANNEL_UPDATE:
+            cache_store_channel(cache, d, guild_id);
+            break;
+        case DISCORD_EVENT_CHANNEL_DELETE:
+            cache_table_remove(cache, &cache->channels, json_snowflake(json_object_get(d, "id")), 0);
+            break;
+        case DISCORD_EVENT_GUILD_ROLE_CREATE:
+        case DISCORD_EVENT_GUILD_ROLE_UPDATE:
+            cache_store_role(cache, json_object_get(d, "role"), guild_id);
+            break;
+        case DISCORD_EVENT_GUILD_ROLE_DELETE:
+            cache_table_remove(cache, &cache->roles, json_snowflake(json_object_get(d, "role_id")), 0);
+            break;
+        case DISCORD_EVENT_GUILD_MEMBER_ADD:
+        case DISCORD_EVENT_GUILD_MEMBER_UPDATE:
+            cache_store_member(cache, d, guild_id);
+            break;
+        case DISCORD_EVENT_GUILD_MEMBER_REMOVE: {
+            uint64_t user_id = json_snowflake(json_object_get(json_object_get(d, "user"), "id"));
+            cache_table_remove(cache, &cache->members, user_id, guild_id);
+            break;
+        }
+        default:
+            break;
+    }
+    cache_reclaim(cache, false);
+    pthread_mutex_unlock(&cache->mutex);
+    
+    return 1;
+}
+
+static void cache_free(discord_cache_t *cache) {
+    if (!cache) return;
+    
+    cache_table_free(cache, &cache->guilds);
+    cache_table_free(cache, &cache->channels);
+    cache_table_free(cache, &cache->roles);
+    cache_table_free(cache, &cache->members);
+    cache_reclaim(cache, true);
+    free(cache->intern);
+    pthread_mutex_destroy(&cache->mutex);
+    free(cache);
+}
+
+int discord_enable_cache(discord_bot_t *bot, const discord_cache_config_t *config) {
+    if (!bot || bot->cache) return 0;
+    
+    discord_cache_config_t defaults = {0};
+    if (!config) config = &defaults;
+    
+    discord_cache_t *cache = calloc(1, sizeof(discord_cache_t));
+    if (!cache) return 0;
+    
+    if (pthread_mutex_init(&cache->mutex, NULL) != 0) {
+        free(cache);
+        return 0;
+    }
+    cache->members_enabled = config->members;
+    atomic_init(&cache->epoch, 1);      // Reader slots use 0 for free
+    
+    if (!cache_table_init(&cache->guilds, sizeof(cache_guild_t), config->max_guilds, cache_guild_release) ||
+        !cache_table_init(&cache->channels, sizeof(cache_channel_t), config->max_channels, cache_channel_release) ||
+        !cache_table_init(&cache->roles, sizeof(cache_role_t), config->max_roles, cache_role_release) ||
+        !cache_table_init(&cache->members, sizeof(cache_member_t), config->max_members, cache_member_release)) {
+        cache_free(cache);
+        return 0;
+    }
+    
+    bot->cache = cache;
+    return 1;
+}
+
+int discord_cache_get_guild(discord_bot_t *bot, uint64_t guild_id, discord_cached_guild_t *out) {
+    if (!bot || !bot->cache || !out || !guild_id) return 0;
+    
+    cache_table_t *table = &bot->cache->guilds;
+    cache_guild_t *guild;
+    unsigned seq;
+    cache_reader_t *reader = cache_read_enter(bot->cache);
+    do {
+        seq = cache_read_begin(table);
+        guild = (cache_guild_t *)cache_table_find(table, guild_id, 0);
+        if (guild) {
+            out->id = guild_id;
+            out->owner_id = guild->owner_id;
+            out->member_count = guild->member_count;
+            cache_string_copy(out->name, sizeof(out->name), guild->name);
+        }
+    } while (cache_read_retry(table, seq));
+    
+    if (!guild) {
+        cache_read_exit(reader);
+        atomic_fetch_add_explicit(&table->misses, 1, memory_order_relaxed);
+        return 0;
+    }
+    cache_touch(bot->cache, table, &guild->entry);
+    cache_read_exit(reader);
+    return 1;
+}
+
+int discord_cache_get_channel(discord_bot_t *bot, uint64_t channel_id, discord_cached_channel_t *out) {
+    if (!bot || !bot->cache || !out || !channel_id) return 0;
+    
+    cache_table_t *table = &bot->cache->channels;
+    cache_channel_t *channel;
+    unsigned seq;
+    cache_reader_t *reader = cache_read_enter(bot->cache);
+    do {
+        seq = cache_read_begin(table);
+        channel = (cache_channel_t *)cache_table_find(table, channel_id, 0);
+        if (channel) {
+            out->id = channel_id;
+            out->guild_id = channel->guild_id;
+            out->parent_id = channel->parent_id;
+            out->type = channel->type;
+            out->position = channel->position;
+            cache_string_copy(out->name, sizeof(out->name), channel->name);
+        }
+    } while (cache_read_retry(table, seq));
+    
+    if (!channel) {
+        cache_read_exit(reader);
+        atomic_fetch_add_explicit(&table->misses, 1, memory_order_relaxed);
+        return 0;
+    }
+    cache_touch(bot->cache, table, &channel->entry);
+    cache_read_exit(reader);
+    return 1;
+}
+
+int discord_cache_get_role(discord_bot_t *bot, uint64_t role_id, discord_cached_role_t *out) {
+    if (!bot || !bot->cache || !out || !role_id) return 0;
+    
+    cache_table_t *table = &bot->cache->roles;
+    cache_role_t *role;
+    unsigned seq;
+    cache_reader_t *reader = cache_read_enter(bot->cache);
+    do {
+        seq = cache_read_begin(table);
+        role = (cache_role_t *)cache_table_find(table, role_id, 0);
+        if (role) {
+            out->id = role_id;
+            out->guild_id = role->guild_id;
+            out->permissions = role->permissions;
+            out->color = role->color;
+            out->position = role->position;
+            cache_string_copy(out->name, sizeof(out->name), role->name);
+        }
+    } while (cache_read_retry(table, seq));
+    
+    if (!role) {
+        cache_read_exit(reader);
+        atomic_fetch_add_explicit(&table->misses, 1, memory_order_relaxed);
+        return 0;
+    }
+    cache_touch(bot->cache, table, &role->entry);
+    cache_read_exit(reader);
+    return 1;
+}
+
+int discord_cache_get_member(discord_bot_t *bot, uint64_t guild_id, uint64_t user_id, discord_cached_member_t *out) {
+    if (!bot || !bot->cache || !out || !guild_id || !user_id) return 0;
+    
+    cache_table_t *table = &bot->cache->members;
+    cache_member_t *member;
+    unsigned seq;
+    cache_reader_t *reader = cache_read_enter(bot->cache);
+    do {
+        seq = cache_read_begin(table);
+        member = (cache_member_t *)cache_table_find(table, user_id, guild_id);
+        if (member) {
+            out->guild_id = guild_id;
+            out->user_id = user_id;
+            cache_string_copy(out->username, sizeof(out->username), member->username);
+            cache_string_copy(out->nick, sizeof(out->nick), member->nick);
+            
+            const cache_role_list_t *roles = member->roles;
+            out->role_count = roles ? (int)roles->count : 0;
+            int copied = out->role_count < DISCORD_CACHE_MEMBER_ROLES ? out->role_count : DISCORD_CACHE_MEMBER_ROLES;
+            for (int i = 0; i < copied; i++) {
+                out->roles[i] = roles->ids[i];
+            }
+        }
+    } while (cache_read_retry(table, seq));
+    
+    if (!member) {
+        cache_read_exit(reader);
+        atomic_fetch_add_explicit(&table->misses, 1, memory_order_relaxed);
+        return 0;
+    }
+    cache_touch(bot->cache, table, &member->entry);
+    cache_read_exit(reader);
+    return 1;
+}
+
+static void cache_table_stats(cache_table_t *table, discord_cache_table_stats_t *stats) {
+    cache_slots_t *slots = atomic_load_explicit(&table->slots, memory_order_relaxed);
+    stats->count = table->count;
+    stats->capacity = slots->capacity;
+    stats->limit = table->limit;
+    stats->bytes = sizeof(cache_slots_t) + slots->capacity * table->slot_size;
+    stats->hits = atomic_load_explicit(&table->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&table->misses, memory_order_relaxed);
+    stats->evictions = table->evictions;
+}
+
+int discord_cache_get_stats(discord_bot_t *bot, discord_cache_stats_t *stats) {
+    if (!bot || !bot->cache || !stats) return 0;
+    
+    discord_cache_t *cache = bot->cache;
+    memset(stats, 0, sizeof(discord_cache_stats_t));
+    
+    pthread_mutex_lock(&cache->mutex);
+    cache_table_stats(&cache->guilds, &stats->guilds);
+    cache_table_stats(&cache->channels, &stats->channels);
+    cache_table_stats(&cache->roles, &stats->roles);
+    cache_table_stats(&cache->members, &stats->members);
+    stats->strings = cache->intern_count;
+    stats->string_bytes = cache->string_bytes + cache->intern_buckets * sizeof(cache_string_t *);
+    stats->role_list_bytes = cache->role_list_bytes;
+    stats->retired_bytes = cache->retired_bytes;
+    pthread_mutex_unlock(&cache->mutex);
+    
+    stats->total_bytes = sizeof(discord_cache_t) + stats->guilds.bytes + stats->channels.bytes +
+                         stats->roles.bytes + stats->members.bytes + stats->string_bytes +
+                         stats->role_list_bytes + stats->retired_bytes;
+    return 1;
+}
+
+static const char *const event_names[DISCORD_EVENT_COUNT] = {
+    "READY",
+    "RESUMED",
+    "APPLICATION_COMMAND_PERMISSIONS_UPDATE",
+    "AUTO_MODERATION_RULE_CREATE",
+    "AUTO_MODERATION_RULE_UPDATE",
+    "AUTO_MODERATION_RULE_DELETE",
+    "AUTO_MODERATION_ACTION_EXECUTION",
+    "CHANNEL_CREATE",
+    "CHANNEL_UPDATE",
+    "CHANNEL_DELETE",
+    "CHANNEL_PINS_UPDATE",
+    "THREAD_CREATE",
+    "THREAD_UPDATE",
+    "THREAD_DELETE",
+    "THREAD_LIST_SYNC",
+    "THREAD_MEMBER_UPDATE",
+    "THREAD_MEMBERS_UPDATE",
+    "ENTITLEMENT_CREATE",
+    "ENTITLEMENT_UPDATE",
+    "ENTITLEMENT_DELETE",
+    "GUILD_CREATE",
+    "GUILD_UPDATE",
+    "GUILD_DELETE",
+    "GUILD_AUDIT_LOG_ENTRY_CREATE",
+    "GUILD_BAN_ADD",
+    "GUILD_BAN_REMOVE",
+    "GUILD_EMOJIS_UPDATE",
+    "GUILD_STICKERS_UPDATE",
+    "GUILD_INTEGRATIONS_UPDATE",
+    "GUILD_MEMBER_ADD",
+    "GUILD_MEMBER_REMOVE",
+    "GUILD_MEMBER_UPDATE",
+    "GUILD_MEMBERS_CHUNK",
+    "GUILD_ROLE_CREATE",
+    "GUILD_ROLE_UPDATE",
+    "GUILD_ROLE_DELETE",
+    "GUILD_SCHEDULED_EVENT_CREATE",
+    "GUILD_SCHEDULED_EVENT_UPDATE",
+    "GUILD_SCHEDULED_EVENT_DELETE",
+    "GUILD_SCHEDULED_EVENT_USER_ADD",
+    "GUILD_SCHEDULED_EVENT_USER_REMOVE",
+    "INTEGRATION_CREATE",
+    "INTEGRATION_UPDATE",
+    "INTEGRATION_DELETE",
+    "INTERACTION_CREATE",
+    "INVITE_CREATE",
+    "INVITE_DELETE",
+    "MESSAGE_CREATE",
+    "MESSAGE_UPDATE",
+    "MESSAGE_DELETE",
+    "MESSAGE_DELETE_BULK",
+    "MESSAGE_REACTION_ADD",
+    "MESSAGE_REACTION_REMOVE",
+    "MESSAGE_REACTION_REMOVE_ALL",
+    "MESSAGE_REACTION_REMOVE_EMOJI",
+    "MESSAGE_POLL_VOTE_ADD",
+    "MESSAGE_POLL_VOTE_REMOVE",
+    "PRESENCE_UPDATE",
+    "STAGE_INSTANCE_CREATE",
+    "STAGE_INSTANCE_UPDATE",
+    "STAGE_INSTANCE_DELETE",
+    "TYPING_START",
+    "USER_UPDATE",
+    "VOICE_STATE_UPDATE",
+    "VOICE_SERVER_UPDATE",
+    "WEBHOOKS_UPDATE",
+};
+
+// Event names map to discord_event_t through a perfect hash: a multiplier is
+// chosen once so every known name lands in its own slot, making a lookup one
+// hash, one table load and one memcmp. EVENT_HASH_SEED is a multiplier known
+// to work for the list above; the search only runs further if the list changes.
+#define EVENT_HASH_BITS 8
+#define EVENT_HASH_SEED 0xcdd4f16a13131177ULL
+
+static uint8_t event_slots[1 << EVENT_HASH_BITS];  // Event + 1, 0 = empty
+static uint64_t event_hash_mult;
+static pthread_once_t event_hash_once = PTHREAD_ONCE_INIT;
+
+static inline size_t event_slot(uint64_t hash, uint64_t mult) {
+    return (size_t)((hash * mult) >> (64 - EVENT_HASH_BITS));
+}
+
+static void event_hash_build(void) {
+    uint64_t hashes[DISCORD_EVENT_COUNT];
+    for (int i = 0; i < DISCORD_EVENT_COUNT; i++) {
+        hashes[i] = hash_bytes(event_names[i], strlen(event_names[i]));
+    }
+    
+    uint64_t mult = EVENT_HASH_SEED;
+    for (;;) {
+        memset(event_slots, 0, sizeof(event_slots));
+        bool collision = false;
+        for (int i = 0; i < DISCORD_EVENT_COUNT && !collision; i++) {
+            size_t slot = event_slot(hashes[i], mult);
+            collision = event_slots[slot] != 0;
+            event_slots[slot] = (uint8_t)(i + 1);
+        }
+        if (!collision) break;
+        mult = hash_u64(mult) | 1;
+    }
+    event_hash_mult = mult;
+}
+
+static discord_event_t event_from_name(const char *name, size_t len) {
+    size_t slot = event_slot(hash_bytes(name, len), event_hash_mult);
+    int index = event_slots[slot] - 1;
+    
+    // Unknown names can land on an occupied slot, so confirm the match
+    if (index < 0 || strncmp(event_names[index], name, len) != 0 || event_names[index][len] != '\0') {
+        return DISCORD_EVENT_UNKNOWN;
+    }
+    return (discord_event_t)index;
+}
+
+const char *discord_event_name(discord_event_t event) {
+    if (event < 0 || event >= DISCORD_EVENT_COUNT) return NULL;
+    return event_names[event];
+}
+
+int discord_on(discord_bot_t *bot, discord_event_t event, discord_event_callback_t callback, void *userdata) {
+    if (!bot || !callback || event < 0 || event >= DISCORD_EVENT_COUNT) return 0;
+    
+    int count = bot->event_handler_count[event];
+    discord_event_handler_t *handlers = realloc(bot->event_handlers[event],
+                                                (count + 1) * sizeof(discord_event_handler_t));
+    if (!handlers) return 0;
+    
+    handlers[count].callback = callback;
+    handlers[count].userdata = userdata;
+    bot->event_handlers[event] = handlers;
+    bot->event_handler_count[event] = count + 1;
+    return 1;
+}
+
+// Run the subscribers of an event on this gateway thread
+static void event_dispatch(discord_bot_t *bot, discord_gateway_t *gw, discord_event_t event, json_t *d) {
+    int count = bot->event_handler_count[event];
+    if (count == 0) return;
+    
+    discord_event_info_t info;
+    info.type = event;
+    info.name = event_names[event];
+    info.shard_id = gw->shard_id;
+    info.data = d;
+    
+    discord_event_handler_t *handlers = bot->event_handlers[event];
+    for (int i = 0; i < count; i++) {
+        handlers[i].callback(bot, &info, handlers[i].userdata);
+    }
+}
+
+// Intents that make Discord send each event
+static const uint32_t event_intents[DISCORD_EVENT_COUNT] = {
+    [DISCORD_EVENT_AUTO_MODERATION_RULE_CREATE] = DISCORD_INTENT_AUTO_MODERATION_CONFIGURATION,
+    [DISCORD_EVENT_AUTO_MODERATION_RULE_UPDATE] = DISCORD_INTENT_AUTO_MODERATION_CONFIGURATION,
+    [DISCORD_EVENT_AUTO_MODERATION_RULE_DELETE] = DISCORD_INTENT_AUTO_MODERATION_CONFIGURATION,
+    [DISCORD_EVENT_AUTO_MODERATION_ACTION_EXECUTION] = DISCORD_INTENT_AUTO_MODERATION_EXECUTION,
+    [DISCORD_EVENT_CHANNEL_CREATE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_CHANNEL_UPDATE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_CHANNEL_DELETE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_CHANNEL_PINS_UPDATE] = DISCORD_INTENT_GUILDS | DISCORD_INTENT_DIRECT_MESSAGES,
+    [DISCORD_EVENT_THREAD_CREATE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_THREAD_UPDATE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_THREAD_DELETE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_THREAD_LIST_SYNC] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_THREAD_MEMBER_UPDATE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_THREAD_MEMBERS_UPDATE] = DISCORD_INTENT_GUILDS | DISCORD_INTENT_GUILD_MEMBERS,
+    [DISCORD_EVENT_GUILD_CREATE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_GUILD_UPDATE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_GUILD_DELETE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_GUILD_AUDIT_LOG_ENTRY_CREATE] = DISCORD_INTENT_GUILD_MODERATION,
+    [DISCORD_EVENT_GUILD_BAN_ADD] = DISCORD_INTENT_GUILD_MODERATION,
+    [DISCORD_EVENT_GUILD_BAN_REMOVE] = DISCORD_INTENT_GUILD_MODERATION,
+    [DISCORD_EVENT_GUILD_EMOJIS_UPDATE] = DISCORD_INTENT_GUILD_EMOJIS_AND_STICKERS,
+    [DISCORD_EVENT_GUILD_STICKERS_UPDATE] = DISCORD_INTENT_GUILD_EMOJIS_AND_STICKERS,
+    [DISCORD_EVENT_GUILD_INTEGRATIONS_UPDATE] = DISCORD_INTENT_GUILD_INTEGRATIONS,
+    [DISCORD_EVENT_GUILD_MEMBER_ADD] = DISCORD_INTENT_GUILD_MEMBERS,
+    [DISCORD_EVENT_GUILD_MEMBER_REMOVE] = DISCORD_INTENT_GUILD_MEMBERS,
+    [DISCORD_EVENT_GUILD_MEMBER_UPDATE] = DISCORD_INTENT_GUILD_MEMBERS,
+    [DISCORD_EVENT_GUILD_ROLE_CREATE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_GUILD_ROLE_UPDATE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_GUILD_ROLE_DELETE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_GUILD_SCHEDULED_EVENT_CREATE] = DISCORD_INTENT_GUILD_SCHEDULED_EVENTS,
+    [DISCORD_EVENT_GUILD_SCHEDULED_EVENT_UPDATE] = DISCORD_INTENT_GUILD_SCHEDULED_EVENTS,
+    [DISCORD_EVENT_GUILD_SCHEDULED_EVENT_DELETE] = DISCORD_INTENT_GUILD_SCHEDULED_EVENTS,
+    [DISCORD_EVENT_GUILD_SCHEDULED_EVENT_USER_ADD] = DISCORD_INTENT_GUILD_SCHEDULED_EVENTS,
+    [DISCORD_EVENT_GUILD_SCHEDULED_EVENT_USER_REMOVE] = DISCORD_INTENT_GUILD_SCHEDULED_EVENTS,
+    [DISCORD_EVENT_INTEGRATION_CREATE] = DISCORD_INTENT_GUILD_INTEGRATIONS,
+    [DISCORD_EVENT_INTEGRATION_UPDATE] = DISCORD_INTENT_GUILD_INTEGRATIONS,
+    [DISCORD_EVENT_INTEGRATION_DELETE] = DISCORD_INTENT_GUILD_INTEGRATIONS,
+    [DISCORD_EVENT_INVITE_CREATE] = DISCORD_INTENT_GUILD_INVITES,
+    [DISCORD_EVENT_INVITE_DELETE] = DISCORD_INTENT_GUILD_INVITES,
+    [DISCORD_EVENT_MESSAGE_CREATE] = DISCORD_INTENT_GUILD_MESSAGES | DISCORD_INTENT_DIRECT_MESSAGES,
+    [DISCORD_EVENT_MESSAGE_UPDATE] = DISCORD_INTENT_GUILD_MESSAGES | DISCORD_INTENT_DIRECT_MESSAGES,
+    [DISCORD_EVENT_MESSAGE_DELETE] = DISCORD_INTENT_GUILD_MESSAGES | DISCORD_INTENT_DIRECT_MESSAGES,
+    [DISCORD_EVENT_MESSAGE_DELETE_BULK] = DISCORD_INTENT_GUILD_MESSAGES,
+    [DISCORD_EVENT_MESSAGE_REACTION_ADD] = DISCORD_INTENT_GUILD_MESSAGE_REACTIONS | DISCORD_INTENT_DIRECT_MESSAGE_REACTIONS,
+    [DISCORD_EVENT_MESSAGE_REACTION_REMOVE] = DISCORD_INTENT_GUILD_MESSAGE_REACTIONS | DISCORD_INTENT_DIRECT_MESSAGE_REACTIONS,
+    [DISCORD_EVENT_MESSAGE_REACTION_REMOVE_ALL] = DISCORD_INTENT_GUILD_MESSAGE_REACTIONS | DISCORD_INTENT_DIRECT_MESSAGE_REACTIONS,
+    [DISCORD_EVENT_MESSAGE_REACTION_REMOVE_EMOJI] = DISCORD_INTENT_GUILD_MESSAGE_REACTIONS | DISCORD_INTENT_DIRECT_MESSAGE_REACTIONS,
+    [DISCORD_EVENT_MESSAGE_POLL_VOTE_ADD] = DISCORD_INTENT_GUILD_MESSAGE_POLLS | DISCORD_INTENT_DIRECT_MESSAGE_POLLS,
+    [DISCORD_EVENT_MESSAGE_POLL_VOTE_REMOVE] = DISCORD_INTENT_GUILD_MESSAGE_POLLS | DISCORD_INTENT_DIRECT_MESSAGE_POLLS,
+    [DISCORD_EVENT_PRESENCE_UPDATE] = DISCORD_INTENT_GUILD_PRESENCES,
+    [DISCORD_EVENT_STAGE_INSTANCE_CREATE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_STAGE_INSTANCE_UPDATE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_STAGE_INSTANCE_DELETE] = DISCORD_INTENT_GUILDS,
+    [DISCORD_EVENT_TYPING_START] = DISCORD_INTENT_GUILD_MESSAGE_TYPING | DISCORD_INTENT_DIRECT_MESSAGE_TYPING,
+    [DISCORD_EVENT_VOICE_STATE_UPDATE] = DISCORD_INTENT_GUILD_VOICE_STATES,
+    [DISCORD_EVENT_WEBHOOKS_UPDATE] = DISCORD_INTENT_GUILD_WEBHOOKS,
+};
+
+void discord_set_intents(discord_bot_t *bot, uint32_t intents) {
+    if (!bot) return;
+    
+    bot->intents = intents;
+    bot->intents_explicit = true;
+}
+
+void discord_add_intents(discord_bot_t *bot, uint32_t intents) {
+    if (!bot) return;
+    
+    bot->intents_extra |= intents;
+}
+
+// Effective intents: the explicit set, or what subscriptions and the cache need
+uint32_t discord_get_intents(discord_bot_t *bot) {
+    if (!bot) return 0;
+    if (bot->intents_explicit) return bot->intents;
+    
+    uint32_t intents = bot->intents_extra;
+    for (int i = 0; i < DISCORD_EVENT_COUNT; i++) {
+        if (bot->event_handler_count[i] > 0) {
+            intents |= event_intents[i];
+        }
+    }
+    if (bot->cache) {
+        intents |= DISCORD_INTENT_GUILDS;
+        if (bot->cache->members_enabled) intents |= DISCORD_INTENT_GUILD_MEMBERS;
+    }
+    return intents;
+}
+
+void discord_set_gateway_decoder(discord_bot_t *bot, discord_decoder_t decoder) {
+    if (!bot) return;
+    bot->gateway_decoder = decoder;
+}
+
+// Whether anything consumes an event; the rest are dropped before parsing
+static bool event_wanted(discord_bot_t *bot, discord_event_t event) {
+    if (event == DISCORD_EVENT_UNKNOWN) return false;
+    if (bot->event_handler_count[event] > 0) return true;
+    
+    switch (event) {
+        case DISCORD_EVENT_READY:
+        case DISCORD_EVENT_RESUMED:
+            return true;
+        case DISCORD_EVENT_INTERACTION_CREATE: {
+            const discord_command_index_t *index = atomic_load_explicit(&bot->command_index, memory_order_acquire);
+            return index && index->count > 0;
+        }
+        default:
+            return bot->cache && cache_wants_event(bot->cache, event);
+    }
+}
+
+// Top-level fields of a gateway frame, read straight from the raw bytes
+typedef struct {
+    int op;
+    const char *t;              // NULL if null or absent
+    size_t t_len;
+    int64_t seq;                // -1 if null or absent
+} gateway_frame_head_t;
+
+static const char *prescan_ws(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+    return p;
+}
+
+// Skip a string starting at its opening quote; returns the byte after the closing one
+static const char *prescan_skip_string(const char *p, const char *end) {
+    for (p++; p < end; p++) {
+        if (*p == '\\') {
+            p++;
+        } else if (*p == '"') {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+// Skip any JSON value without building it
+static const char *prescan_skip_value(const char *p, const char *end) {
+    if (p >= end) return NULL;
+    if (*p == '"') return prescan_skip_string(p, end);
+    
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (p < end) {
+            char c = *p;
+            if (c == '"') {
+                p = prescan_skip_string(p, end);
+                if (!p) return NULL;
+                continue;
+            }
+            if (c == '{' || c == '[') depth++;
+            else if (c == '}' || c == ']') {
+                if (--depth == 0) return p + 1;
+            }
+            p++;
+        }
+        return NULL;
+    }
+    
+    // Number, true, false or null
+    while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\n' && *p != '\r' && *p != '\t') p++;
+    return p;
+}
+
+static const char *prescan_integer(const char *p, const char *end, int64_t *value, bool *present) {
+    *present = false;
+    if (p < end && *p == 'n') return prescan_skip_value(p, end);
+    
+    bool negative = p < end && *p == '-';
+    if (negative) p++;
+    int64_t v = 0;
+    const char *start = p;
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (*p - '0');
+        p++;
+    }
+    if (p == start) return NULL;
+    *value = negative ? -v : v;
+    *present = true;
+    return p;
+}
+
+// Pull op, t and s out of a frame without parsing it. Returns 0 if the frame does
+// not look like a plain gateway object; the caller then parses it normally.
+static int gateway_prescan(const char *msg, size_t len, gateway_frame_head_t *head) {
+    const char *p = msg;
+    const char *end = msg + len;
+    bool have_op = false, have_t = false, have_s = false;
+    
+    head->op = -1;
+    head->t = NULL;
+    head->t_len = 0;
+    head->seq = -1;
+    
+    p = prescan_ws(p, end);
+    if (p >= end || *p != '{') return 0;
+    p++;
+    
+    while (!(have_op && have_t && have_s)) {
+        p = prescan_ws(p, end);
+        if (p >= end || *p == '}') break;
+        if (*p == ',') {
+            p++;
+            continue;
+        }
+        if (*p != '"') return 0;
+        
+        const char *key = p + 1;
+        p = prescan_skip_string(p, end);
+        if (!p) return 0;
+        size_t key_len = (size_t)(p - key - 1);
+        
+        p = prescan_ws(p, end);
+        if (p >= end || *p != ':') return 0;
+        p = prescan_ws(p + 1, end);
+        if (p >= end) return 0;
+        
+        if (key_len == 2 && memcmp(key, "op", 2) == 0) {
+            int64_t op;
+            bool present;
+            p = prescan_integer(p, end, &op, &present);
+            if (!p || !present) return 0;
+            head->op = (int)op;
+            have_op = true;
+        } else if (key_len == 1 && key[0] == 's') {
+            bool present;
+            p = prescan_integer(p, end, &head->seq, &present);
+            if (!p) return 0;
+            if (!present) head->seq = -1;
+            have_s = true;
+        } else if (key_len == 1 && key[0] == 't') {
+            if (*p == '"') {
+                const char *value = p + 1;
+                p = prescan_skip_string(p, end);
+                if (!p) return 0;
+                head->t = value;
+                head->t_len = (size_t)(p - value - 1);
+                // Event names never need unescaping; anything else takes the slow path
+                if (memchr(head->t, '\\', head->t_len)) return 0;
+            } else {
+                p = prescan_skip_value(p, end);
+                if (!p) return 0;
+            }
+            have_t = true;
+        } else {
+            p = prescan_skip_value(p, end);
+            if (!p) return 0;
+        }
+    }
+    
+    return have_op;
+}
+
+// On-demand gateway decoder. Stage 1 classifies the frame 64 bytes at a time
+// into quote, backslash and structural bitmasks (AVX2, SSE4.2 or scalar,
+// picked at runtime), masks out everything inside strings and records the
+// offset of every structural character and string quote. Stage 2 validates the
+// grammar over that index and links each '{'/'[' to its closing bracket, so
+// lookups by path hop over whole subtrees without materializing anything.
+#define OD_MAX_DEPTH 256
+
+struct discord_od_doc {
+    const char *json;
+    size_t len;
+    uint32_t *index;            // Byte offsets of structurals and quotes
+    uint32_t *match;            // For an opening bracket, the index of its close
+    size_t count;
+    size_t cap;
+};
+
+typedef enum {
+    OD_MISSING,
+    OD_OBJECT,
+    OD_ARRAY,
+    OD_STRING,
+    OD_SCALAR                   // Number, true, false or null
+} od_kind_t;
+
+// A value: k is its first index entry (for scalars, the entry just after it)
+typedef struct {
+    od_kind_t kind;
+    uint32_t k;
+    uint32_t offset;            // Byte offset of the value
+} od_value_t;
+
+typedef void (*od_classify_fn)(const unsigned char *block, uint64_t *quote, uint64_t *backslash, uint64_t *structural);
+
+static void od_classify_scalar(const unsigned char *block, uint64_t *quote, uint64_t *backslash, uint64_t *structural) {
+    uint64_t q = 0, bs = 0, st = 0;
+    for (int i = 0; i < 64; i++) {
+        unsigned char c = block[i];
+        uint64_t bit = 1ULL << i;
+        if (c == '"') q |= bit;
+        else if (c == '\\') bs |= bit;
+        else if (c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',') st |= bit;
+    }
+    *quote = q;
+    *backslash = bs;
+    *structural = st;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OD_HAVE_X86 1
+
+// SSE4.2: PCMPESTRM matches each 16-byte lane against the structural set at once
+__attribute__((target("sse4.2")))
+static void od_classify_sse42(const unsigned char *block, uint64_t *quote, uint64_t *backslash, uint64_t *structural) {
+    const __m128i set = _mm_setr_epi8('{', '}', '[', ']', ':', ',', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i q_char = _mm_set1_epi8('"');
+    const __m128i bs_char = _mm_set1_epi8('\\');
+    uint64_t q = 0, bs = 0, st = 0;
+    
+    for (int i = 0; i < 4; i++) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(block + i * 16));
+        __m128i hits = _mm_cmpestrm(set, 6, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_UNIT_MASK);
+        st |= (uint64_t)(uint16_t)_mm_movemask_epi8(hits) << (i * 16);
+        q |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, q_char)) << (i * 16);
+        bs |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, bs_char)) << (i * 16);
+    }
+    *quote = q;
+    *backslash = bs;
+    *structural = st;
+}
+
+// AVX2: two 32-byte lanes; the structural set is one nibble-table lookup.
+// '{' 0x7b, '}' 0x7d, '[' 0x5b, ']' 0x5d, ':' 0x3a and ',' 0x2c are told
+// apart by low nibble (b, d, a, c) and high nibble (7, 5, 3, 2).
+__attribute__((target("avx2")))
+static void od_classify_avx2(const unsigned char *block, uint64_t *quote, uint64_t *backslash, uint64_t *structural) {
+    // One bit per high nibble; a low nibble lists the high nibbles it pairs with
+    const __m256i lo_table = _mm256_setr_epi8(
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 3, 8, 3, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 3, 8, 3, 0, 0);
+    const __m256i hi_table = _mm256_setr_epi8(
+        0, 0, 8, 4, 0, 2, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 0, 8, 4, 0, 2, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i q_char = _mm256_set1_epi8('"');
+    const __m256i bs_char = _mm256_set1_epi8('\\');
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t q = 0, bs = 0, st = 0;
+    
+    for (int i = 0; i < 2; i++) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(block + i * 32));
+        __m256i lo = _mm256_shuffle_epi8(lo_table, _mm256_and_si256(chunk, nibble));
+        __m256i hi = _mm256_shuffle_epi8(hi_table, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibble));
+        __m256i hits = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), zero);
+        
+        st |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(hits) << (i * 32);
+        q |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, q_char)) << (i * 32);
+        bs |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, bs_char)) << (i * 32);
+    }
+    *quote = q;
+    *backslash = bs;
+    *structural = st;
+}
+#endif
+
+static od_classify_fn od_classify = od_classify_scalar;
+static pthread_once_t od_classify_once = PTHREAD_ONCE_INIT;
+
+static void od_classify_select(void) {
+#ifdef OD_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        od_classify = od_classify_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        od_classify = od_classify_sse42;
+    }
+#endif
+}
+
+// Characters preceded by an odd run of backslashes (carried across blocks)
+static uint64_t od_escaped(uint64_t backslash, uint64_t *prev_escaped) {
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    
+    if (!backslash) {
+        uint64_t escaped = *prev_escaped;
+        *prev_escaped = 0;
+        return escaped;
+    }
+    backslash &= ~*prev_escaped;
+    uint64_t follows_escape = backslash << 1 | *prev_escaped;
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t sequences_on_even;
+    *prev_escaped = __builtin_add_overflow(odd_starts, backslash, &sequences_on_even);
+    uint64_t invert_mask = sequences_on_even << 1;
+    return (even_bits ^ invert_mask) & follows_escape;
+}
+
+// Running XOR: bit i is set if an odd number of quotes occur at or before i
+static uint64_t od_prefix_xor(uint64_t x) {
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+static int od_stage1(discord_od_doc_t *doc) {
+    const unsigned char *json = (const unsigned char *)doc->json;
+    uint64_t prev_escaped = 0;
+    uint64_t prev_in_string = 0;
+    unsigned char tail[64];
+    size_t count = 0;
+    
+    for (size_t base = 0; base < doc->len; base += 64) {
+        const unsigned char *block = json + base;
+        if (doc->len - base < 64) {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, block, doc->len - base);
+            block = tail;
+        }
+        
+        uint64_t quote, backslash, structural;
+        od_classify(block, &quote, &backslash, &structural);
+        
+        quote &= ~od_escaped(backslash, &prev_escaped);
+        uint64_t in_string = od_prefix_xor(quote) ^ prev_in_string;
+        prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+        
+        // Structurals outside strings, plus both quotes of every string
+        uint64_t bits = (structural & ~in_string) | quote;
+        while (bits) {
+            doc->index[count++] = (uint32_t)(base + (size_t)__builtin_ctzll(bits));
+            bits &= bits - 1;
+        }
+    }
+    
+    doc->count = count;
+    return prev_in_string == 0; // Unterminated string otherwise
+}
+
+static bool od_is_ws(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// A scalar between two index entries must be a well-formed literal or a number
+// in the JSON grammar: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+static bool od_valid_scalar(const char *p, size_t len) {
+    if (len == 4 && (memcmp(p, "true", 4) == 0 || memcmp(p, "null", 4) == 0)) return true;
+    if (len == 5 && memcmp(p, "false", 5) == 0) return true;
+    
+    const char *end = p + len;
+    if (p < end && *p == '-') p++;
+    if (p == end || *p < '0' || *p > '9') return false;
+    if (*p++ != '0') {
+        while (p < end && *p >= '0' && *p <= '9') p++;
+    }
+    if (p < end && *p == '.') {
+        p++;
+        if (p == end || *p < '0' || *p > '9') return false;
+        while (p < end && *p >= '0' && *p <= '9') p++;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) p++;
+        if (p == end || *p < '0' || *p > '9') return false;
+        while (p < end && *p >= '0' && *p <= '9') p++;
+    }
+    return p == end;
+}
+
+static bool od_hex4(const char *p, const char *end, uint32_t *out) {
+    if (end - p < 4) return false;
+    
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9') v |= (uint32_t)(c - '0');
+        else if (c >= 'a' && c <= 'f') v |= (uint32_t)(c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') v |= (uint32_t)(c - 'A' + 10);
+        else return false;
+    }
+    *out = v;
+    return true;
+}
+
+// String contents between the quotes: valid UTF-8, no control characters and
+// only the escapes JSON defines, with \u surrogates properly paired
+static bool od_valid_string(const char *p, size_t len) {
+    const unsigned char *s = (const unsigned char *)p;
+    size_t i = 0;
+    
+    while (i < len) {
+        unsigned char c = s[i];
+        if (c >= 0x80) {
+            size_t n = utf8_sequence_length(s + i, len - i);
+            if (!n) return false;
+            i += n;
+            continue;
+        }
+        if (c < 0x20) return false;
+        if (c != '\\') {
+            i++;
+            continue;
+        }
+        
+        if (++i == len) return false;
+        c = s[i++];
+        if (c != 'u') {
+            if (c == '\0' || !strchr("\"\\/bfnrt", c)) return false;
+            continue;
+        }
+        uint32_t cp, low;
+        if (!od_hex4(p + i, p + len, &cp)) return false;
+        i += 4;
+        // jansson rejects \u0000 and unpaired surrogates too
+        if (cp == 0 || (cp >= 0xdc00 && cp <= 0xdfff)) return false;
+        if (cp >= 0xd800 && cp <= 0xdbff) {
+            if (len - i < 6 || s[i] != '\\' || s[i + 1] != 'u' || !od_hex4(p + i + 2, p + len, &low) ||
+                low < 0xdc00 || low > 0xdfff) {
+                return false;
+            }
+            i += 6;
+        }
+    }
+    return true;
+}
+
+typedef enum {
+    OD_EXPECT_VALUE,
+    OD_EXPECT_VALUE_OR_END,     // After '['
+    OD_EXPECT_KEY,              // After ',' in an object
+    OD_EXPECT_KEY_OR_END,       // After '{'
+    OD_EXPECT_COLON,
+    OD_EXPECT_COMMA_OR_END,
+    OD_EXPECT_NOTHING           // Root value complete
+} od_expect_t;
+
+// Validate the token sequence and link brackets
+static int od_stage2(discord_od_doc_t *doc) {
+    const char *json = doc->json;
+    uint32_t stack[OD_MAX_DEPTH];
+    int depth = 0;
+    od_expect_t expect = OD_EXPECT_VALUE;
+    size_t gap_start = 0;
+    
+    for (size_t k = 0; k <= doc->count; k++) {
+        size_t at = k < doc->count ? doc->index[k] : doc->len;
+        
+        // Anything between tokens is whitespace or a single scalar value
+        size_t s = gap_start, e = at;
+        while (s < e && od_is_ws(json[s])) s++;
+        while (e > s && od_is_ws(json[e - 1])) e--;
+        if (s < e) {
+            if (expect != OD_EXPECT_VALUE && expect != OD_EXPECT_VALUE_OR_END) return 0;
+            if (!od_valid_scalar(json + s, e - s)) return 0;
+            expect = depth ? OD_EXPECT_COMMA_OR_END : OD_EXPECT_NOTHING;
+        }
+        if (k == doc->count) break;
+        
+        char c = json[at];
+        gap_start = at + 1;
+        
+        switch (c) {
+            case '"':
+                // A string spans this quote and the next one
+                if (k + 1 >= doc->count) return 0;
+                k++;
+                gap_start = doc->index[k] + 1;
+                if (!od_valid_string(json + at + 1, doc->index[k] - at - 1)) return 0;
+                if (expect == OD_EXPECT_KEY || expect == OD_EXPECT_KEY_OR_END) {
+                    expect = OD_EXPECT_COLON;
+                } else if (expect == OD_EXPECT_VALUE || expect == OD_EXPECT_VALUE_OR_END) {
+                    expect = depth ? OD_EXPECT_COMMA_OR_END : OD_EXPECT_NOTHING;
+                } else {
+                    return 0;
+                }
+                break;
+            case '{':
+            case '[':
+                if (expect != OD_EXPECT_VALUE && expect != OD_EXPECT_VALUE_OR_END) return 0;
+                if (depth == OD_MAX_DEPTH) return 0;
+                stack[depth++] = (uint32_t)k;
+                expect = c == '{' ? OD_EXPECT_KEY_OR_END : OD_EXPECT_VALUE_OR_END;
+                break;
+            case '}':
+            case ']': {
+                if (depth == 0) return 0;
+                uint32_t open = stack[depth - 1];
+                char open_c = json[doc->index[open]];
+                if ((c == '}') != (open_c == '{')) return 0;
+                if (expect != OD_EXPECT_COMMA_OR_END &&
+                    expect != (c == '}' ? OD_EXPECT_KEY_OR_END : OD_EXPECT_VALUE_OR_END)) {
+                    return 0;
+                }
+                doc->match[open] = (uint32_t)k;
+                depth--;
+                expect = depth ? OD_EXPECT_COMMA_OR_END : OD_EXPECT_NOTHING;
+                break;
+            }
+            case ':':
+                if (expect != OD_EXPECT_COLON) return 0;
+                expect = OD_EXPECT_VALUE;
+                break;
+            case ',':
+                if (expect != OD_EXPECT_COMMA_OR_END) return 0;
+                expect = json[doc->index[stack[depth - 1]]] == '{' ? OD_EXPECT_KEY : OD_EXPECT_VALUE;
+                break;
+            default:
+                return 0;
+        }
+    }
+    
+    return expect == OD_EXPECT_NOTHING;
+}
+
+static discord_od_doc_t *od_doc_new(void) {
+    pthread_once(&od_classify_once, od_classify_select);
+    return calloc(1, sizeof(discord_od_doc_t));
+}
+
+static void od_doc_free(discord_od_doc_t *doc) {
+    if (!doc) return;
+    
+    free(doc->index);
+    free(doc->match);
+    free(doc);
+}
+
+// Index and validate a frame. The document borrows json until the next parse.
+static int od_parse(discord_od_doc_t *doc, const char *json, size_t len) {
+    if (len >= UINT32_MAX) return 0;
+    
+    // Every byte could be an index entry; the buffers are reused across frames
+    if (len + 1 > doc->cap) {
+        size_t cap = doc->cap ? doc->cap : 4096;
+        while (cap < len + 1) cap *= 2;
+        uint32_t *index = realloc(doc->index, cap * sizeof(uint32_t));
+        if (!index) return 0;
+        doc->index = index;
+        uint32_t *match = realloc(doc->match, cap * sizeof(uint32_t));
+        if (!match) return 0;
+        doc->match = match;
+        doc->cap = cap;
+    }
+    
+    doc->json = json;
+    doc->len = len;
+    doc->count = 0;
+    return od_stage1(doc) && od_stage2(doc);
+}
+
+// Value whose text starts at or after byte offset from; k is the next index entry
+static od_value_t od_value_at(const discord_od_doc_t *doc, uint32_t k, size_t from) {
+    od_value_t value = { OD_MISSING, k, 0 };
+    while (from < doc->len && od_is_ws(doc->json[from])) from++;
+    
+    value.offset = (uint32_t)from;
+    if (k < doc->count && doc->index[k] == from) {
+        char c = doc->json[from];
+        value.kind = c == '{' ? OD_OBJECT : c == '[' ? OD_ARRAY : c == '"' ? OD_STRING : OD_MISSING;
+    } else if (from < doc->len) {
+        value.kind = OD_SCALAR;
+    }
+    return value;
+}
+
+static od_value_t od_root(const discord_od_doc_t *doc) {
+    return od_value_at(doc, 0, 0);
+}
+
+// Index entry just past a value
+static uint32_t od_value_end(const discord_od_doc_t *doc, od_value_t value) {
+    switch (value.kind) {
+        case OD_OBJECT:
+        case OD_ARRAY:
+            return doc->match[value.k] + 1;
+        case OD_STRING:
+            return value.k + 2;
+        default:
+            return value.k;
+    }
+}
+
+static od_value_t od_object_get(const discord_od_doc_t *doc, od_value_t object, const char *key, size_t key_len) {
+    od_value_t missing = { OD_MISSING, 0, 0 };
+    if (object.kind != OD_OBJECT) return missing;
+    
+    uint32_t k = object.k + 1;
+    while (k < doc->count && doc->json[doc->index[k]] == '"') {
+        // Keys compare raw; the ones looked up never need unescaping
+        uint32_t key_start = doc->index[k] + 1;
+        uint32_t key_end = doc->index[k + 1];
+        od_value_t value = od_value_at(doc, k + 3, doc->index[k + 2] + 1);
+        
+        if (key_end - key_start == key_len && memcmp(doc->json + key_start, key, key_len) == 0) {
+            return value;
+        }
+        
+        k = od_value_end(doc, value);
+        if (k >= doc->count || doc->json[doc->index[k]] != ',') break;
+        k++;
+    }
+    return missing;
+}
+
+static bool od_get_int(const discord_od_doc_t *doc, od_value_t value, int64_t *out) {
+    if (value.kind != OD_SCALAR) return false;
+    
+    const char *p = doc->json + value.offset;
+    const char *end = doc->json + doc->len;
+    bool negative = p < end && *p == '-';
+    if (negative) p++;
+    if (p >= end || *p < '0' || *p > '9') return false;
+    
+    int64_t v = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        v = v * 10 + (*p - '0');
+        p++;
+    }
+    *out = negative ? -v : v;
+    return true;
+}
+
+static bool od_is_true(const discord_od_doc_t *doc, od_value_t value) {
+    return value.kind == OD_SCALAR && doc->len - value.offset >= 4 && memcmp(doc->json + value.offset, "true", 4) == 0;
+}
+
+// Raw view of a string value (escapes left as they are)
+static bool od_get_raw_string(const discord_od_doc_t *doc, od_value_t value, const char **str, size_t *len) {
+    if (value.kind != OD_STRING) return false;
+    
+    *str = doc->json + doc->index[value.k] + 1;
+    *len = doc->index[value.k + 1] - doc->index[value.k] - 1;
+    return true;
+}
+
+static size_t od_utf8_encode(uint32_t cp, char *out) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xc0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3f));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xe0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+        out[2] = (char)(0x80 | (cp & 0x3f));
+        return 3;
+    }
+    out[0] = (char)(0xf0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    out[3] = (char)(0x80 | (cp & 0x3f));
+    return 4;
+}
+
+// Copy a string value into out, decoding escapes and truncating to size
+static bool od_copy_string(const discord_od_doc_t *doc, od_value_t value, char *out, size_t size) {
+    const char *p, *end;
+    size_t len;
+    if (size == 0 || !od_get_raw_string(doc, value, &p, &len)) return false;
+    end = p + len;
+    
+    size_t n = 0;
+    while (p < end) {
+        char buf[4];
+        size_t buf_len = 1;
+        
+        if (*p != '\\') {
+            buf[0] = *p++;
+        } else {
+            if (++p >= end) return false;
+            char esc = *p++;
+            switch (esc) {
+                case '"': case '\\': case '/': buf[0] = esc; break;
+                case 'b': buf[0] = '\b'; break;
+                case 'f': buf[0] = '\f'; break;
+                case 'n': buf[0] = '\n'; break;
+                case 'r': buf[0] = '\r'; break;
+                case 't': buf[0] = '\t'; break;
+                case 'u': {
+                    uint32_t cp, low;
+                    if (!od_hex4(p, end, &cp)) return false;
+                    p += 4;
+                    // Surrogate pair
+                    if (cp >= 0xd800 && cp <= 0xdbff && end - p >= 6 && p[0] == '\\' && p[1] == 'u' &&
+                        od_hex4(p + 2, end, &low) && low >= 0xdc00 && low <= 0xdfff) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                        p += 6;
+                    }
+                    buf_len = od_utf8_encode(cp, buf);
+                    break;
+                }
+                default:
+                    return false;
+            }
+        }
+        
+        if (n + buf_len >= size) break;
+        memcpy(out + n, buf, buf_len);
+        n += buf_len;
+    }
+    out[n] = '\0';
+    return true;
+}
+
+// Drop the session so the next connection identifies from scratch
+static void gateway_clear_session(discord_gateway_t *gw) {
+    gw->session_id[0] = '\0';
+    gw->resume_gateway_url[0] = '\0';
+    gw->sequence = -1;
+}
+
+// Ask for a WRITEABLE callback. Replayed frames have no connection behind them
+// (wsi is NULL), so there is nothing to wake.
+static void gateway_wake_writer(struct lws *wsi) {
+    if (wsi) lws_callback_on_writable(wsi);
+}
+
+// Close the connection from the service loop; the thread then reconnects and resumes
+static void gateway_request_close(discord_gateway_t *gw, struct lws *wsi) {
+    gw->close_requested = true;
+    gateway_wake_writer(wsi);
+}
+
+// Outbound gateway frames. Everything sent on a connection is queued here and
+// written only from LWS_CALLBACK_CLIENT_WRITEABLE, one frame per callback, and
+// never while lws still holds unsent bytes of an earlier frame. Discord closes
+// connections that send more than 120 frames a minute; the last two sends of
+// each window are kept for heartbeats.
+#define GATEWAY_TX_SLOTS 8
+#define GATEWAY_SEND_LIMIT 120
+#define GATEWAY_SEND_WINDOW_MS 60000
+#define GATEWAY_SEND_RESERVED 2
+#define GATEWAY_HEARTBEAT_PREFIX "{\"op\":1,\"d\":"
+
+struct discord_gateway_tx {
+    json_buf_t frames[GATEWAY_TX_SLOTS];    // Ring of queued frames, each behind LWS_PRE bytes of headroom
+    unsigned head;
+    unsigned count;
+    int64_t sent_ms[GATEWAY_SEND_LIMIT];    // Ring of the latest send times, oldest at sent_next
+    unsigned sent_next;
+    unsigned char heartbeat[LWS_PRE + sizeof(GATEWAY_HEARTBEAT_PREFIX) + 24];   // Scratch, rebuilt per send
+};
+
+// A new connection starts with an empty queue and a fresh send window
+static void gateway_tx_clear(discord_gateway_tx_t *tx) {
+    tx->head = 0;
+    tx->count = 0;
+    tx->sent_next = 0;
+    for (int i = 0; i < GATEWAY_SEND_LIMIT; i++) {
+        tx->sent_ms[i] = INT64_MIN / 2;
+    }
+}
+
+static discord_gateway_tx_t *gateway_tx_get(discord_gateway_t *gw) {
+    if (!gw->tx && (gw->tx = calloc(1, sizeof(discord_gateway_tx_t)))) {
+        gateway_tx_clear(gw->tx);
+    }
+    return gw->tx;
+}
+
+static void gateway_tx_free(discord_gateway_t *gw) {
+    if (!gw->tx) return;
+    
+    for (int i = 0; i < GATEWAY_TX_SLOTS; i++) {
+        free(gw->tx->frames[i].data);
+    }
+    free(gw->tx);
+    gw->tx = NULL;
+}
+
+// Claim the next slot for a frame; write it with a json_writer_t, then queue it
+// with gateway_tx_commit. Slots keep their buffers, so steady-state sends don't
+// allocate. NULL if the queue is full.
+static json_buf_t *gateway_tx_begin(discord_gateway_t *gw) {
+    discord_gateway_tx_t *tx = gateway_tx_get(gw);
+    if (!tx || tx->count == GATEWAY_TX_SLOTS) {
+        fprintf(stderr, "Shard %d: gateway send queue full, dropping frame\n", gw->shard_id);
+        return NULL;
+    }
+    
+    json_buf_t *frame = &tx->frames[(tx->head + tx->count) % GATEWAY_TX_SLOTS];
+    if (!buffer_reserve((void **)&frame->data, &frame->cap, LWS_PRE + 1)) return NULL;
+    frame->len = LWS_PRE;
+    return frame;
+}
+
+static void gateway_tx_commit(discord_gateway_t *gw, struct lws *wsi) {
+    gw->tx->count++;
+    gateway_wake_writer(wsi);
+}
+
+// Write the heartbeat into its scratch buffer; returns its length. The whole
+// frame is rebuilt every time, because lws_write masks the payload in place.
+static size_t gateway_heartbeat_frame(discord_gateway_tx_t *tx, int64_t sequence) {
+    char *start = (char *)tx->heartbeat + LWS_PRE;
+    memcpy(start, GATEWAY_HEARTBEAT_PREFIX, sizeof(GATEWAY_HEARTBEAT_PREFIX) - 1);
+    char *p = start + sizeof(GATEWAY_HEARTBEAT_PREFIX) - 1;
+    
+    if (sequence < 0) {
+        memcpy(p, "null", 4);
+        p += 4;
+    } else {
+        char digits[20];
+        int n = 0;
+        uint64_t value = (uint64_t)sequence;
+        do {
+            digits[n++] = (char)('0' + value % 10);
+            value /= 10;
+        } while (value);
+        while (n > 0) *p++ = digits[--n];
+    }
+    *p++ = '}';
+    return (size_t)(p - start);
+}
+
+// Milliseconds until a send fits the rate limit, leaving reserved sends unused
+static int64_t gateway_tx_wait_ms(const discord_gateway_tx_t *tx, int64_t now, int reserved) {
+    // The (limit - reserved)th most recent send must have left the window
+    int64_t sent = tx->sent_ms[(tx->sent_next + (unsigned)reserved) % GATEWAY_SEND_LIMIT];
+    int64_t wait_ms = sent + GATEWAY_SEND_WINDOW_MS - now;
+    return wait_ms > 0 ? wait_ms : 0;
+}
+
+// The send window has room again
+static void gateway_tx_cb(lws_sorted_usec_list_t *sul) {
+    discord_gateway_t *gw = lws_container_of(sul, discord_gateway_t, sul_tx);
+    if (gw->wsi) lws_callback_on_writable(gw->wsi);
+}
+
+// Write at most one frame: a due heartbeat first, then the oldest queued frame.
+// Returns -1 if the connection has failed.
+static int gateway_tx_write(discord_bot_t *bot, discord_gateway_t *gw, struct lws *wsi) {
+    discord_gateway_tx_t *tx = gateway_tx_get(gw);
+    if (!tx) return -1;
+    
+    bool heartbeat = gw->heartbeat_due;
+    if (!heartbeat && tx->count == 0) return 0;
+    
+    // lws still holds part of an earlier frame and calls back once it has gone
+    if (lws_send_pipe_choked(wsi)) {
+        lws_callback_on_writable(wsi);
+        return 0;
+    }
+    
+    int64_t now = monotonic_ms();
+    int64_t wait_ms = gateway_tx_wait_ms(tx, now, heartbeat ? 0 : GATEWAY_SEND_RESERVED);
+    if (wait_ms > 0) {
+        lws_sul_schedule(gw->context, 0, &gw->sul_tx, gateway_tx_cb, wait_ms * LWS_US_PER_MS);
+        return 0;
+    }
+    
+    unsigned char *payload;
+    size_t len;
+    if (heartbeat) {
+        gw->heartbeat_due = false;
+        len = gateway_heartbeat_frame(tx, gw->sequence);
+        payload = tx->heartbeat + LWS_PRE;
+    } else {
+        json_buf_t *frame = &tx->frames[tx->head];
+        payload = (unsigned char *)frame->data + LWS_PRE;
+        len = frame->len - LWS_PRE;
+        tx->head = (tx->head + 1) % GATEWAY_TX_SLOTS;
+        tx->count--;
+    }
+    
+    // lws buffers whatever the socket doesn't take (see the choke check above);
+    // a short count means the connection is gone
+    if (lws_write(wsi, payload, len, LWS_WRITE_TEXT) < (int)len) return -1;
+    tx->sent_ms[tx->sent_next] = now;
+    tx->sent_next = (tx->sent_next + 1) % GATEWAY_SEND_LIMIT;
+    
+    if (heartbeat) {
+        pthread_mutex_lock(&bot->latency_mutex);
+        gw->heartbeat_sent_us = lws_now_usecs();
+        gw->heartbeat_acked = 0;
+        pthread_mutex_unlock(&bot->latency_mutex);
+    }
+    
+    if (gw->heartbeat_due || tx->count > 0) {
+        lws_callback_on_writable(wsi);
+    }
+    return 0;
+}
+
+// Identifies are limited to one per 5 seconds per concurrency bucket
+// (shard_id % max_concurrency). Claims the slot and returns 0 if this shard may
+// identify now, otherwise the milliseconds until the bucket opens.
+static int64_t gateway_identify_gate(discord_bot_t *bot, discord_gateway_t *gw) {
+    int bucket = gw->shard_id % bot->max_concurrency;
+    int64_t now = monotonic_ms();
+    int64_t wait_ms = 0;
+    
+    pthread_mutex_lock(&bot->identify_mutex);
+    if (now >= bot->identify_next_ms[bucket]) {
+        bot->identify_next_ms[bucket] = now + 5000;
+    } else {
+        wait_ms = bot->identify_next_ms[bucket] - now;
+    }
+    pthread_mutex_unlock(&bot->identify_mutex);
+    
+    return wait_ms;
+}
+
+// Queue IDENTIFY (opcode 2) to start a new session
+static void gateway_send_identify(discord_bot_t *bot, discord_gateway_t *gw, struct lws *wsi) {
+    json_buf_t *frame = gateway_tx_begin(gw);
+    if (!frame) return;
+    
+    json_writer_t w;
+    jw_init(&w, frame);
+    jw_begin(&w, '{');
+    jw_key(&w, "op");
+    jw_int(&w, 2);
+    jw_key(&w, "d");
+    jw_begin(&w, '{');
+    jw_key(&w, "token");
+    jw_string(&w, bot->token);
+    jw_key(&w, "intents");
+    jw_int(&w, discord_get_intents(bot));
+    
+    jw_key(&w, "shard");
+    jw_begin(&w, '[');
+    jw_int(&w, gw->shard_id);
+    jw_int(&w, bot->shard_count);
+    jw_end(&w, ']');
+    
+    jw_key(&w, "properties");
+    jw_begin(&w, '{');
+    jw_key(&w, "$os");
+    jw_string(&w, "linux");
+    jw_key(&w, "$browser");
+    jw_string(&w, "discord_c_lib");
+    jw_key(&w, "$device");
+    jw_string(&w, "discord_c_lib");
+    jw_end(&w, '}');
+    jw_end(&w, '}');
+    jw_end(&w, '}');
+    
+    if (!w.failed) gateway_tx_commit(gw, wsi);
+}
+
+// Queue RESUME (opcode 6) so Discord replays the events we missed
+static void gateway_send_resume(discord_bot_t *bot, discord_gateway_t *gw, struct lws *wsi) {
+    json_buf_t *frame = gateway_tx_begin(gw);
+    if (!frame) return;
+    
+    json_writer_t w;
+    jw_init(&w, frame);
+    jw_begin(&w, '{');
+    jw_key(&w, "op");
+    jw_int(&w, 6);
+    jw_key(&w, "d");
+    jw_begin(&w, '{');
+    jw_key(&w, "token");
+    jw_string(&w, bot->token);
+    jw_key(&w, "session_id");
+    jw_string(&w, gw->session_id);
+    jw_key(&w, "seq");
+    if (gw->sequence >= 0) {
+        jw_int(&w, gw->sequence);
+    } else {
+        jw_null(&w);
+    }
+    jw_end(&w, '}');
+    jw_end(&w, '}');
+    
+    if (!w.failed) gateway_tx_commit(gw, wsi);
+}
+
+static void gateway_connect(discord_bot_t *bot, discord_gateway_t *gw);
+
+// Heartbeat timer. A heartbeat still unacknowledged when the next one is due means
+// the connection is a zombie: close it so the shard reconnects and resumes.
+static void gateway_heartbeat_cb(lws_sorted_usec_list_t *sul) {
+    discord_gateway_t *gw = lws_container_of(sul, discord_gateway_t, sul_heartbeat);
+    if (!gw->wsi) return;
+    
+    pthread_mutex_lock(&gw->bot->latency_mutex);
+    int acked = gw->heartbeat_acked;
+    pthread_mutex_unlock(&gw->bot->latency_mutex);
+    
+    if (!acked) {
+        printf("Shard %d: heartbeat not acknowledged, reconnecting\n", gw->shard_id);
+        gw->close_requested = true;
+    } else {
+        gw->heartbeat_due = true;
+        lws_sul_schedule(gw->context, 0, &gw->sul_heartbeat, gateway_heartbeat_cb,
+                         (lws_usec_t)gw->heartbeat_interval * LWS_US_PER_MS);
+    }
+    lws_callback_on_writable(gw->wsi);
+}
+
+// A delayed identify whose concurrency bucket may now be open
+static void gateway_identify_cb(lws_sorted_usec_list_t *sul) {
+    discord_gateway_t *gw = lws_container_of(sul, discord_gateway_t, sul_identify);
+    if (!gw->wsi) return;
+    
+    int64_t wait_ms = gateway_identify_gate(gw->bot, gw);
+    if (wait_ms > 0) {
+        lws_sul_schedule(gw->context, 0, &gw->sul_identify, gateway_identify_cb, wait_ms * LWS_US_PER_MS);
+        return;
+    }
+    gw->identify_due = true;
+    lws_callback_on_writable(gw->wsi);
+}
+
+// Reconnect timer
+static void gateway_connect_cb(lws_sorted_usec_list_t *sul) {
+    discord_gateway_t *gw = lws_container_of(sul, discord_gateway_t, sul_connect);
+    if (gw->wsi || gw->fatal || atomic_load(&gw->bot->should_stop)) return;
+    
+    gateway_connect(gw->bot, gw);
+}
+
+// HELLO (opcode 10): start heartbeating, then resume or identify
+static void gateway_on_hello(discord_bot_t *bot, discord_gateway_t *gw, struct lws *wsi, int64_t heartbeat_interval) {
+    if (heartbeat_interval > 0) {
+        gw->heartbeat_interval = (int)heartbeat_interval;
+    }
+    
+    // A fresh connection has no heartbeat outstanding
+    pthread_mutex_lock(&bot->latency_mutex);
+    gw->heartbeat_acked = 1;
+    pthread_mutex_unlock(&bot->latency_mutex);
+    
+    // A replayed HELLO has no connection to heartbeat or identify on
+    if (!wsi) return;
+    
+    // The first heartbeat goes out after interval * jitter, as Discord specifies
+    if (gw->heartbeat_interval > 0) {
+        lws_usec_t first_us = (lws_usec_t)(gw->heartbeat_interval * random_fraction() * LWS_US_PER_MS);
+        lws_sul_schedule(gw->context, 0, &gw->sul_heartbeat, gateway_heartbeat_cb, first_us);
+    }
+    
+    int64_t identify_wait_ms;
+    if (gw->session_id[0]) {
+        printf("Shard %d: resuming session %s at sequence %lld\n", gw->shard_id, gw->session_id, (long long)gw->sequence);
+        gateway_send_resume(bot, gw, wsi);
+    } else if ((identify_wait_ms = gateway_identify_gate(bot, gw)) == 0) {
+        gateway_send_identify(bot, gw, wsi);
+    } else {
+        // Another shard in this concurrency bucket identified recently; retry
+        // when the bucket opens
+        lws_sul_schedule(gw->context, 0, &gw->sul_identify, gateway_identify_cb,
+                         identify_wait_ms * LWS_US_PER_MS);
+    }
+}
+
+// HEARTBEAT_ACK (opcode 11)
+static void gateway_on_heartbeat_ack(discord_bot_t *bot, discord_gateway_t *gw) {
+    // Nothing to measure against an ACK for a heartbeat this process never sent
+    if (gw->heartbeat_sent_us == 0) return;
+    
+    lws_usec_t ack_us = lws_now_usecs();
+    pthread_mutex_lock(&bot->latency_mutex);
+    gw->heartbeat_acked = 1;
+    gw->latency_ms = (long)((ack_us - gw->heartbeat_sent_us + LWS_US_PER_MS / 2) / LWS_US_PER_MS);
+    pthread_mutex_unlock(&bot->latency_mutex);
+    
+    histogram_record(&bot->metrics->heartbeat_rtt, (uint64_t)(ack_us - gw->heartbeat_sent_us) * 1000);
+}
+
+// INVALID_SESSION (opcode 9); resumable tells whether the session survives
+static void gateway_on_invalid_session(discord_gateway_t *gw, struct lws *wsi, bool resumable) {
+    if (!resumable) {
+        printf("Session invalidated, re-identifying\n");
+        gateway_clear_session(gw);
+    }
+    // Discord asks for a random 1-5 second wait before the next attempt
+    gw->reconnect_delay_ms = 1000 + (int64_t)(random_fraction() * 4000.0);
+    gateway_request_close(gw, wsi);
+}
+
+// Hand an application command to the worker pool; the job takes a reference to root
+static void gateway_submit_interaction(discord_bot_t *bot, json_t *root, slash_command_t *cmd) {
+    if (worker_pool_submit(bot, interaction_job_run, json_incref(root), cmd) == 0) {
+        fprintf(stderr, "Handler queue full, dropping /%s\n", cmd->name);
+        json_decref(root);
+    }
+}
+
+// Decode a frame through the on-demand index. Control opcodes and the READY
+// and RESUMED bookkeeping are read straight from the index. Returns 0 without
+// side effects (other than the sequence) when the frame needs the jansson path:
+// invalid JSON, an interaction, or an event with subscribers or cache interest.
+// decode_ns receives the time spent indexing either way.
+static int gateway_handle_ondemand(discord_bot_t *bot, discord_gateway_t *gw, struct lws *wsi,
+                                   const char *msg, size_t len, uint64_t *decode_ns) {
+    if (!gw->od && !(gw->od = od_doc_new())) return 0;
+    discord_od_doc_t *doc = gw->od;
+    uint64_t start_ns = monotonic_ns();
+    int parsed = od_parse(doc, msg, len);
+    *decode_ns = monotonic_ns() - start_ns;
+    if (!parsed) return 0;
+    
+    od_value_t root = od_root(doc);
+    int64_t opcode, seq;
+    if (!od_get_int(doc, od_object_get(doc, root, "op", 2), &opcode)) return 0;
+    od_value_t d = od_object_get(doc, root, "d", 1);
+    
+    switch (opcode) {
+        case 10: {
+            int64_t heartbeat_interval = 0;
+            od_get_int(doc, od_object_get(doc, d, "heartbeat_interval", 18), &heartbeat_interval);
+            gateway_on_hello(bot, gw, wsi, heartbeat_interval);
+            return 1;
+        }
+        case 11:
+            gateway_on_heartbeat_ack(bot, gw);
+            return 1;
+        case 1:
+            gw->heartbeat_due = true;
+            gateway_wake_writer(wsi);
+            return 1;
+        case 7:
+            printf("Gateway requested reconnect\n");
+            gateway_request_close(gw, wsi);
+            return 1;
+        case 9:
+            gateway_on_invalid_session(gw, wsi, od_is_true(doc, d));
+            return 1;
+        case 0:
+            break;
+        default:
+            return 1;
+    }
+    
+    if (od_get_int(doc, od_object_get(doc, root, "s", 1), &seq)) {
+        gw->sequence = seq;
+    }
+    
+    const char *t;
+    size_t t_len;
+    if (!od_get_raw_string(doc, od_object_get(doc, root, "t", 1), &t, &t_len)) return 1;
+    discord_event_t event = event_from_name(t, t_len);
+    if (event == DISCORD_EVENT_UNKNOWN) return 1;
+    if (bot->event_handler_count[event] > 0) return 0;
+    
+    switch (event) {
+        case DISCORD_EVENT_READY:
+            if (!od_copy_string(doc, od_object_get(doc, d, "session_id", 10), gw->session_id, sizeof(gw->session_id))) {
+                gw->session_id[0] = '\0';
+            }
+            if (!od_copy_string(doc, od_object_get(doc, d, "resume_gateway_url", 18),
+                                gw->resume_gateway_url, sizeof(gw->resume_gateway_url))) {
+                gw->resume_gateway_url[0] = '\0';
+            }
+            gw->reconnect_attempts = 0;
+            return 1;
+        case DISCORD_EVENT_RESUMED:
+            printf("Session resumed\n");
+            gw->reconnect_attempts = 0;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Decode a frame into a jansson tree: the fallback path, and the one that feeds
+// subscribers and the cache. decode_ns is time already spent on the frame by
+// the on-demand index, so a frame handed back is recorded once.
+static void gateway_handle_json(discord_bot_t *bot, discord_gateway_t *gw, struct lws *wsi,
+                                const char *msg, size_t len, uint64_t decode_ns) {
+    // Parse the JSON message in place
+    json_error_t error;
+    uint64_t start_ns = monotonic_ns();
+    json_t *root = json_loadb(msg, len, 0, &error);
+    histogram_record(&bot->metrics->decode, decode_ns + monotonic_ns() - start_ns);
+    if (!root) {
+        printf("JSON parse error: %s\n", error.text);
+        return;
+    }
+    
+    json_t *op = json_object_get(root, "op");
+    json_t *t = json_object_get(root, "t");
+    json_t *d = json_object_get(root, "d");
+    
+    if (!op) {
+        json_decref(root);
+        return;
+    }
+    
+    int opcode = json_integer_value(op);
+    
+    // Track the sequence number for heartbeats and RESUME
+    json_t *seq = json_object_get(root, "s");
+    if (json_is_integer(seq)) {
+        gw->sequence = json_integer_value(seq);
+    }
+    
+    // Handle HELLO message (opcode 10)
+    if (opcode == 10) {
+        json_t *heartbeat_interval = json_object_get(d, "heartbeat_interval");
+        gateway_on_hello(bot, gw, wsi, json_is_integer(heartbeat_interval) ? json_integer_value(heartbeat_interval) : 0);
+    }
+    // Handle HEARTBEAT_ACK (opcode 11)
+    else if (opcode == 11) {
+        gateway_on_heartbeat_ack(bot, gw);
+    }
+    // Handle HEARTBEAT request (opcode 1): send one immediately
+    else if (opcode == 1) {
+        gw->heartbeat_due = true;
+        gateway_wake_writer(wsi);
+    }
+    // Handle RECONNECT (opcode 7)
+    else if (opcode == 7) {
+        printf("Gateway requested reconnect\n");
+        gateway_request_close(gw, wsi);
+    }
+    // Handle INVALID_SESSION (opcode 9); d tells whether the session can be resumed
+    else if (opcode == 9) {
+        gateway_on_invalid_session(gw, wsi, json_is_true(d));
+    }
+    // Handle dispatch events (opcode 0). A null or unknown t is ignored.
+    else if (opcode == 0 && json_is_string(t)) {
+        discord_event_t event = event_from_name(json_string_value(t), json_string_length(t));
+        
+        switch (event) {
+            case DISCORD_EVENT_READY: {
+                json_t *session_id = json_object_get(d, "session_id");
+                json_t *resume_url = json_object_get(d, "resume_gateway_url");
+                snprintf(gw->session_id, sizeof(gw->session_id), "%s",
+                         json_is_string(session_id) ? json_string_value(session_id) : "");
+                snprintf(gw->resume_gateway_url, sizeof(gw->resume_gateway_url), "%s",
+                         json_is_string(resume_url) ? json_string_value(resume_url) : "");
+                gw->reconnect_attempts = 0;
+                break;
+            }
+            case DISCORD_EVENT_RESUMED:
+                printf("Session resumed\n");
+                gw->reconnect_attempts = 0;
+                break;
+            // Handle INTERACTION_CREATE (slash commands)
+            case DISCORD_EVENT_INTERACTION_CREATE: {
+                json_t *interaction_type = json_object_get(d, "type");
+                
+                // Type 2 = Application Command
+                if (interaction_type && json_integer_value(interaction_type) == 2) {
+                    json_t *data_obj = json_object_get(d, "data");
+                    json_t *command_name = json_object_get(data_obj, "name");
+                    json_t *command_id = json_object_get(data_obj, "id");
+                    json_t *interaction_id = json_object_get(d, "id");
+                    json_t *interaction_token = json_object_get(d, "token");
+                    
+                    if (command_name && interaction_id && interaction_token) {
+                        // Find matching command
+                        slash_command_t *cmd = command_lookup(bot,
+                            snowflake_parse(json_string_value(command_id)),
+                            json_string_value(command_name),
+                            json_string_length(command_name));
+                        
+                        // The handler runs on the worker pool; the frame stays alive
+                        // until the job releases its reference
+                        if (cmd) {
+                            gateway_submit_interaction(bot, root, cmd);
+                        }
+                    }
+                }
+                break;
+            }
+            default:
+                // Guild, channel, role and member events feed the entity cache
+                if (bot->cache) {
+                    cache_apply_event(bot->cache, event, d);
+                }
+                break;
+        }
+        
+        // Subscribers see every event, including the ones handled above
+        if (event != DISCORD_EVENT_UNKNOWN) {
+            event_dispatch(bot, gw, event, d);
+        }
+    }
+    
+    json_decref(root);
+}
+
+// Handle one complete (decompressed) gateway message
+static void gateway_handle_message(discord_bot_t *bot, discord_gateway_t *gw, struct lws *wsi,
+                                   const char *msg, size_t len) {
+    // Most dispatches are events nobody consumes: read op, t and s from the raw
+    // bytes and drop those without building a tree (the sequence still counts)
+    metrics_count(&bot->metrics->frames_received, 1);
+    
+    gateway_frame_head_t head;
+    discord_event_t event = DISCORD_EVENT_UNKNOWN;
+    if (gateway_prescan(msg, len, &head) && head.op == 0 && head.t) {
+        event = event_from_name(head.t, head.t_len);
+        if (!event_wanted(bot, event)) {
+            if (head.seq >= 0) {
+                gw->sequence = head.seq;
+            }
+            metrics_count(&bot->metrics->frames_dropped, 1);
+            return;
+        }
+    }
+    
+    // A handler's context views a jansson tree, so indexing an interaction
+    // first would only parse it twice
+    uint64_t decode_ns = 0;
+    if (bot->gateway_decoder == DISCORD_DECODER_ONDEMAND && event != DISCORD_EVENT_INTERACTION_CREATE &&
+        gateway_handle_ondemand(bot, gw, wsi, msg, len, &decode_ns)) {
+        histogram_record(&bot->metrics->decode, decode_ns);
+        return;
+    }
+    gateway_handle_json(bot, gw, wsi, msg, len, decode_ns);
+}
+
+// zlib-stream messages end with the Z_SYNC_FLUSH marker
+static bool zlib_has_flush_suffix(const unsigned char *data, size_t len) {
+    return len >= 4 && data[len - 4] == 0x00 && data[len - 3] == 0x00 &&
+           data[len - 2] == 0xff && data[len - 1] == 0xff;
+}
+
+static void gateway_inflate_reset(discord_gateway_t *gw) {
+    gw->zbuf_len = 0;
+    
+    if (gw->inflate_ready) {
+        inflateReset(&gw->inflate);
+        return;
+    }
+    
+    memset(&gw->inflate, 0, sizeof(gw->inflate));
+    if (inflateInit(&gw->inflate) == Z_OK) {
+        gw->inflate_ready = true;
+    } else {
+        printf("Failed to initialize zlib inflate context\n");
+    }
+}
+
+static void gateway_inflate_end(discord_gateway_t *gw) {
+    if (gw->inflate_ready) {
+        inflateEnd(&gw->inflate);
+        gw->inflate_ready = false;
+    }
+    free(gw->zbuf);
+    free(gw->inflated);
+    free(gw->rx_buf);
+    gw->zbuf = NULL;
+    gw->inflated = NULL;
+    gw->rx_buf = NULL;
+    gw->zbuf_len = gw->zbuf_cap = gw->inflated_cap = 0;
+    gw->rx_len = gw->rx_cap = 0;
+}
+
+// Gateway capture file: a 16-byte header ("DCAP", version, capture start in
+// Unix nanoseconds), then one record per receive callback: a 16-byte record
+// header (nanoseconds since the start, shard id, flags, length) followed by the
+// bytes exactly as lws delivered them. Integers are little-endian.
+#define CAPTURE_MAGIC "DCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 16
+#define CAPTURE_RECORD_SIZE 16
+#define CAPTURE_FINAL 0x01          // Last chunk of a message (uncompressed streams)
+#define CAPTURE_COMPRESSED 0x02     // Chunk of a zlib-stream
+#define CAPTURE_CONNECT 0x04        // A new connection starts here (no payload)
+
+struct discord_capture {
+    FILE *file;
+    pthread_mutex_t mutex;          // Gateway threads record concurrently
+    uint64_t start_ns;              // Monotonic time of the header
+    uint64_t records;
+    uint64_t bytes;
+};
+
+static void put_le(unsigned char *out, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) {
+        out[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static uint64_t get_le(const unsigned char *in, int size) {
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++) {
+        value |= (uint64_t)in[i] << (8 * i);
+    }
+    return value;
+}
+
+static void capture_record(discord_capture_t *capture, discord_gateway_t *gw, uint8_t flags,
+                           const void *data, size_t len) {
+    unsigned char header[CAPTURE_RECORD_SIZE] = {0};
+    put_le(header, monotonic_ns() - capture->start_ns, 8);
+    put_le(header + 8, (uint64_t)gw->shard_id, 2);
+    header[10] = flags;
+    put_le(header + 12, (uint64_t)len, 4);
+    
+    pthread_mutex_lock(&capture->mutex);
+    if (fwrite(header, sizeof(header), 1, capture->file) != 1 ||
+        (len && fwrite(data, len, 1, capture->file) != 1)) {
+        fprintf(stderr, "Failed to write gateway capture record\n");
+    }
+    capture->records++;
+    capture->bytes += len;
+    pthread_mutex_unlock(&capture->mutex);
+}
+
+int discord_capture_start(discord_bot_t *bot, const char *path) {
+    if (!bot || !path || bot->capture) return 0;
+    
+    discord_capture_t *capture = calloc(1, sizeof(discord_capture_t));
+    if (!capture) return 0;
+    
+    capture->file = fopen(path, "wb");
+    if (!capture->file || pthread_mutex_init(&capture->mutex, NULL) != 0) {
+        fprintf(stderr, "Failed to open gateway capture %s\n", path);
+        if (capture->file) fclose(capture->file);
+        free(capture);
+        return 0;
+    }
+    // Receives are small; batch them into large writes
+    setvbuf(capture->file, NULL, _IOFBF, 1 << 20);
+    
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    unsigned char header[CAPTURE_HEADER_SIZE];
+    memcpy(header, CAPTURE_MAGIC, 4);
+    put_le(header + 4, CAPTURE_VERSION, 4);
+    put_le(header + 8, (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec, 8);
+    capture->start_ns = monotonic_ns();
+    
+    if (fwrite(header, sizeof(header), 1, capture->file) != 1) {
+        fprintf(stderr, "Failed to write gateway capture %s\n", path);
+        fclose(capture->file);
+        pthread_mutex_destroy(&capture->mutex);
+        free(capture);
+        return 0;
+    }
+    
+    bot->capture = capture;
+    printf("Recording gateway traffic to %s\n", path);
+    return 1;
+}
+
+void discord_capture_stop(discord_bot_t *bot) {
+    if (!bot || !bot->capture) return;
+    
+    discord_capture_t *capture = bot->capture;
+    bot->capture = NULL;
+    
+    if (fclose(capture->file) != 0) {
+        fprintf(stderr, "Failed to flush gateway capture\n");
+    }
+    printf("Gateway capture: %llu records, %llu bytes\n",
+           (unsigned long long)capture->records, (unsigned long long)capture->bytes);
+    pthread_mutex_destroy(&capture->mutex);
+    free(capture);
+}
+
+// Buffer compressed bytes; once a complete zlib-stream message has arrived, inflate
+// it through the connection's persistent context and hand the JSON to the decoder
+static void gateway_receive_compressed(discord_bot_t *bot, discord_gateway_t *gw, struct lws *wsi,
+                                       const unsigned char *in, size_t len) {
+    if (!gw->inflate_ready) return;
+    
+    if (!buffer_reserve((void **)&gw->zbuf, &gw->zbuf_cap, gw->zbuf_len + len)) {
+        printf("Failed to allocate memory for compressed message\n");
+        gw->zbuf_len = 0;
+        return;
+    }
+    memcpy(gw->zbuf + gw->zbuf_len, in, len);
+    gw->zbuf_len += len;
+    
+    if (!zlib_has_flush_suffix(gw->zbuf, gw->zbuf_len)) return;
+    
+    if (!buffer_reserve((void **)&gw->inflated, &gw->inflated_cap, MAX_RESPONSE_SIZE * 4)) {
+        gw->zbuf_len = 0;
+        return;
+    }
+    
+    gw->inflate.next_in = gw->zbuf;
+    gw->inflate.avail_in = (uInt)gw->zbuf_len;
+    size_t out_len = 0;
+    
+    for (;;) {
+        if (out_len == gw->inflated_cap &&
+            !buffer_reserve((void **)&gw->inflated, &gw->inflated_cap, gw->inflated_cap * 2)) {
+            printf("Failed to allocate memory for inflated message\n");
+            gw->zbuf_len = 0;
+            return;
+        }
+        
+        gw->inflate.next_out = (Bytef *)gw->inflated + out_len;
+        gw->inflate.avail_out = (uInt)(gw->inflated_cap - out_len);
+        
+        int ret = inflate(&gw->inflate, Z_SYNC_FLUSH);
+        out_len = gw->inflated_cap - gw->inflate.avail_out;
+        
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            printf("zlib inflate error: %d\n", ret);
+            gw->zbuf_len = 0;
+            return;
+        }
+        // Output space left over means inflate has consumed everything it can
+        if (gw->inflate.avail_out > 0) break;
+    }
+    
+    gw->zbuf_len = 0;
+    gateway_handle_message(bot, gw, wsi, gw->inflated, out_len);
+}
+
+// Accumulate fragments of an uncompressed frame in the connection's reusable
+// receive buffer and decode once the final fragment (complete) has arrived
+static void gateway_receive_fragment(discord_bot_t *bot, discord_gateway_t *gw, struct lws *wsi,
+                                     const char *in, size_t len, bool complete) {
+    // Fast path: a whole message in one callback is parsed straight from lws' buffer
+    if (complete && gw->rx_len == 0) {
+        gateway_handle_message(bot, gw, wsi, in, len);
+        return;
+    }
+    
+    if (!buffer_reserve((void **)&gw->rx_buf, &gw->rx_cap, gw->rx_len + len)) {
+        printf("Failed to allocate memory for message\n");
+        gw->rx_len = 0;
+        return;
+    }
+    memcpy(gw->rx_buf + gw->rx_len, in, len);
+    gw->rx_len += len;
+    
+    if (complete) {
+        gateway_handle_message(bot, gw, wsi, gw->rx_buf, gw->rx_len);
+        gw->rx_len = 0;
+    }
+}
+
+// Close codes after which reconnecting cannot succeed
+static bool gateway_close_is_fatal(int code) {
+    return code == 4004 ||                  // Authentication failed
+           (code >= 4010 && code <= 4014);  // Invalid shard, sharding required, invalid API version, invalid/disallowed intents
+}
+
+// Connection is gone: schedule the next attempt with jittered exponential backoff.
+// lws can report the end of one connection more than once (a connection error
+// followed by CLIENT_CLOSED), so only the first report for the current wsi counts.
+static void gateway_connection_lost(discord_gateway_t *gw, struct lws *wsi) {
+    if (wsi != gw->wsi) return;
+    gw->wsi = NULL;
+    gw->close_requested = false;
+    lws_sul_cancel(&gw->sul_heartbeat);
+    lws_sul_cancel(&gw->sul_identify);
+    lws_sul_cancel(&gw->sul_tx);
+    if (gw->fatal || atomic_load(&gw->bot->should_stop)) return;
+    
+    int64_t delay_ms = gw->reconnect_delay_ms;
+    if (delay_ms <= 0) {
+        int shift = gw->reconnect_attempts < 6 ? gw->reconnect_attempts : 6;
+        int64_t backoff_ms = 1000LL << shift;   // 1s .. 64s
+        delay_ms = (int64_t)(backoff_ms * (0.5 + 0.5 * random_fraction()));
+    }
+    gw->reconnect_attempts++;
+    gw->reconnect_delay_ms = 0;
+    gw->next_connect_ms = monotonic_ms() + delay_ms;
+    gw->reconnects++;
+    metrics_count(&gw->bot->metrics->reconnects, 1);
+    lws_sul_schedule(gw->context, 0, &gw->sul_connect, gateway_connect_cb, delay_ms * LWS_US_PER_MS);
+    
+    printf("Shard %d: reconnecting in %lldms (%s)\n", gw->shard_id, (long long)delay_ms,
+           gw->session_id[0] ? "resume" : "identify");
+}
+
+// Enhanced WebSocket callback with heartbeat and latency tracking
+static int ws_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len) {
+    (void)user;
+    discord_bot_t *bot = (discord_bot_t *)lws_context_user(lws_get_context(wsi));
+    discord_gateway_t *gw = (discord_gateway_t *)lws_get_opaque_user_data(wsi);
+    
+    if (!gw) return 0;
+    
+    switch (reason) {
+        case LWS_CALLBACK_CLIENT_ESTABLISHED:
+            printf("Shard %d connected to Discord Gateway\n", gw->shard_id);
+            // Drop any partial frame left over from a previous connection
+            gw->rx_len = 0;
+            
+            // Every connection starts a fresh zlib stream
+            if (gw->compress) {
+                gateway_inflate_reset(gw);
+            }
+            if (gateway_tx_get(gw)) {
+                gateway_tx_clear(gw->tx);
+            }
+            if (bot->capture) {
+                capture_record(bot->capture, gw, CAPTURE_CONNECT | (gw->compress ? CAPTURE_COMPRESSED : 0), NULL, 0);
+            }
+            break;
+            
+        case LWS_CALLBACK_CLIENT_RECEIVE: {
+            metrics_count(&bot->metrics->bytes_received, len);
+            if (gw->compress) {
+                if (bot->capture) capture_record(bot->capture, gw, CAPTURE_COMPRESSED, in, len);
+                gateway_receive_compressed(bot, gw, wsi, (const unsigned char *)in, len);
+            } else {
+                bool complete = lws_is_final_fragment(wsi) && lws_remaining_packet_payload(wsi) == 0;
+                if (bot->capture) capture_record(bot->capture, gw, complete ? CAPTURE_FINAL : 0, in, len);
+                gateway_receive_fragment(bot, gw, wsi, (const char *)in, len, complete);
+            }
+            break;
+        }
+        
+        case LWS_CALLBACK_CLIENT_WRITEABLE: {
+            // Close requested by RECONNECT / INVALID_SESSION. Codes other than 1000/1001
+            // keep the session alive on Discord's side so it can be resumed.
+            if (gw->close_requested) {
+                lws_close_reason(wsi, (enum lws_close_status)4000, NULL, 0);
+                return -1;
+            }
+            
+            if (gw->identify_due) {
+                gw->identify_due = false;
+                gateway_send_identify(bot, gw, wsi);
+            }
+            
+            // Due heartbeats (from the timer or requested by the gateway) go
+            // ahead of queued frames
+            if (gateway_tx_write(bot, gw, wsi) < 0) {
+                return -1;
+            }
+            break;
+        }
+        
+        case LWS_CALLBACK_WS_PEER_INITIATED_CLOSE: {
+            int code = len >= 2 ? (((unsigned char *)in)[0] << 8) | ((unsigned char *)in)[1] : 0;
+            printf("Gateway closed the connection (code %d)\n", code);
+            
+            if (gateway_close_is_fatal(code)) {
+                fprintf(stderr, "Gateway close code %d is not recoverable, giving up\n", code);
+                gw->fatal = true;
+            } else if (code == 4007 || code == 4009) {
+                // Invalid sequence / session timed out
+                gateway_clear_session(gw);
+            }
+            break;
+        }
+        
+        case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+            printf("Connection error: %s\n", in ? (const char *)in : "unknown");
+            gateway_connection_lost(gw, wsi);
+            break;
+            
+        case LWS_CALLBACK_CLIENT_CLOSED:
+        case LWS_CALLBACK_CLOSED:
+            printf("Connection closed\n");
+            gateway_connection_lost(gw, wsi);
+            break;
+            
+        default:
+            break;
+    }
     
-    info.port = CONTEXT_PORT_NO_LISTEN;
-    info.protocols = protocols;
-    info.user = bot;
-    info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+    return 0;
+}
+
+// Split a gateway URL into host, port and path, adding the query parameters we need
+static void gateway_parse_url(const char *url, bool compress, char *host, size_t host_size,
+                              char *path, size_t path_size, int *port, bool *tls) {
+    snprintf(host, host_size, "gateway.discord.gg");
+    snprintf(path, path_size, "/?v=10&encoding=json");
+    *port = 443;
+    *tls = true;
     
-    bot->ws_context = lws_create_context(&info);
-    if (!bot->ws_context) {
-        printf("Failed to create WebSocket context\n");
-        return NULL;
+    // Parse the gateway URL properly; ws:// is plain TCP (local mock servers)
+    const char *url_start = NULL;
+    if (url && strncmp(url, "wss://", 6) == 0) {
+        url_start = url + 6;
+    } else if (url && strncmp(url, "ws://", 5) == 0) {
+        url_start = url + 5;
+        *port = 80;
+        *tls = false;
     }
     
-    // Fixed URL parsing - allocate separate buffers
-    char host[256] = "gateway.discord.gg";
-    char path[256] = "/?v=10&encoding=json";
-    int port = 443;
-    
-    // Parse the gateway URL properly
-    if (bot->gateway_url && strncmp(bot->gateway_url, "wss://", 6) == 0) {
-        const char *url_start = bot->gateway_url + 6; // Skip "wss://"
+    if (url_start) {
         const char *path_start = strchr(url_start, '/');
         
         if (path_start) {
             // Copy host part
             size_t host_len = path_start - url_start;
-            if (host_len < sizeof(host)) {
-                strncpy(host, url_start, host_len);
+            if (host_len < host_size) {
+                memcpy(host, url_start, host_len);
                 host[host_len] = '\0';
             }
             
             // Copy path part
-            strncpy(path, path_start, sizeof(path) - 1);
-            path[sizeof(path) - 1] = '\0';
+            snprintf(path, path_size, "%s", path_start);
         } else {
             // No path found, copy entire remaining part as host
-            strncpy(host, url_start, sizeof(host) - 1);
-            host[sizeof(host) - 1] = '\0';
+            snprintf(host, host_size, "%s", url_start);
         }
         
         // Check for port in host
         char *port_start = strchr(host, ':');
         if (port_start) {
             *port_start = '\0';
-            port = atoi(port_start + 1);
+            *port = atoi(port_start + 1);
         }
     }
     
     // Add query parameters if not present
     if (strstr(path, "v=10") == NULL) {
-        strncat(path, "?v=10&encoding=json", sizeof(path) - strlen(path) - 1);
+        strncat(path, strchr(path, '?') ? "&v=10&encoding=json" : "?v=10&encoding=json", path_size - strlen(path) - 1);
+    }
+    
+    // Opt-in zlib-stream transport compression
+    if (compress && strstr(path, "compress=") == NULL) {
+        strncat(path, "&compress=zlib-stream", path_size - strlen(path) - 1);
     }
+}
+
+// Open a connection, to the resume URL if there is a session to resume
+static void gateway_connect(discord_bot_t *bot, discord_gateway_t *gw) {
+    const char *url = (gw->session_id[0] && gw->resume_gateway_url[0]) ? gw->resume_gateway_url : bot->gateway_url;
+    
+    char host[256];
+    char path[256];
+    int port;
+    bool tls;
+    gw->compress = bot->gateway_compress;
+    gateway_parse_url(url, gw->compress, host, sizeof(host), path, sizeof(path), &port, &tls);
     
     struct lws_client_connect_info ccinfo;
     memset(&ccinfo, 0, sizeof(ccinfo));
-    ccinfo.context = bot->ws_context;
+    ccinfo.context = gw->context;
     ccinfo.address = host;
     ccinfo.port = port;
     ccinfo.path = path;
     ccinfo.host = host;
     ccinfo.origin = "origin";
     ccinfo.protocol = "discord-gateway";
-    ccinfo.ssl_connection = LCCSCF_USE_SSL;
+    ccinfo.ssl_connection = tls ? LCCSCF_USE_SSL : 0;
+    ccinfo.opaque_user_data = gw;
+    ccinfo.pwsi = &gw->wsi;         // Set before any callback for the new wsi can run
     
-    printf("Connecting to: %s:%d%s\n", host, port, path);
+    printf("Shard %d connecting to: %s:%d%s\n", gw->shard_id, host, port, path);
     
-    bot->ws_connection = lws_client_connect_via_info(&ccinfo);
-    if (!bot->ws_connection) {
+    gw->close_requested = false;
+    gw->heartbeat_due = false;
+    gw->identify_due = false;
+    gw->heartbeat_interval = 0;     // Until the new connection's HELLO
+    gw->wsi = lws_client_connect_via_info(&ccinfo);
+    // A failure reported through CLIENT_CONNECTION_ERROR has already scheduled the retry
+    if (!gw->wsi && gw->next_connect_ms <= monotonic_ms()) {
         printf("Failed to connect to Discord Gateway\n");
-        lws_context_destroy(bot->ws_context);
-        return NULL;
+        gateway_connection_lost(gw, NULL);
+    }
+}
+
+// Whether every shard on a service thread has failed for good and disconnected
+static bool gateway_thread_finished(const discord_gateway_thread_t *thread) {
+    const discord_bot_t *bot = thread->bot;
+    for (int i = thread->index; i < bot->shard_count; i += bot->gateway_thread_count) {
+        if (!bot->shards[i].fatal || bot->shards[i].wsi) return false;
+    }
+    return true;
+}
+
+// lws context for one service thread. Contexts are created by discord_start_bot
+// before any service thread runs, and only the first does the process-wide TLS
+// setup, so that never runs concurrently.
+static struct lws_context *gateway_context_create(discord_bot_t *bot, bool tls_global_init) {
+    static struct lws_protocols protocols[] = {
+        {
+            "discord-gateway",
+            ws_callback,
+            0,
+            MAX_RESPONSE_SIZE,
+        },
+        { NULL, NULL, 0, 0 }
+    };
+    
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.port = CONTEXT_PORT_NO_LISTEN;
+    info.protocols = protocols;
+    info.user = bot;
+    info.options = tls_global_init ? LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT : 0;
+    
+    struct lws_context *context = lws_create_context(&info);
+    if (!context) {
+        printf("Failed to create WebSocket context\n");
+    }
+    return context;
+}
+
+// Gateway thread: one lws service loop driving every shard assigned to it.
+// discord_stop_bot destroys the context once the thread has been joined.
+static void* gateway_thread_func(void *arg) {
+    discord_gateway_thread_t *thread = (discord_gateway_thread_t *)arg;
+    discord_bot_t *bot = thread->bot;
+    
+    // Shards are spread round-robin over the service threads; each connects
+    // from its own timer so nothing polls
+    for (int i = thread->index; i < bot->shard_count; i += bot->gateway_thread_count) {
+        discord_gateway_t *gw = &bot->shards[i];
+        gw->context = thread->context;
+        lws_sul_schedule(thread->context, 0, &gw->sul_connect, gateway_connect_cb, 1);
     }
     
-    while (!bot->should_stop) {
-        lws_service(bot->ws_context, 100);
-        lws_callback_on_writable(bot->ws_connection);
+    // lws sleeps until socket activity or the next timer; discord_stop_bot wakes
+    // it with lws_cancel_service. Shards that failed for good never reconnect,
+    // so once all of them have, the thread has nothing left to do.
+    while (!atomic_load(&bot->should_stop)) {
+        if (lws_service(thread->context, 0) < 0) break;
+        if (gateway_thread_finished(thread)) {
+            printf("Gateway thread %d: every shard has stopped\n", thread->index);
+            break;
+        }
     }
     
-    lws_context_destroy(bot->ws_context);
+    for (int i = thread->index; i < bot->shard_count; i += bot->gateway_thread_count) {
+        discord_gateway_t *gw = &bot->shards[i];
+        lws_sul_cancel(&gw->sul_heartbeat);
+        lws_sul_cancel(&gw->sul_identify);
+        lws_sul_cancel(&gw->sul_connect);
+        lws_sul_cancel(&gw->sul_tx);
+    }
     return NULL;
 }
 
-// Get application ID from Discord API
-int discord_get_application_id(discord_bot_t *bot) {
-    char url[] = "https://discord.com/api/v10/applications/@me";
+// Free per-shard state from a previous run
+static void gateway_shards_free(discord_bot_t *bot) {
+    for (int i = 0; i < bot->shard_count; i++) {
+        gateway_inflate_end(&bot->shards[i]);
+        od_doc_free(bot->shards[i].od);
+        gateway_tx_free(&bot->shards[i]);
+    }
+    free(bot->shards);
+    free(bot->gateway_threads);
+    free(bot->identify_next_ms);
+    bot->shards = NULL;
+    bot->gateway_threads = NULL;
+    bot->identify_next_ms = NULL;
+    bot->shard_count = 0;
+    bot->gateway_thread_count = 0;
+}
+
+// Allocate shards and service threads from the configuration and /gateway/bot
+static int gateway_shards_init(discord_bot_t *bot) {
+    gateway_shards_free(bot);
     
-    response_buffer_t response = {0};
+    int shard_count = bot->shard_count_requested > 0 ? bot->shard_count_requested : bot->recommended_shards;
+    if (shard_count < 1) shard_count = 1;
     
-    struct curl_slist *headers = NULL;
-    char auth_header[256];
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Bot %s", bot->token);
-    headers = curl_slist_append(headers, auth_header);
+    int thread_count = bot->gateway_thread_count_requested;
+    if (thread_count <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_count = cpus > 0 ? (int)cpus : 1;
+    }
+    if (thread_count > shard_count) thread_count = shard_count;
     
-    curl_easy_setopt(bot->curl, CURLOPT_URL, url);
-    curl_easy_setopt(bot->curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(bot->curl, CURLOPT_WRITEFUNCTION, write_response_callback);
-    curl_easy_setopt(bot->curl, CURLOPT_WRITEDATA, &response);
+    if (bot->max_concurrency < 1) bot->max_concurrency = 1;
     
-    CURLcode res = curl_easy_perform(bot->curl);
+    bot->shards = calloc(shard_count, sizeof(discord_gateway_t));
+    bot->gateway_threads = calloc(thread_count, sizeof(discord_gateway_thread_t));
+    bot->identify_next_ms = calloc(bot->max_concurrency, sizeof(int64_t));
+    if (!bot->shards || !bot->gateway_threads || !bot->identify_next_ms) {
+        gateway_shards_free(bot);
+        return 0;
+    }
+    
+    bot->shard_count = shard_count;
+    bot->gateway_thread_count = thread_count;
+    for (int i = 0; i < shard_count; i++) {
+        discord_gateway_t *gw = &bot->shards[i];
+        gw->bot = bot;
+        gw->shard_id = i;
+        gw->latency_ms = -1;
+        gateway_clear_session(gw);
+    }
+    
+    printf("Starting %d shard(s) on %d gateway thread(s), max_concurrency %d\n",
+           shard_count, thread_count, bot->max_concurrency);
+    return 1;
+}
+
+// Configure sharding before discord_start_bot: shard_count 0 uses Discord's
+// recommendation, thread_count 0 uses one service thread per CPU (at most one per shard)
+void discord_set_sharding(discord_bot_t *bot, int shard_count, int thread_count) {
+    if (!bot) return;
+    
+    bot->shard_count_requested = shard_count;
+    bot->gateway_thread_count_requested = thread_count;
+}
+
+// Enable zlib-stream compression for subsequent gateway connections
+void discord_set_gateway_compression(discord_bot_t *bot, bool enabled) {
+    if (!bot) return;
+    
+    bot->gateway_compress = enabled;
+}
+
+// Get application ID from Discord API
+int discord_get_application_id(discord_bot_t *bot) {
+    char url[512];
+    snprintf(url, sizeof(url), "%s/applications/@me", bot->api_base_url);
     
-    curl_slist_free_all(headers);
-    curl_easy_reset(bot->curl);
+    char *response = rest_perform_sync(bot, "GET", url, NULL);
     
-    if (res == CURLE_OK && response.data) {
-        json_t *root = json_loads(response.data, 0, NULL);
+    if (response) {
+        json_t *root = json_loads(response, 0, NULL);
         if (root) {
             json_t *id = json_object_get(root, "id");
             if (id) {
                 bot->application_id = strdup(json_string_value(id));
                 json_decref(root);
-                free(response.data);
+                free(response);
                 return 1;
             }
             json_decref(root);
         }
-        free(response.data);
+        free(response);
     }
     
     return 0;
 }
 
+int discord_set_api_base_url(discord_bot_t *bot, const char *url) {
+    if (!bot || !url) return 0;
+    
+    char *copy = strdup(url);
+    if (!copy) return 0;
+    
+    // Paths are appended with a leading '/'
+    size_t len = strlen(copy);
+    while (len > 0 && copy[len - 1] == '/') copy[--len] = '\0';
+    
+    free(bot->api_base_url);
+    bot->api_base_url = copy;
+    return 1;
+}
+
+int discord_set_gateway_url(discord_bot_t *bot, const char *url) {
+    if (!bot || !url) return 0;
+    
+    char *copy = strdup(url);
+    if (!copy) return 0;
+    
+    free(bot->gateway_url);
+    bot->gateway_url = copy;
+    bot->gateway_url_pinned = true;
+    return 1;
+}
+
+void discord_set_rest_dry_run(discord_bot_t *bot, bool enabled) {
+    if (!bot) return;
+    bot->rest_dry_run = enabled;
+}
+
+void discord_set_rest_keepalive(discord_bot_t *bot, int interval_ms) {
+    if (!bot) return;
+    bot->rest_keepalive_ms = interval_ms > 0 ? interval_ms : 0;
+}
+
 // Initialize the bot
 discord_bot_t* discord_init(const char *token) {
     discord_bot_t *bot = malloc(sizeof(discord_bot_t));
@@ -557,23 +6390,52 @@ discord_bot_t* discord_init(const char *token) {
     
     memset(bot, 0, sizeof(discord_bot_t));
     
+    // The environment can point the bot at another host, e.g. a local mock
+    const char *api_base_url = getenv("DISCORD_API_BASE_URL");
+    const char *gateway_url = getenv("DISCORD_GATEWAY_URL");
+    
     bot->token = strdup(token);
-    bot->curl = curl_easy_init();
-    bot->gateway_url = strdup("wss://gateway.discord.gg/?v=10&encoding=json");
-    bot->gateway_latency_ms = -1; // Initialize to -1 (unknown)
+    bot->api_base_url = strdup(api_base_url && *api_base_url ? api_base_url : DISCORD_API_BASE_URL);
+    bot->gateway_url = strdup(gateway_url && *gateway_url ? gateway_url : DISCORD_GATEWAY_URL);
+    bot->gateway_url_pinned = gateway_url && *gateway_url;
+    const char *dry_run = getenv("DISCORD_REST_DRY_RUN");
+    bot->rest_dry_run = dry_run && strcmp(dry_run, "1") == 0;
+    bot->recommended_shards = 1;
+    bot->defer_threshold_ms = 2000;
+    bot->rest_keepalive_ms = REST_KEEPALIVE_DEFAULT_MS;
+    bot->gateway_decoder = DISCORD_DECODER_ONDEMAND;
+    bot->max_concurrency = 1;
+    bot->metrics = metrics_create();
+    
+    // Event name lookup table, shared by every bot
+    pthread_once(&event_hash_once, event_hash_build);
     
     // Initialize mutex
-    if (pthread_mutex_init(&bot->latency_mutex, NULL) != 0) {
+    if (pthread_mutex_init(&bot->latency_mutex, NULL) != 0 ||
+        pthread_mutex_init(&bot->identify_mutex, NULL) != 0 ||
+        pthread_mutex_init(&bot->command_mutex, NULL) != 0) {
+        discord_cleanup(bot);
+        return NULL;
+    }
+    
+    if (!bot->token || !bot->api_base_url || !bot->gateway_url || !bot->metrics) {
         discord_cleanup(bot);
         return NULL;
     }
     
-    if (!bot->token || !bot->curl || !bot->gateway_url) {
+    // Start the REST I/O thread
+    if (!rest_engine_start(bot)) {
         discord_cleanup(bot);
         return NULL;
     }
     
-    // Get application ID
+    const char *capture_file = getenv("DISCORD_CAPTURE_FILE");
+    if (capture_file && *capture_file) {
+        discord_capture_start(bot, capture_file);
+    }
+    
+    // Get application ID. This also opens the pooled API connection, which the
+    // keepalive then holds open for the first interaction reply.
     if (!discord_get_application_id(bot)) {
         printf("Warning: Failed to get application ID\n");
     }
@@ -583,49 +6445,46 @@ discord_bot_t* discord_init(const char *token) {
 
 // Get Gateway URL from Discord API
 int discord_get_gateway_url(discord_bot_t *bot) {
-    const char *url = "https://discord.com/api/v10/gateway/bot";
-    
-    response_buffer_t response = {0};
-    
-    struct curl_slist *headers = NULL;
-    char auth_header[256];
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Bot %s", bot->token);
-    headers = curl_slist_append(headers, auth_header);
-    
-    curl_easy_setopt(bot->curl, CURLOPT_URL, url);
-    curl_easy_setopt(bot->curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(bot->curl, CURLOPT_WRITEFUNCTION, write_response_callback);
-    curl_easy_setopt(bot->curl, CURLOPT_WRITEDATA, &response);
-    
-    CURLcode res = curl_easy_perform(bot->curl);
+    char url[512];
+    snprintf(url, sizeof(url), "%s/gateway/bot", bot->api_base_url);
     
-    curl_slist_free_all(headers);
-    curl_easy_reset(bot->curl);
+    char *response = rest_perform_sync(bot, "GET", url, NULL);
     
-    if (res == CURLE_OK && response.data) {
-        json_t *root = json_loads(response.data, 0, NULL);
+    if (response) {
+        json_t *root = json_loads(response, 0, NULL);
         if (root) {
             json_t *url_obj = json_object_get(root, "url");
             if (url_obj) {
-                // Free old gateway URL and set new one
-                if (bot->gateway_url) {
+                // Free old gateway URL and set new one, unless one was configured
+                if (!bot->gateway_url_pinned) {
                     free(bot->gateway_url);
+                    bot->gateway_url = strdup(json_string_value(url_obj));
                 }
-                bot->gateway_url = strdup(json_string_value(url_obj));
                 
                 printf("Got Gateway URL: %s\n", bot->gateway_url);
                 
-                json_decref(root);
-                if (response.data) {
-                    free(response.data);
+                // Sharding recommendation and identify concurrency
+                json_t *shards = json_object_get(root, "shards");
+                if (json_is_integer(shards)) {
+                    bot->recommended_shards = (int)json_integer_value(shards);
                 }
+                json_t *limit = json_object_get(root, "session_start_limit");
+                json_t *max_concurrency = json_object_get(limit, "max_concurrency");
+                if (json_is_integer(max_concurrency)) {
+                    bot->max_concurrency = (int)json_integer_value(max_concurrency);
+                }
+                json_t *remaining = json_object_get(limit, "remaining");
+                if (json_is_integer(remaining) && json_integer_value(remaining) < bot->recommended_shards) {
+                    printf("Warning: only %lld session starts remaining today\n", (long long)json_integer_value(remaining));
+                }
+                
+                json_decref(root);
+                free(response);
                 return 1;
             }
             json_decref(root);
         }
-        if (response.data) {
-            free(response.data);
-        }
+        free(response);
     }
     
     printf("Failed to get Gateway URL, using fallback\n");
@@ -636,24 +6495,41 @@ int discord_get_gateway_url(discord_bot_t *bot) {
 void discord_cleanup(discord_bot_t *bot) {
     if (bot) {
         discord_stop_bot(bot);
+        discord_capture_stop(bot);
+        
+        // Asynchronous replies still pending are dropped when they complete
+        deferred_detach_all(bot);
+        
+        // Flush outstanding REST requests before the token goes away
+        rest_engine_stop(bot);
         
         free(bot->token);
+        free(bot->api_base_url);
         free(bot->gateway_url);
         free(bot->application_id);
         
         // Clean up commands
+        command_index_free(bot);
         for (int i = 0; i < bot->command_count; i++) {
-            free(bot->commands[i].name);
-            free(bot->commands[i].description);
+            free(bot->commands[i]->name);
+            free(bot->commands[i]->description);
             // Note: handler is a function pointer, no need to free
+            free(bot->commands[i]);
+        }
+        free(bot->commands);
+        
+        gateway_shards_free(bot);
+        cache_free(bot->cache);
+        for (int i = 0; i < DISCORD_EVENT_COUNT; i++) {
+            free(bot->event_handlers[i]);
         }
+        metrics_free(bot->metrics);
         
         // Destroy mutex
         pthread_mutex_destroy(&bot->latency_mutex);
+        pthread_mutex_destroy(&bot->identify_mutex);
+        pthread_mutex_destroy(&bot->command_mutex);
         
-        if (bot->curl) {
-            curl_easy_cleanup(bot->curl);
-        }
         free(bot);
     }
 }
@@ -662,157 +6538,438 @@ void discord_cleanup(discord_bot_t *bot) {
 void discord_send_message(discord_bot_t *bot, const char *channel_id, discord_message_t *message) {
     if (!bot || !channel_id || !message) return;
     
-    char url[256];
-    snprintf(url, sizeof(url), "https://discord.com/api/v10/channels/%s/messages", channel_id);
-
-    char *payload_str = build_message_payload(message);
-    if (!payload_str) return;
+    char url[512];
+    snprintf(url, sizeof(url), "%s/channels/%s/messages", bot->api_base_url, channel_id);
 
-    struct curl_slist *headers = NULL;
-    char auth_header[256];
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Bot %s", bot->token);
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, auth_header);
+    json_buf_t payload;
+    payload_buf_acquire(&payload);
+    if (!build_message_payload(&payload, message)) {
+        payload_buf_release(&payload);
+        return;
+    }
 
-    curl_easy_setopt(bot->curl, CURLOPT_URL, url);
-    curl_easy_setopt(bot->curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(bot->curl, CURLOPT_POSTFIELDS, payload_str);
-    curl_easy_setopt(bot->curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(bot->curl, CURLOPT_POST, 1L);
+    // Queued on the REST engine; the payload buffer is owned by the request from here on
+    rest_submit_payload(bot, "POST", url, &payload, true, NULL, NULL);
+}
 
-    CURLcode res = curl_easy_perform(bot->curl);
-    if (res != CURLE_OK) {
-        fprintf(stderr, "Request failed: %s\n", curl_easy_strerror(res));
+// Append a command to the registry. Once the bot has started, the dispatch index
+// is republished so the command takes effect right away.
+static int command_add(discord_bot_t *bot, const char *name, const char *description,
+                       command_handler_t handler, command_async_handler_t async_handler) {
+    if (!bot || !name || !description || (!handler && !async_handler)) {
+        return 0;
     }
-
-    curl_slist_free_all(headers);
-    free(payload_str);
-    curl_easy_reset(bot->curl);
+    
+    slash_command_t *cmd = calloc(1, sizeof(slash_command_t));
+    if (!cmd) return 0;
+    cmd->name = strdup(name);
+    cmd->description = strdup(description);
+    cmd->handler = handler;
+    cmd->async_handler = async_handler;
+    if (!cmd->name || !cmd->description) {
+        free(cmd->name);
+        free(cmd->description);
+        free(cmd);
+        return 0;
+    }
+    cmd->name_hash = hash_bytes(cmd->name, strlen(cmd->name));
+    
+    pthread_mutex_lock(&bot->command_mutex);
+    if (bot->command_count == bot->command_capacity) {
+        int capacity = bot->command_capacity ? bot->command_capacity * 2 : 16;
+        slash_command_t **commands = realloc(bot->commands, capacity * sizeof(slash_command_t *));
+        if (!commands) {
+            pthread_mutex_unlock(&bot->command_mutex);
+            free(cmd->name);
+            free(cmd->description);
+            free(cmd);
+            return 0;
+        }
+        bot->commands = commands;
+        bot->command_capacity = capacity;
+    }
+    bot->commands[bot->command_count++] = cmd;
+    
+    if (atomic_load_explicit(&bot->command_index, memory_order_relaxed)) {
+        discord_command_index_t *index = command_index_create(bot);
+        if (index) command_index_publish(bot, index);
+    }
+    pthread_mutex_unlock(&bot->command_mutex);
+    
+    return 1;
 }
 
 // Register a slash command (separated from handling)
 int discord_register_slash_command(discord_bot_t *bot, const char *name, const char *description, command_handler_t handler) {
-    if (!bot || !name || !description || !handler || bot->command_count >= MAX_COMMANDS) {
-        return 0;
+    return command_add(bot, name, description, handler, NULL);
+}
+
+int discord_register_async_slash_command(discord_bot_t *bot, const char *name, const char *description,
+                                         command_async_handler_t handler) {
+    return command_add(bot, name, description, NULL, handler);
+}
+
+// The definition sent to Discord for a registered command
+static json_t *command_definition(const slash_command_t *cmd) {
+    json_t *command = json_object();
+    json_object_set_new(command, "name", json_string(cmd->name));
+    json_object_set_new(command, "description", json_string(cmd->description));
+    json_object_set_new(command, "type", json_integer(1)); // CHAT_INPUT
+    return command;
+}
+
+// Fields Discord assigns, or fills in when a definition leaves them out
+static bool command_field_ignored(const char *key, json_t *value) {
+    if (strcmp(key, "id") == 0 || strcmp(key, "application_id") == 0 || strcmp(key, "guild_id") == 0 ||
+        strcmp(key, "version") == 0 || strcmp(key, "name_localized") == 0 || strcmp(key, "description_localized") == 0) {
+        return true;
+    }
+    if (strcmp(key, "default_member_permissions") == 0 || strcmp(key, "contexts") == 0 ||
+        strcmp(key, "name_localizations") == 0 || strcmp(key, "description_localizations") == 0) {
+        return json_is_null(value);
+    }
+    if (strcmp(key, "dm_permission") == 0) return json_is_true(value);
+    if (strcmp(key, "nsfw") == 0) return json_is_false(value);
+    if (strcmp(key, "options") == 0) return json_is_array(value) && json_array_size(value) == 0;
+    if (strcmp(key, "integration_types") == 0) {
+        json_t *first = json_array_get(value, 0);
+        return json_array_size(value) == 1 && json_is_integer(first) && json_integer_value(first) == 0;
+    }
+    return false;
+}
+
+// Canonical text of a command definition: compact JSON with sorted keys and
+// without ignored fields, so a local definition and Discord's copy of it
+// serialize identically and any other difference (options, choices,
+// permissions, localizations) shows up
+static char *command_canonical(json_t *cmd) {
+    json_t *canonical = json_object();
+    if (!canonical) return NULL;
+    
+    const char *key;
+    json_t *value;
+    json_object_foreach(cmd, key, value) {
+        if (!command_field_ignored(key, value)) json_object_set(canonical, key, value);
+    }
+    char *text = json_dumps(canonical, JSON_COMPACT | JSON_SORT_KEYS);
+    json_decref(canonical);
+    return text;
+}
+
+static int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Whether Discord's command set already matches the local definitions
+static bool command_set_matches(json_t *local, json_t *remote) {
+    size_t count = json_array_size(local);
+    if (!json_is_array(remote) || json_array_size(remote) != count) return false;
+    
+    char **texts = calloc(count * 2 + 1, sizeof(char *));
+    if (!texts) return false;
+    
+    bool matches = true;
+    for (size_t i = 0; i < count && matches; i++) {
+        texts[i] = command_canonical(json_array_get(local, i));
+        texts[count + i] = command_canonical(json_array_get(remote, i));
+        matches = texts[i] && texts[count + i];
+    }
+    if (matches) {
+        qsort(texts, count, sizeof(char *), compare_strings);
+        qsort(texts + count, count, sizeof(char *), compare_strings);
+        for (size_t i = 0; i < count && matches; i++) {
+            matches = strcmp(texts[i], texts[count + i]) == 0;
+        }
     }
     
-    bot->commands[bot->command_count].name = strdup(name);
-    bot->commands[bot->command_count].description = strdup(description);
-    bot->commands[bot->command_count].handler = handler;
-    bot->command_count++;
+    for (size_t i = 0; i < count * 2; i++) {
+        free(texts[i]);
+    }
+    free(texts);
+    return matches;
+}
+
+// Record the IDs Discord assigned and republish the index so dispatch can match on them
+static void command_record_ids(discord_bot_t *bot, json_t *commands) {
+    pthread_mutex_lock(&bot->command_mutex);
+    discord_command_index_t *names = command_index_create(bot);
+    if (!names) {
+        pthread_mutex_unlock(&bot->command_mutex);
+        return;
+    }
     
-    return 1;
+    for (size_t i = 0; i < json_array_size(commands); i++) {
+        json_t *cmd = json_array_get(commands, i);
+        json_t *name = json_object_get(cmd, "name");
+        
+        slash_command_t *local = command_index_find(names, 0, json_string_value(name), json_string_length(name));
+        if (local) {
+            local->id = snowflake_parse(json_string_value(json_object_get(cmd, "id")));
+        }
+    }
+    free(names);
+    
+    discord_command_index_t *index = command_index_create(bot);
+    if (index) command_index_publish(bot, index);
+    pthread_mutex_unlock(&bot->command_mutex);
 }
 
-// Register all commands with Discord API
-int discord_register_all_commands(discord_bot_t *bot) {
+// Sync the local command set with Discord: one GET, then a single bulk overwrite
+// (PUT) only if the definitions differ. guild_id NULL targets global commands.
+static int command_sync(discord_bot_t *bot, const char *guild_id) {
     if (!bot || !bot->application_id) return 0;
     
+    json_t *commands = json_array();
+    pthread_mutex_lock(&bot->command_mutex);
     for (int i = 0; i < bot->command_count; i++) {
-        char url[256];
-        snprintf(url, sizeof(url), "https://discord.com/api/v10/applications/%s/commands", bot->application_id);
-        
-        json_t *command = json_object();
-        json_object_set_new(command, "name", json_string(bot->commands[i].name));
-        json_object_set_new(command, "description", json_string(bot->commands[i].description));
-        json_object_set_new(command, "type", json_integer(1)); // CHAT_INPUT
-        
-        char *command_str = json_dumps(command, 0);
-        json_decref(command);
-        
-        if (!command_str) continue;
-        
-        struct curl_slist *headers = NULL;
-        char auth_header[256];
-        snprintf(auth_header, sizeof(auth_header), "Authorization: Bot %s", bot->token);
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-        headers = curl_slist_append(headers, auth_header);
-        
-        curl_easy_setopt(bot->curl, CURLOPT_URL, url);
-        curl_easy_setopt(bot->curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(bot->curl, CURLOPT_POSTFIELDS, command_str);
-        curl_easy_setopt(bot->curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(bot->curl, CURLOPT_POST, 1L);
-        
-        CURLcode res = curl_easy_perform(bot->curl);
-        if (res != CURLE_OK) {
-            fprintf(stderr, "Failed to register command %s: %s\n", bot->commands[i].name, curl_easy_strerror(res));
-        } else {
-            printf("Registered command: %s\n", bot->commands[i].name);
-        }
-        
-        curl_slist_free_all(headers);
-        free(command_str);
-        curl_easy_reset(bot->curl);
+        json_array_append_new(commands, command_definition(bot->commands[i]));
+    }
+    pthread_mutex_unlock(&bot->command_mutex);
+    
+    // Nothing registered locally: leave Discord's commands alone rather than
+    // overwriting them with an empty set
+    if (json_array_size(commands) == 0) {
+        json_decref(commands);
+        return 1;
+    }
+    
+    char url[512];
+    if (guild_id) {
+        snprintf(url, sizeof(url), "%s/applications/%s/guilds/%s/commands",
+                 bot->api_base_url, bot->application_id, guild_id);
+    } else {
+        snprintf(url, sizeof(url), "%s/applications/%s/commands", bot->api_base_url, bot->application_id);
+    }
+    
+    // Compare against what Discord already has
+    char *existing_str = rest_perform_sync(bot, "GET", url, NULL);
+    json_t *existing = existing_str ? json_loads(existing_str, 0, NULL) : NULL;
+    free(existing_str);
+    
+    if (command_set_matches(commands, existing)) {
+        command_record_ids(bot, existing);
+        printf("Commands unchanged (%zu), skipping registration\n", json_array_size(commands));
+        json_decref(existing);
+        json_decref(commands);
+        return 1;
+    }
+    json_decref(existing);
+    
+    size_t count = json_array_size(commands);
+    char *commands_str = json_dumps(commands, JSON_COMPACT);
+    json_decref(commands);
+    if (!commands_str) return 0;
+    
+    // Bulk overwrite replaces the whole set in one request
+    char *response = rest_perform_sync(bot, "PUT", url, commands_str);
+    if (!response) {
+        fprintf(stderr, "Failed to register commands\n");
+        return 0;
+    }
+    
+    json_t *registered = json_loads(response, 0, NULL);
+    free(response);
+    if (json_is_array(registered)) {
+        command_record_ids(bot, registered);
     }
+    json_decref(registered);
     
+    printf("Registered %zu commands\n", count);
     return 1;
 }
 
+// Register all commands with Discord API
+int discord_register_all_commands(discord_bot_t *bot) {
+    return command_sync(bot, NULL);
+}
+
+// Register all commands as guild commands (these update instantly, useful for development)
+int discord_register_guild_commands(discord_bot_t *bot, const char *guild_id) {
+    if (!guild_id) return 0;
+    
+    return command_sync(bot, guild_id);
+}
+
 // Send interaction response using build_message_payload function
 void discord_send_interaction_response(discord_bot_t *bot, const char *interaction_id, const char *interaction_token, discord_message_t *message) {
     if (!bot || !interaction_id || !interaction_token || !message) return;
     
     char url[512];
-    snprintf(url, sizeof(url), "https://discord.com/api/v10/interactions/%s/%s/callback", interaction_id, interaction_token);
+    snprintf(url, sizeof(url), "%s/interactions/%s/%s/callback", bot->api_base_url, interaction_id, interaction_token);
     
-    // Use your existing build_message_payload function!
-    char *message_payload = build_message_payload(message);
-    if (!message_payload) return;
-    
-    // Parse it to get the data object
-    json_error_t error;
-    json_t *message_data = json_loads(message_payload, 0, &error);
-    if (!message_data) {
-        free(message_payload);
+    // Written straight into a pooled buffer, which curl sends as-is
+    json_buf_t payload;
+    payload_buf_acquire(&payload);
+    if (!build_interaction_response_payload(&payload, 4, message)) { // CHANNEL_MESSAGE_WITH_SOURCE
+        payload_buf_release(&payload);
         return;
     }
     
-    // Create the interaction response wrapper
-    json_t *response = json_object();
-    json_object_set_new(response, "type", json_integer(4)); // CHANNEL_MESSAGE_WITH_SOURCE
-    json_object_set_new(response, "data", message_data); // Use the complete message data!
+    // Interaction callbacks are authenticated by the token in the URL. The request
+    // is queued, so the gateway thread never waits on the HTTPS round trip.
+    rest_submit_payload(bot, "POST", url, &payload, false, NULL, NULL);
+}
+
+// Replay a gateway capture through the receive path. Each shard in the capture
+// gets a private, connectionless gateway; wsi is NULL throughout, so anything
+// that would write to Discord (heartbeats, IDENTIFY, reconnects) is skipped.
+int discord_replay_capture(discord_bot_t *bot, const char *path, bool realtime, discord_replay_stats_t *stats) {
+    if (!bot || !path) return 0;
+    
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open gateway capture %s\n", path);
+        return 0;
+    }
+    
+    // Load the whole capture so the replay measures decoding, not disk reads
+    unsigned char *data = NULL;
+    long size = -1;
+    if (fseek(file, 0, SEEK_END) == 0 && (size = ftell(file)) >= CAPTURE_HEADER_SIZE &&
+        fseek(file, 0, SEEK_SET) == 0 && (data = malloc((size_t)size))) {
+        if (fread(data, (size_t)size, 1, file) != 1) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(file);
+    if (!data || memcmp(data, CAPTURE_MAGIC, 4) != 0 || get_le(data + 4, 4) != CAPTURE_VERSION) {
+        fprintf(stderr, "%s is not a gateway capture\n", path);
+        free(data);
+        return 0;
+    }
     
-    // Add ephemeral flag if needed (this goes in the data object)
-    if (message->ephemeral) {
-        json_object_set_new(message_data, "flags", json_integer(64)); // EPHEMERAL flag
+    // Validate the records and find the highest shard id
+    int shard_count = 0;
+    size_t offset = CAPTURE_HEADER_SIZE;
+    while (offset + CAPTURE_RECORD_SIZE <= (size_t)size) {
+        size_t len = (size_t)get_le(data + offset + 12, 4);
+        int shard_id = (int)get_le(data + offset + 8, 2);
+        if (len > (size_t)size - offset - CAPTURE_RECORD_SIZE) break;
+        if (shard_id >= shard_count) shard_count = shard_id + 1;
+        offset += CAPTURE_RECORD_SIZE + len;
+    }
+    if (offset != (size_t)size) {
+        fprintf(stderr, "Gateway capture %s is truncated; replaying the complete records\n", path);
     }
+    size_t end = offset;
     
-    char *response_str = json_dumps(response, 0);
-    json_decref(response);
-    free(message_payload);
+    discord_gateway_t *shards = calloc(shard_count > 0 ? (size_t)shard_count : 1, sizeof(discord_gateway_t));
+    bool workers_started = !bot->workers;
+    if (!shards || !command_index_build(bot) || (workers_started && !worker_pool_start(bot))) {
+        free(shards);
+        free(data);
+        return 0;
+    }
+    for (int i = 0; i < shard_count; i++) {
+        shards[i].bot = bot;
+        shards[i].shard_id = i;
+        shards[i].sequence = -1;
+        shards[i].latency_ms = -1;
+    }
     
-    if (!response_str) return;
+    uint64_t messages_before = atomic_load_explicit(&bot->metrics->frames_received, memory_order_relaxed);
+    discord_replay_stats_t result = {0};
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t start_ns = monotonic_ns();
     
-    struct curl_slist *headers = NULL;
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+    for (offset = CAPTURE_HEADER_SIZE; offset < end; ) {
+        const unsigned char *record = data + offset;
+        uint64_t at_ns = get_le(record, 8);
+        discord_gateway_t *gw = &shards[get_le(record + 8, 2)];
+        uint8_t flags = record[10];
+        size_t len = (size_t)get_le(record + 12, 4);
+        const unsigned char *payload = record + CAPTURE_RECORD_SIZE;
+        offset += CAPTURE_RECORD_SIZE + len;
+        
+        if (realtime) {
+            struct timespec due = start;
+            uint64_t nsec = (uint64_t)due.tv_nsec + at_ns;
+            due.tv_sec += (time_t)(nsec / 1000000000ULL);
+            due.tv_nsec = (long)(nsec % 1000000000ULL);
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {}
+        }
+        
+        if (flags & CAPTURE_CONNECT) {
+            // Same reset as LWS_CALLBACK_CLIENT_ESTABLISHED
+            gw->rx_len = 0;
+            gw->compress = flags & CAPTURE_COMPRESSED;
+            if (gw->compress) gateway_inflate_reset(gw);
+            continue;
+        }
+        
+        result.records++;
+        result.bytes += len;
+        metrics_count(&bot->metrics->bytes_received, len);
+        if (flags & CAPTURE_COMPRESSED) {
+            // A capture started mid-connection has no zlib context to continue
+            if (!gw->inflate_ready) continue;
+            gateway_receive_compressed(bot, gw, NULL, payload, len);
+        } else {
+            gateway_receive_fragment(bot, gw, NULL, (const char *)payload, len, flags & CAPTURE_FINAL);
+        }
+    }
     
-    curl_easy_setopt(bot->curl, CURLOPT_URL, url);
-    curl_easy_setopt(bot->curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(bot->curl, CURLOPT_POSTFIELDS, response_str);
-    curl_easy_setopt(bot->curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(bot->curl, CURLOPT_POST, 1L);
+    // Let queued handlers finish so their work is part of the run
+    if (workers_started) worker_pool_stop(bot);
+    result.elapsed_ns = monotonic_ns() - start_ns;
+    result.messages = atomic_load_explicit(&bot->metrics->frames_received, memory_order_relaxed) - messages_before;
     
-    CURLcode res = curl_easy_perform(bot->curl);
-    if (res != CURLE_OK) {
-        fprintf(stderr, "Failed to send interaction response: %s\n", curl_easy_strerror(res));
+    for (int i = 0; i < shard_count; i++) {
+        gateway_inflate_end(&shards[i]);
+        od_doc_free(shards[i].od);
     }
+    free(shards);
+    free(data);
     
-    curl_slist_free_all(headers);
-    free(response_str);
-    curl_easy_reset(bot->curl);
+    if (stats) *stats = result;
+    return 1;
 }
 
 // Start the bot
 int discord_start_bot(discord_bot_t *bot) {
     if (!bot) return 0;
     
-    bot->should_stop = 0;
+    atomic_store(&bot->should_stop, 0);
+    
+    // Build the dispatch index once, now that every command (and its ID) is known
+    if (!command_index_build(bot)) {
+        return 0;
+    }
+    
+    // Get the correct Gateway URL and shard recommendation first
+    if (!discord_get_gateway_url(bot) && !bot->gateway_url_pinned) {
+        printf("Warning: Using fallback Gateway URL\n");
+        // Fallback to hardcoded URL if API call fails
+        if (bot->gateway_url) {
+            free(bot->gateway_url);
+        }
+        bot->gateway_url = strdup(DISCORD_GATEWAY_URL);
+    }
+    
+    if (!gateway_shards_init(bot)) {
+        return 0;
+    }
     
-    if (pthread_create(&bot->gateway_thread, NULL, gateway_thread_func, bot) != 0) {
+    // Handlers run here, off the gateway threads
+    if (!worker_pool_start(bot)) {
         return 0;
     }
     
+    for (int i = 0; i < bot->gateway_thread_count; i++) {
+        discord_gateway_thread_t *thread = &bot->gateway_threads[i];
+        thread->bot = bot;
+        thread->index = i;
+        
+        thread->context = gateway_context_create(bot, i == 0);
+        if (!thread->context || pthread_create(&thread->thread, NULL, gateway_thread_func, thread) != 0) {
+            discord_stop_bot(bot);
+            return 0;
+        }
+        thread->started = true;
+    }
+    
     return 1;
 }
 
@@ -820,9 +6977,37 @@ int discord_start_bot(discord_bot_t *bot) {
 void discord_stop_bot(discord_bot_t *bot) {
     if (!bot) return;
     
-    bot->should_stop = 1;
+    atomic_store(&bot->should_stop, 1);
+    
+    // Wake every service loop so it sees should_stop
+    for (int i = 0; i < bot->gateway_thread_count; i++) {
+        if (bot->gateway_threads[i].context) {
+            lws_cancel_service(bot->gateway_threads[i].context);
+        }
+    }
+    
+    for (int i = 0; i < bot->gateway_thread_count; i++) {
+        if (bot->gateway_threads[i].started) {
+            pthread_join(bot->gateway_threads[i].thread, NULL);
+            bot->gateway_threads[i].started = false;
+        }
+    }
     
-    if (bot->gateway_thread) {
-        pthread_join(bot->gateway_thread, NULL);
+    // Destroyed here rather than by the threads, so the wakeup above never races
+    // a thread that left its loop on its own. The first context did the global
+    // TLS setup, so it goes last.
+    for (int i = bot->gateway_thread_count - 1; i >= 0; i--) {
+        discord_gateway_thread_t *thread = &bot->gateway_threads[i];
+        if (thread->context) {
+            lws_context_destroy(thread->context);
+            thread->context = NULL;
+        }
+        for (int j = i; j < bot->shard_count; j += bot->gateway_thread_count) {
+            bot->shards[j].wsi = NULL;
+            bot->shards[j].context = NULL;
+        }
     }
+    
+    // No new interactions can arrive now; let queued handlers finish
+    worker_pool_stop(bot);
 }
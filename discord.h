@@ -6,16 +6,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <curl/curl.h>
 #include <jansson.h>
 #include <libwebsockets.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 #include <time.h>
+#include <zlib.h>
 
-#define MAX_COMMANDS 200
 #define MAX_RESPONSE_SIZE 4096
 #define MAX_EMBED_FIELDS 10
+#define REST_EASY_POOL_SIZE 32      // Idle easy handles kept for reuse
+
+// Default endpoints; DISCORD_API_BASE_URL and DISCORD_GATEWAY_URL in the
+// environment override them at init
+#define DISCORD_API_BASE_URL "https://discord.com/api/v10"
+#define DISCORD_GATEWAY_URL "wss://gateway.discord.gg/?v=10&encoding=json"
 
 // Function pointer type for command handlers
 
@@ -29,6 +37,7 @@ typedef struct {
     char *footer_url;
     unsigned int color; // Hex color code
     time_t timestamp;
+    struct discord_arena *arena;    // Interaction arena it was allocated from and is freed with, NULL on the heap
 } discord_embed_t;
 
 // Message structure
@@ -36,15 +45,194 @@ typedef struct {
     char *content;
     bool ephemeral;
     discord_embed_t *embed; // Can be NULL if no embed
+    struct discord_arena *arena;    // Interaction arena it was allocated from and is freed with, NULL on the heap
 } discord_message_t;
 
-typedef discord_message_t* (*command_handler_t)(void);
+typedef struct discord_bot discord_bot_t;
+
+// Read-only view of a string inside a received gateway frame (not NUL-terminated
+// in general; valid only while the handler runs)
+typedef struct {
+    const char *ptr;
+    size_t len;
+} discord_str_t;
+
+// Application command option types
+typedef enum {
+    DISCORD_OPTION_SUB_COMMAND = 1,
+    DISCORD_OPTION_SUB_COMMAND_GROUP = 2,
+    DISCORD_OPTION_STRING = 3,
+    DISCORD_OPTION_INTEGER = 4,
+    DISCORD_OPTION_BOOLEAN = 5,
+    DISCORD_OPTION_USER = 6,
+    DISCORD_OPTION_CHANNEL = 7,
+    DISCORD_OPTION_ROLE = 8,
+    DISCORD_OPTION_MENTIONABLE = 9,
+    DISCORD_OPTION_NUMBER = 10,
+    DISCORD_OPTION_ATTACHMENT = 11
+} discord_option_type_t;
+
+// A decoded command option. Only the member matching type is meaningful; USER,
+// CHANNEL, ROLE, MENTIONABLE and ATTACHMENT options carry a snowflake.
+typedef struct {
+    discord_str_t name;
+    discord_option_type_t type;
+    discord_str_t string;
+    int64_t integer;
+    double number;
+    bool boolean;
+    uint64_t snowflake;
+} discord_option_t;
+
+// Interaction passed to command handlers. Views point into the gateway frame,
+// which stays referenced until the handler returns; nothing is copied.
+typedef struct {
+    discord_bot_t *bot;
+    uint64_t id;
+    uint64_t application_id;
+    uint64_t command_id;
+    uint64_t guild_id;          // 0 in DMs
+    uint64_t channel_id;
+    uint64_t user_id;
+    discord_str_t token;
+    discord_str_t command_name;
+    discord_str_t user_name;
+    discord_str_t locale;
+    const void *frame_data;     // Internal: the interaction's "data" object
+} discord_interaction_t;
+
+typedef discord_message_t* (*command_handler_t)(const discord_interaction_t *ctx);
+
+// Gateway dispatch events (the "t" field of opcode 0)
+typedef enum {
+    DISCORD_EVENT_READY = 0,
+    DISCORD_EVENT_RESUMED,
+    DISCORD_EVENT_APPLICATION_COMMAND_PERMISSIONS_UPDATE,
+    DISCORD_EVENT_AUTO_MODERATION_RULE_CREATE,
+    DISCORD_EVENT_AUTO_MODERATION_RULE_UPDATE,
+    DISCORD_EVENT_AUTO_MODERATION_RULE_DELETE,
+    DISCORD_EVENT_AUTO_MODERATION_ACTION_EXECUTION,
+    DISCORD_EVENT_CHANNEL_CREATE,
+    DISCORD_EVENT_CHANNEL_UPDATE,
+    DISCORD_EVENT_CHANNEL_DELETE,
+    DISCORD_EVENT_CHANNEL_PINS_UPDATE,
+    DISCORD_EVENT_THREAD_CREATE,
+    DISCORD_EVENT_THREAD_UPDATE,
+    DISCORD_EVENT_THREAD_DELETE,
+    DISCORD_EVENT_THREAD_LIST_SYNC,
+    DISCORD_EVENT_THREAD_MEMBER_UPDATE,
+    DISCORD_EVENT_THREAD_MEMBERS_UPDATE,
+    DISCORD_EVENT_ENTITLEMENT_CREATE,
+    DISCORD_EVENT_ENTITLEMENT_UPDATE,
+    DISCORD_EVENT_ENTITLEMENT_DELETE,
+    DISCORD_EVENT_GUILD_CREATE,
+    DISCORD_EVENT_GUILD_UPDATE,
+    DISCORD_EVENT_GUILD_DELETE,
+    DISCORD_EVENT_GUILD_AUDIT_LOG_ENTRY_CREATE,
+    DISCORD_EVENT_GUILD_BAN_ADD,
+    DISCORD_EVENT_GUILD_BAN_REMOVE,
+    DISCORD_EVENT_GUILD_EMOJIS_UPDATE,
+    DISCORD_EVENT_GUILD_STICKERS_UPDATE,
+    DISCORD_EVENT_GUILD_INTEGRATIONS_UPDATE,
+    DISCORD_EVENT_GUILD_MEMBER_ADD,
+    DISCORD_EVENT_GUILD_MEMBER_REMOVE,
+    DISCORD_EVENT_GUILD_MEMBER_UPDATE,
+    DISCORD_EVENT_GUILD_MEMBERS_CHUNK,
+    DISCORD_EVENT_GUILD_ROLE_CREATE,
+    DISCORD_EVENT_GUILD_ROLE_UPDATE,
+    DISCORD_EVENT_GUILD_ROLE_DELETE,
+    DISCORD_EVENT_GUILD_SCHEDULED_EVENT_CREATE,
+    DISCORD_EVENT_GUILD_SCHEDULED_EVENT_UPDATE,
+    DISCORD_EVENT_GUILD_SCHEDULED_EVENT_DELETE,
+    DISCORD_EVENT_GUILD_SCHEDULED_EVENT_USER_ADD,
+    DISCORD_EVENT_GUILD_SCHEDULED_EVENT_USER_REMOVE,
+    DISCORD_EVENT_INTEGRATION_CREATE,
+    DISCORD_EVENT_INTEGRATION_UPDATE,
+    DISCORD_EVENT_INTEGRATION_DELETE,
+    DISCORD_EVENT_INTERACTION_CREATE,
+    DISCORD_EVENT_INVITE_CREATE,
+    DISCORD_EVENT_INVITE_DELETE,
+    DISCORD_EVENT_MESSAGE_CREATE,
+    DISCORD_EVENT_MESSAGE_UPDATE,
+    DISCORD_EVENT_MESSAGE_DELETE,
+    DISCORD_EVENT_MESSAGE_DELETE_BULK,
+    DISCORD_EVENT_MESSAGE_REACTION_ADD,
+    DISCORD_EVENT_MESSAGE_REACTION_REMOVE,
+    DISCORD_EVENT_MESSAGE_REACTION_REMOVE_ALL,
+    DISCORD_EVENT_MESSAGE_REACTION_REMOVE_EMOJI,
+    DISCORD_EVENT_MESSAGE_POLL_VOTE_ADD,
+    DISCORD_EVENT_MESSAGE_POLL_VOTE_REMOVE,
+    DISCORD_EVENT_PRESENCE_UPDATE,
+    DISCORD_EVENT_STAGE_INSTANCE_CREATE,
+    DISCORD_EVENT_STAGE_INSTANCE_UPDATE,
+    DISCORD_EVENT_STAGE_INSTANCE_DELETE,
+    DISCORD_EVENT_TYPING_START,
+    DISCORD_EVENT_USER_UPDATE,
+    DISCORD_EVENT_VOICE_STATE_UPDATE,
+    DISCORD_EVENT_VOICE_SERVER_UPDATE,
+    DISCORD_EVENT_WEBHOOKS_UPDATE,
+    DISCORD_EVENT_COUNT,
+    DISCORD_EVENT_UNKNOWN = -1
+} discord_event_t;
+
+// Gateway intents (IDENTIFY "intents" bit flags)
+typedef enum {
+    DISCORD_INTENT_GUILDS = 1 << 0,
+    DISCORD_INTENT_GUILD_MEMBERS = 1 << 1,              // Privileged
+    DISCORD_INTENT_GUILD_MODERATION = 1 << 2,
+    DISCORD_INTENT_GUILD_EMOJIS_AND_STICKERS = 1 << 3,
+    DISCORD_INTENT_GUILD_INTEGRATIONS = 1 << 4,
+    DISCORD_INTENT_GUILD_WEBHOOKS = 1 << 5,
+    DISCORD_INTENT_GUILD_INVITES = 1 << 6,
+    DISCORD_INTENT_GUILD_VOICE_STATES = 1 << 7,
+    DISCORD_INTENT_GUILD_PRESENCES = 1 << 8,            // Privileged
+    DISCORD_INTENT_GUILD_MESSAGES = 1 << 9,
+    DISCORD_INTENT_GUILD_MESSAGE_REACTIONS = 1 << 10,
+    DISCORD_INTENT_GUILD_MESSAGE_TYPING = 1 << 11,
+    DISCORD_INTENT_DIRECT_MESSAGES = 1 << 12,
+    DISCORD_INTENT_DIRECT_MESSAGE_REACTIONS = 1 << 13,
+    DISCORD_INTENT_DIRECT_MESSAGE_TYPING = 1 << 14,
+    DISCORD_INTENT_MESSAGE_CONTENT = 1 << 15,           // Privileged
+    DISCORD_INTENT_GUILD_SCHEDULED_EVENTS = 1 << 16,
+    DISCORD_INTENT_AUTO_MODERATION_CONFIGURATION = 1 << 20,
+    DISCORD_INTENT_AUTO_MODERATION_EXECUTION = 1 << 21,
+    DISCORD_INTENT_GUILD_MESSAGE_POLLS = 1 << 24,
+    DISCORD_INTENT_DIRECT_MESSAGE_POLLS = 1 << 25
+} discord_intent_t;
+
+// A received dispatch event. data is the event's "d" object, borrowed for the
+// duration of the callback.
+typedef struct {
+    discord_event_t type;
+    const char *name;
+    int shard_id;
+    json_t *data;
+} discord_event_info_t;
+
+// Event callback, invoked on the gateway thread of the shard that received it;
+// long-running work should be handed off
+typedef void (*discord_event_callback_t)(discord_bot_t *bot, const discord_event_info_t *event, void *userdata);
+
+typedef struct {
+    discord_event_callback_t callback;
+    void *userdata;
+} discord_event_handler_t;
+
+// Pending reply of an asynchronous command, fulfilled with discord_deferred_complete
+typedef struct discord_deferred discord_deferred_t;
+
+// Asynchronous handler: returns right away and completes the reply later, from any
+// thread. ctx stays valid until the reply is completed.
+typedef void (*command_async_handler_t)(const discord_interaction_t *ctx, discord_deferred_t *deferred);
 
 // Slash command structure
 typedef struct {
     char *name;
     char *description;
     command_handler_t handler;
+    command_async_handler_t async_handler;  // Set instead of handler for async commands
+    uint64_t id;        // Command ID assigned by Discord at registration (0 if unknown)
+    uint64_t name_hash;
 } slash_command_t;
 
 typedef struct {
@@ -52,30 +240,324 @@ typedef struct {
     size_t size;
 } response_buffer_t;
 
+// Result of an asynchronous REST request, handed to its completion callback
+typedef struct {
+    CURLcode result;    // Transport result (CURLE_OK if a response was received)
+    long status;        // HTTP status code, 0 if no response
+    const char *body;   // Response body (NUL-terminated), may be NULL
+    size_t body_len;
+} discord_rest_response_t;
+
+// Completion callback, invoked on the REST I/O thread
+typedef void (*discord_rest_callback_t)(discord_bot_t *bot, const discord_rest_response_t *response, void *userdata);
+
+typedef struct discord_rest_request discord_rest_request_t;
+typedef struct discord_ratelimiter discord_ratelimiter_t;
+typedef struct discord_command_index discord_command_index_t;
+typedef struct discord_worker_pool discord_worker_pool_t;
+typedef struct discord_arena discord_arena_t;
+typedef struct discord_rest_timer discord_rest_timer_t;
+typedef struct discord_cache discord_cache_t;
+typedef struct discord_od_doc discord_od_doc_t;
+typedef struct discord_metrics discord_metrics_t;
+typedef struct discord_capture discord_capture_t;
+typedef struct discord_gateway_tx discord_gateway_tx_t;
+
+// Result of replaying a gateway capture
+typedef struct {
+    uint64_t records;           // Receive callbacks fed to the decoder
+    uint64_t messages;          // Complete gateway messages decoded
+    uint64_t bytes;             // Raw bytes as received (compressed if the capture is)
+    uint64_t elapsed_ns;
+} discord_replay_stats_t;
+
+// Entity cache configuration. Limits cap each table (0 = unlimited); beyond a
+// limit the least recently used records are evicted.
+typedef struct {
+    size_t max_guilds;
+    size_t max_channels;
+    size_t max_roles;
+    size_t max_members;
+    bool members;               // Cache members (requires the privileged GUILD_MEMBERS intent)
+} discord_cache_config_t;
+
+// Cache lookups copy the record out, so results stay valid after the call.
+// Names longer than their field are cut at a UTF-8 codepoint boundary.
+#define DISCORD_CACHE_MEMBER_ROLES 32
+
+typedef struct {
+    uint64_t id;
+    uint64_t owner_id;
+    int member_count;
+    char name[101];
+} discord_cached_guild_t;
+
+typedef struct {
+    uint64_t id;
+    uint64_t guild_id;          // 0 for DM channels
+    uint64_t parent_id;         // Category or thread parent, 0 if none
+    int type;
+    int position;
+    char name[101];
+} discord_cached_channel_t;
+
+typedef struct {
+    uint64_t id;
+    uint64_t guild_id;
+    uint64_t permissions;
+    uint32_t color;
+    int position;
+    char name[101];
+} discord_cached_role_t;
+
+typedef struct {
+    uint64_t guild_id;
+    uint64_t user_id;
+    char username[33];
+    char nick[33];              // Empty if none
+    int role_count;             // Total; only the first DISCORD_CACHE_MEMBER_ROLES are copied
+    uint64_t roles[DISCORD_CACHE_MEMBER_ROLES];
+} discord_cached_member_t;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    size_t limit;
+    size_t bytes;               // Slot array size
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} discord_cache_table_stats_t;
+
+// Memory report of the entity cache
+typedef struct {
+    discord_cache_table_stats_t guilds;
+    discord_cache_table_stats_t channels;
+    discord_cache_table_stats_t roles;
+    discord_cache_table_stats_t members;
+    size_t strings;             // Distinct interned strings
+    size_t string_bytes;
+    size_t role_list_bytes;     // Member role lists
+    size_t retired_bytes;       // Replaced memory still visible to an active lookup
+    size_t total_bytes;
+} discord_cache_stats_t;
+
+// Summary of a latency histogram. Values are nanoseconds (queue depths are
+// plain counts); quantiles are accurate to within 6.25%.
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t p999;
+} discord_histogram_stats_t;
+
+// Bot-wide counters and latency distributions
+typedef struct {
+    uint64_t frames_received;       // Complete gateway messages
+    uint64_t bytes_received;        // Gateway bytes on the wire (compressed, if enabled)
+    uint64_t frames_dropped;        // Dispatches nobody consumes, dropped before parsing
+    uint64_t rest_requests;         // Completed REST requests
+    uint64_t rest_errors;           // REST requests that failed in transport
+    uint64_t rate_limited;          // 429 responses, including retried ones
+    uint64_t reconnects;            // Gateway reconnects scheduled
+    discord_histogram_stats_t heartbeat_rtt;
+    discord_histogram_stats_t decode;              // Indexing or parsing one gateway frame
+    discord_histogram_stats_t handler;             // Command handler start to reply issued
+    discord_histogram_stats_t rest;                // REST submission to completion
+    discord_histogram_stats_t worker_queue_depth;  // Sampled at each handler job submission
+    discord_histogram_stats_t rest_queue_depth;    // Sampled as requests enter their buckets
+} discord_metrics_snapshot_t;
+
+// Latency of one route ("POST /channels/:id/messages") or command
+typedef struct {
+    char label[128];
+    discord_histogram_stats_t latency;
+} discord_labelled_stats_t;
+
+// Per-bucket rate-limit statistics
+typedef struct {
+    char bucket[64];            // Discord bucket hash, or the route for buckets not yet identified
+    char route[128];            // First route seen in this bucket, e.g. "POST /channels/:id/messages"
+    int limit;                  // -1 if not yet known
+    int remaining;
+    int queued;                 // Requests currently waiting for the bucket
+    uint64_t requests;          // Requests started
+    uint64_t delayed;           // Requests that had to wait for the bucket or global limit
+    uint64_t total_wait_ms;     // Summed queue wait of delayed requests
+    uint64_t max_wait_ms;
+    uint64_t rate_limited;      // 429 responses
+} discord_ratelimit_stats_t;
+
+typedef struct {
+    int bucket_count;
+    int queued;
+    uint64_t global_delayed;        // Times the global 50 req/s limit held a request back
+    uint64_t global_rate_limited;   // Global 429 responses
+    uint64_t invalid_requests;      // 401/403/429 responses in the current 10 minute window
+} discord_ratelimit_global_t;
+
+// Gateway frame decoders. The on-demand decoder indexes each frame with SIMD
+// and reads only the fields it needs, handing anything else to jansson.
+typedef enum {
+    DISCORD_DECODER_ONDEMAND,
+    DISCORD_DECODER_JANSSON
+} discord_decoder_t;
+
+// Per-shard gateway connection state
 typedef struct {
+    discord_bot_t *bot;
+    int shard_id;
+    struct lws_context *context;    // Service loop that owns this shard
+    struct lws *wsi;                // NULL while disconnected
+    
+    // Session state, kept across reconnects so the session can be resumed
+    int64_t sequence;               // Last dispatch sequence number, -1 if none
+    char session_id[128];           // Empty when there is no session to resume
+    char resume_gateway_url[256];
+    
+    // Connection lifecycle
+    bool close_requested;
+    bool fatal;                     // Closed with a non-recoverable code
+    int reconnect_attempts;
+    int64_t reconnect_delay_ms;     // Forced delay for the next reconnect (INVALID_SESSION)
+    int64_t next_connect_ms;
+    uint64_t reconnects;
+    bool identify_due;              // Identify concurrency bucket opened, send on writeable
+    
+    // Timers on the owning service loop (lws sorted-usec lists)
+    lws_sorted_usec_list_t sul_heartbeat;
+    lws_sorted_usec_list_t sul_identify;
+    lws_sorted_usec_list_t sul_connect;
+    lws_sorted_usec_list_t sul_tx;      // Send rate limit window reopens
+    
+    // Heartbeat and latency (latency fields guarded by the bot's latency_mutex)
+    int heartbeat_interval;         // Milliseconds, from HELLO
+    bool heartbeat_due;
+    lws_usec_t heartbeat_sent_us;
+    int heartbeat_acked;
+    long latency_ms;                // -1 until the first ACK
+    
+    // zlib-stream transport compression
+    bool compress;
+    bool inflate_ready;
+    z_stream inflate;               // Persistent for the lifetime of the connection
+    unsigned char *zbuf;            // Compressed bytes awaiting the Z_SYNC_FLUSH suffix
+    size_t zbuf_len;
+    size_t zbuf_cap;
+    char *inflated;                 // Reused output buffer
+    size_t inflated_cap;
+    
+    // Receive accumulator for fragmented frames, reused across messages
+    char *rx_buf;
+    size_t rx_len;
+    size_t rx_cap;
+    
+    // On-demand decoder index, reused across messages
+    discord_od_doc_t *od;
+    
+    // Outbound frame queue, drained from LWS_CALLBACK_CLIENT_WRITEABLE
+    discord_gateway_tx_t *tx;
+} discord_gateway_t;
+
+// A gateway service thread; shard i runs on thread i % gateway_thread_count
+typedef struct {
+    discord_bot_t *bot;
+    int index;
+    struct lws_context *context;
+    pthread_t thread;
+    bool started;
+} discord_gateway_thread_t;
+
+struct discord_bot {
     char *token;
+    char *api_base_url;                 // REST base, without a trailing '/'
     char *gateway_url;
+    bool gateway_url_pinned;            // Configured; /gateway/bot does not replace it
     char *application_id;
-    CURL *curl;
     
-    // Slash commands
-    slash_command_t commands[MAX_COMMANDS];
+    // Async REST engine (curl multi handle driven by a dedicated I/O thread)
+    CURLM *rest_multi;
+    pthread_t rest_thread;
+    pthread_mutex_t rest_mutex;                     // Guards rest_timers
+    _Atomic(discord_rest_request_t *) rest_queue;   // Lock-free submission stack, newest first
+    atomic_int rest_submitting;                     // Submitters between the running check and the push
+    atomic_int rest_running;
+    int rest_in_flight;
+    bool rest_dry_run;                      // Complete requests locally without sending them
+    CURLSH *rest_share;                     // DNS and TLS session cache shared by every transfer
+    CURL *rest_easy_pool[REST_EASY_POOL_SIZE];  // Idle easy handles for reuse
+    int rest_easy_pool_count;
+    int rest_keepalive_ms;                  // Idle time before a keepalive request, 0 = never
+    int64_t rest_last_activity_ms;
+    discord_ratelimiter_t *ratelimiter;     // Owned by the REST I/O thread
+    struct curl_slist *rest_headers[4];     // Shared header lists, indexed by REST_HEADERS_* flags
+    discord_rest_timer_t *rest_timers;      // Run on the I/O thread, sorted by due time
+    
+    // Slash commands. Records are allocated one by one and never move, so
+    // dispatch can hold on to them; the array is guarded by command_mutex.
+    slash_command_t **commands;
     int command_count;
+    int command_capacity;
+    pthread_mutex_t command_mutex;
+    
+    // Lock-free dispatch index (published by discord_start_bot, then again on every
+    // registration or sync); replaced indexes are kept until discord_cleanup
+    _Atomic(discord_command_index_t *) command_index;
+    discord_command_index_t *command_index_retired;
     
     // WebSocket related
-    struct lws_context *ws_context;
-    struct lws *ws_connection;
-    pthread_t gateway_thread;
-    int should_stop;
+    bool gateway_compress;
+    atomic_int should_stop;             // Set by discord_stop_bot, polled by the service threads
+    
+    // Shard manager
+    discord_gateway_t *shards;
+    int shard_count;
+    int shard_count_requested;          // 0 = Discord's recommendation
+    int recommended_shards;             // From /gateway/bot
+    discord_gateway_thread_t *gateway_threads;
+    int gateway_thread_count;
+    int gateway_thread_count_requested; // 0 = one per CPU
+    int max_concurrency;                // session_start_limit.max_concurrency
+    int64_t *identify_next_ms;          // Next allowed identify per concurrency bucket
+    pthread_mutex_t identify_mutex;
+    
+    // Handler worker pool
+    discord_worker_pool_t *workers;
+    int worker_count_requested;         // 0 = one per CPU
+    int worker_queue_depth;             // Total queued interactions, 0 = default (1024)
+    bool interaction_arenas;            // Allocate handler replies from a per-interaction arena
+    int defer_threshold_ms;             // Auto-ACK unanswered interactions after this, -1 = never
+    discord_deferred_t *deferreds;      // Unfinished replies, detached by discord_cleanup (registry lock)
+    int deferred_completing;            // Completions still using the bot (registry lock)
+    
+    // Entity cache, NULL unless enabled
+    discord_cache_t *cache;
+    
+    // Event subscriptions (discord_on), one callback array per event type
+    discord_event_handler_t *event_handlers[DISCORD_EVENT_COUNT];
+    int event_handler_count[DISCORD_EVENT_COUNT];
+    
+    // Gateway intents: derived from subscriptions and the cache unless set explicitly
+    uint32_t intents;
+    uint32_t intents_extra;             // Always added to the derived set
+    bool intents_explicit;
+    
+    // Gateway frame decoder
+    discord_decoder_t gateway_decoder;
+    
+    // Always-on counters and histograms
+    discord_metrics_t *metrics;
+    
+    // Gateway traffic recorder, NULL unless capturing
+    discord_capture_t *capture;
     
     // Latency tracking
-    struct timeval last_heartbeat_sent;
-    struct timeval last_heartbeat_ack;
-    int heartbeat_acked;
-    int heartbeat_interval;
-    long gateway_latency_ms;
     pthread_mutex_t latency_mutex;
-} discord_bot_t;
+};
 
 // Initialize the bot with a token
 discord_bot_t* discord_init(const char *token);
@@ -100,7 +582,30 @@ void discord_set_embed_thumbnail(discord_embed_t *embed, const char *thumbnail);
 void discord_message_set_embed(discord_message_t *message, discord_embed_t *embed);
 // Command management (separated from handling)
 int discord_register_slash_command(discord_bot_t *bot, const char *name, const char *description, command_handler_t handler);
+// Registration reads the existing commands once and skips the update when nothing
+// changed; otherwise the whole set is applied with a single bulk overwrite
 int discord_register_all_commands(discord_bot_t *bot);
+int discord_register_guild_commands(discord_bot_t *bot, const char *guild_id);
+// Register a command whose handler completes its reply asynchronously
+int discord_register_async_slash_command(discord_bot_t *bot, const char *name, const char *description,
+                                         command_async_handler_t handler);
+
+// Complete an interaction's reply from any thread, taking ownership of message.
+// If the interaction was already acknowledged as deferred, the original response
+// is edited; a NULL message then deletes it. If that ACK failed, or the bot has
+// since been cleaned up, the message is dropped.
+void discord_deferred_complete(discord_deferred_t *deferred, discord_message_t *message);
+
+// Make the deferred acknowledgement ephemeral (call before it is sent)
+void discord_deferred_set_ephemeral(discord_deferred_t *deferred, bool ephemeral);
+
+// Acknowledge interactions with a deferred response (type 5) when no reply is ready
+// after threshold_ms, well inside Discord's 3 second limit. Applies to synchronous
+// and asynchronous handlers; default 2000, -1 disables. A synchronous handler's
+// ACK is public; if its returned message is ephemeral, the reply is sent as an
+// ephemeral follow-up and the public placeholder is deleted.
+void discord_set_defer_threshold(discord_bot_t *bot, int threshold_ms);
+
 // Start the bot (connects to gateway and listens for commands)
 int discord_start_bot(discord_bot_t *bot);
 
@@ -116,9 +621,119 @@ void discord_send_interaction_response(discord_bot_t *bot, const char *interacti
 // Get application ID from token (helper function)
 int discord_get_application_id(discord_bot_t *bot);
 
-// Get current gateway latency in milliseconds
+// Point the bot at another REST or gateway host, e.g. a local mock server.
+// The gateway URL may be ws:// or wss://; once set, the one /gateway/bot
+// returns is ignored. Both can also come from the environment (see above).
+int discord_set_api_base_url(discord_bot_t *bot, const char *url);
+int discord_set_gateway_url(discord_bot_t *bot, const char *url);
+
+// Queue an asynchronous REST request. method is "GET", "POST", "PUT", "PATCH" or "DELETE";
+// body may be NULL and is copied. The bot token is sent unless authorize is false.
+// callback (may be NULL) runs on the REST I/O thread once the request completes.
+// This and every function that sends (discord_send_message, replies) may be called
+// from any number of threads at once: submission is a lock-free push, and only
+// the I/O thread touches curl.
+int discord_rest_submit(discord_bot_t *bot, const char *method, const char *url, const char *body,
+                        bool authorize, discord_rest_callback_t callback, void *userdata);
+
+// Snapshot rate-limit statistics. Fills up to max_buckets entries and returns how many
+// were written; global (may be NULL) receives bot-wide counters.
+int discord_get_ratelimit_stats(discord_bot_t *bot, discord_ratelimit_stats_t *buckets, int max_buckets,
+                                discord_ratelimit_global_t *global);
+
+// Snapshot counters and latency histograms
+int discord_get_metrics(discord_bot_t *bot, discord_metrics_snapshot_t *metrics);
+
+// Per-route REST latency and per-command handler latency. Fill up to max entries
+// and return how many were written.
+int discord_get_route_metrics(discord_bot_t *bot, discord_labelled_stats_t *routes, int max_routes);
+int discord_get_command_metrics(discord_bot_t *bot, discord_labelled_stats_t *commands, int max_commands);
+
+// Every metric in the Prometheus text format. The caller frees the string.
+char *discord_metrics_prometheus(discord_bot_t *bot);
+
+// Serve GET /metrics on 127.0.0.1:port from a background thread. Port 0 picks a
+// free port. Returns the bound port, or 0 on failure.
+int discord_enable_metrics_endpoint(discord_bot_t *bot, int port);
+
+// Enable zlib-stream transport compression on the gateway (off by default)
+void discord_set_gateway_compression(discord_bot_t *bot, bool enabled);
+
+// Configure sharding (call before discord_start_bot). shard_count 0 uses the count
+// Discord recommends; thread_count 0 runs one gateway service thread per CPU.
+void discord_set_sharding(discord_bot_t *bot, int shard_count, int thread_count);
+
+// Configure the command handler pool (call before discord_start_bot). Handlers run on
+// thread_count workers (0 = one per CPU); at most queue_depth interactions may wait.
+void discord_set_worker_pool(discord_bot_t *bot, int thread_count, int queue_depth);
+
+// Allocate messages, embeds and reply payloads created inside a command handler from
+// an arena scoped to that interaction, released in one step once the reply is sent
+// (off by default). Such messages must not be kept past the handler's interaction;
+// discord_destroy_message on them is a no-op.
+void discord_set_interaction_arena(discord_bot_t *bot, bool enabled);
+
+// Enable the entity cache (call before discord_start_bot). config may be NULL for
+// unlimited tables without members. Lookups never block on gateway updates and
+// may be called from any thread; they return 1 and fill out on a hit.
+int discord_enable_cache(discord_bot_t *bot, const discord_cache_config_t *config);
+int discord_cache_get_guild(discord_bot_t *bot, uint64_t guild_id, discord_cached_guild_t *out);
+int discord_cache_get_channel(discord_bot_t *bot, uint64_t channel_id, discord_cached_channel_t *out);
+int discord_cache_get_role(discord_bot_t *bot, uint64_t role_id, discord_cached_role_t *out);
+int discord_cache_get_member(discord_bot_t *bot, uint64_t guild_id, uint64_t user_id, discord_cached_member_t *out);
+int discord_cache_get_stats(discord_bot_t *bot, discord_cache_stats_t *stats);
+
+// Subscribe to a gateway dispatch event (call before discord_start_bot). Several
+// callbacks may be registered per event; they run in registration order.
+int discord_on(discord_bot_t *bot, discord_event_t event, discord_event_callback_t callback, void *userdata);
+
+// Gateway intents. By default the bot identifies with the intents its event
+// subscriptions and cache need; discord_add_intents adds flags to that set (e.g.
+// DISCORD_INTENT_MESSAGE_CONTENT), discord_set_intents replaces it outright.
+void discord_set_intents(discord_bot_t *bot, uint32_t intents);
+void discord_add_intents(discord_bot_t *bot, uint32_t intents);
+uint32_t discord_get_intents(discord_bot_t *bot);
+
+// Choose how gateway frames are decoded (default DISCORD_DECODER_ONDEMAND)
+void discord_set_gateway_decoder(discord_bot_t *bot, discord_decoder_t decoder);
+
+// Record every raw gateway receive, with its arrival time, to a capture file
+// (call before discord_start_bot and stop after discord_stop_bot; compressed
+// streams can only be replayed from the start of a connection). Setting
+// DISCORD_CAPTURE_FILE in the environment starts a capture at init.
+int discord_capture_start(discord_bot_t *bot, const char *path);
+void discord_capture_stop(discord_bot_t *bot);
+
+// Feed a capture through the gateway decode and dispatch path without a network,
+// as fast as possible or, with realtime, at the recorded pace. Commands and event
+// subscriptions run as they would live; pair with discord_set_rest_dry_run so
+// their replies go nowhere. Call instead of discord_start_bot; returns 1 on success.
+int discord_replay_capture(discord_bot_t *bot, const char *path, bool realtime, discord_replay_stats_t *stats);
+
+// Complete every REST request locally with an empty success response instead of
+// sending it. Also enabled by DISCORD_REST_DRY_RUN=1 in the environment.
+void discord_set_rest_dry_run(discord_bot_t *bot, bool enabled);
+
+// REST requests multiplex over a pooled HTTP/2 connection with shared DNS and TLS
+// session caches. After interval_ms without REST traffic (default 40000) a cheap
+// unauthenticated request keeps that connection warm, so a reply after a quiet
+// period doesn't pay for a new handshake; 0 disables it.
+void discord_set_rest_keepalive(discord_bot_t *bot, int interval_ms);
+
+// Name of an event as Discord sends it, e.g. "MESSAGE_CREATE"
+const char *discord_event_name(discord_event_t event);
+
+// Get current gateway latency in milliseconds (mean over shards)
 long discord_get_latency(discord_bot_t *bot);
+long discord_get_shard_latency(discord_bot_t *bot, int shard_id);
+
+// Number of options the invoked command was given (options of a subcommand are
+// counted in place of the subcommand itself)
+int discord_interaction_option_count(const discord_interaction_t *ctx);
 
-void discord_set_global_bot(discord_bot_t *bot);
+// Decode an option by name, or by position with discord_interaction_option_at.
+// Options are only decoded on request. Returns 1 if found.
+int discord_interaction_option(const discord_interaction_t *ctx, const char *name, discord_option_t *option);
+int discord_interaction_option_at(const discord_interaction_t *ctx, int index, discord_option_t *option);
 
 #endif
@@ -1,6 +1,7 @@
 #include "../discord.h"
 #include <signal.h>
 #include <unistd.h>
+#include <pthread.h>
 
 const char *bot_token = "YOUR_BOT_TOKEN_HERE";
 
@@ -17,42 +18,42 @@ void signal_handler(int sig) {
 }
 
 // Command handlers - these functions are called when slash commands are used
-discord_message_t* ping_command(void) {
-    // Get the global bot instance to check latency
-    long latency = discord_get_latency(g_bot);
+// The interaction context carries the bot, so handlers need no global state
+discord_message_t* ping_command(const discord_interaction_t *ctx) {
+    long latency = discord_get_latency(ctx->bot);
     
-    char *response = malloc(256);
+    char response[256];
     if (latency >= 0) {
-        snprintf(response, 256, "🏓 Pong! Gateway latency: %ldms", latency);
+        snprintf(response, sizeof(response), "🏓 Pong! Gateway latency: %ldms", latency);
     } else {
-        snprintf(response, 256, "🏓 Pong! (Latency unknown)");
+        snprintf(response, sizeof(response), "🏓 Pong! (Latency unknown)");
     }
     return discord_create_message(response, false);
 }
 
-discord_message_t* hello_command(void) {
-    char *response = malloc(256);
-    snprintf(response, 256, "👋 Hello there! I'm a Discord bot written in C!");
+discord_message_t* hello_command(const discord_interaction_t *ctx) {
+    char response[256];
+    snprintf(response, sizeof(response), "👋 Hello there, %.*s! I'm a Discord bot written in C!",
+             (int)ctx->user_name.len, ctx->user_name.ptr);
     return discord_create_message(response, false);
 }
 
-discord_message_t* time_command(void) {
+discord_message_t* time_command(const discord_interaction_t *ctx) {
+    (void)ctx;
     time_t now = time(NULL);
-    struct tm *local_time = localtime(&now);
+    struct tm local_time;
+    localtime_r(&now, &local_time);
     
-    char *response = malloc(256);
-    snprintf(response, 256, "🕐 Current server time: %s", asctime(local_time));
-    
-    // Remove trailing newline from asctime
-    char *newline = strchr(response, '\n');
-    if (newline) *newline = '\0';
+    char response[256];
+    strftime(response, sizeof(response), "🕐 Current server time: %a %b %d %H:%M:%S %Y", &local_time);
     
     return discord_create_message(response, false);
 }
 
-discord_message_t* info_command(void) {
-    char *response = malloc(512);
-    snprintf(response, 512, 
+discord_message_t* info_command(const discord_interaction_t *ctx) {
+    (void)ctx;
+    char response[512];
+    snprintf(response, sizeof(response), 
         "ℹ️ **Bot Information**\n"
         "• Language: C\n"
         "• Library: Custom Discord C Library\n"
@@ -63,7 +64,8 @@ discord_message_t* info_command(void) {
 
 
 
-discord_message_t* embed_demo_command(void) {
+discord_message_t* embed_demo_command(const discord_interaction_t *ctx) {
+    (void)ctx;
     discord_message_t *message = discord_create_message("", false);
     
     discord_embed_t *embed = discord_create_embed(
@@ -85,6 +87,28 @@ discord_message_t* embed_demo_command(void) {
     return message;
 }
 
+// Async commands return immediately and complete later from any thread. If the
+// reply takes longer than the defer threshold, the library acknowledges the
+// interaction first and the result then edits that response.
+static void* slow_command_worker(void *arg) {
+    discord_deferred_t *deferred = (discord_deferred_t *)arg;
+    
+    sleep(5); // Stand-in for a database lookup or rendering
+    
+    discord_deferred_complete(deferred, discord_create_message("🐢 Done! That took 5 seconds.", false));
+    return NULL;
+}
+
+void slow_command(const discord_interaction_t *ctx, discord_deferred_t *deferred) {
+    (void)ctx;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, slow_command_worker, deferred) != 0) {
+        discord_deferred_complete(deferred, discord_create_message("Could not start the job", true));
+        return;
+    }
+    pthread_detach(thread);
+}
+
 int main() { 
     
     
@@ -104,9 +128,6 @@ int main() {
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
     
-    // Set global bot instance for commands that need it
-    discord_set_global_bot(g_bot);
-    
     // Register slash commands
     printf("Registering slash commands...\n");
     discord_register_slash_command(g_bot, "ping", "Check bot latency", ping_command);
@@ -114,6 +135,7 @@ int main() {
     discord_register_slash_command(g_bot, "time", "Get current server time", time_command);
     discord_register_slash_command(g_bot, "info", "Get bot information", info_command);
     discord_register_slash_command(g_bot, "embed", "Demonstrate embed functionality", embed_demo_command);
+    discord_register_async_slash_command(g_bot, "slow", "Run a slow job in the background", slow_command);
     
     // Register commands with Discord API
     printf("Registering commands with Discord...\n");
@@ -137,9 +159,10 @@ int main() {
     printf("  /time  - Get current server time\n");
     printf("  /info  - Get bot information\n");
     printf("  /embed - See an embed example\n");
+    printf("  /slow  - Run a slow background job\n");
     
     // Keep the main thread alive
-    while (g_bot && !g_bot->should_stop) {
+    while (g_bot && !atomic_load(&g_bot->should_stop)) {
         sleep(1);
         
         // Display current latency every 30 seconds